@@ -66,7 +66,7 @@ if [ ! -f $K2FPID ] || [ ! -d /proc/$(cat $K2FPID) ]; then
   exit 1
 fi
 
-rm -rf $LIBDIR/*.history && rm -rf $LIBDIR/*.current
+rm -rf $LIBDIR/*.history && rm -rf $LIBDIR/*.current && rm -rf $LIBDIR/*.inode
 cp $CFGDIR/main.lua $CFGDIR/main.lua.backup
 sed -i -E "s|localhost:9092|$KAFKASERVER|g" $CFGDIR/main.lua
 $BUILDDIR/tail2kafka $CFGDIR; sleep 2
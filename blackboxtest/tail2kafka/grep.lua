@@ -4,3 +4,12 @@ autocreat = true
 grep     = function(fields)
   return {'[' .. fields[4] .. '] "' .. fields[5] .. '"', fields[6], fields[table.maxn(fields)]}
 end
+
+-- the same with ffi = true, fields are start,len pairs into line
+local ffi = require("ffi")
+grepFfi = function(line, nline, spans, nspans, out, nout)
+  local p = ffi.cast("const char *", line)
+  local s = ffi.cast("const uint32_t *", spans)
+  local field = function(i) return ffi.string(p + s[i*2], s[i*2+1]) end
+  return '[' .. field(3) .. '] "' .. field(4) .. '" ' .. field(5) .. ' ' .. field(nspans-1)
+end
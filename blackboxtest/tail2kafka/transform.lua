@@ -6,3 +6,30 @@ transform = function(line)
   if s == "[error]" then return line
   else return nil end
 end
+
+-- the same with ffi = true, a line longer than out comes back as a string
+local ffi = require("ffi")
+transformFfi = function(line, nline, spans, nspans, out, nout)
+  local p = ffi.cast("const char *", line)
+  if nline < 7 or ffi.string(p, 7) ~= "[error]" then return nil end
+  if nline > nout then return ffi.string(p, nline) end
+  ffi.copy(out, p, nline)
+  return nline
+end
+
+-- the same as transform_batch, results[i] is of lines[i], false to skip
+transformBatch = function(lines)
+  local results = {}
+  for i = 1, #lines do
+    results[i] = string.sub(lines[i], 1, 7) == "[error]" and lines[i]
+  end
+  return results
+end
+
+-- the same as transform, the mark line truncates the file under the scan as copytruncate does
+transformTruncate = function(line)
+  if line == "[error] truncate" then io.open("logs/transform.log", "w"):close() end
+  local s = string.sub(line, 1, 7);
+  if s == "[error]" then return line
+  else return nil end
+end
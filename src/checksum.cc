@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#endif
+
+#include "util.h"
+#include "checksum.h"
+
+#define CRC32C_POLY 0x82F63B78   // reflected Castagnoli
+
+Checksum::Algorithm Checksum::stringToAlgorithm(const char *s)
+{
+  if (strcasecmp(s, "none") == 0) return NONE;
+  else if (strcasecmp(s, "md5") == 0) return MD5;
+  else if (strcasecmp(s, "crc32c") == 0) return CRC32C;
+  else return NIL;
+}
+
+const char *Checksum::algorithmToString(Algorithm alg)
+{
+  if (alg == MD5) return "md5";
+  else if (alg == CRC32C) return "crc32c";
+  else return "none";
+}
+
+void Checksum::init(Algorithm alg)
+{
+  alg_ = alg;
+  final_ = false;
+  hex_.clear();
+
+  if (alg_ == MD5) MD5_Init(&md5Ctx_);
+  crc_ = 0;
+}
+
+void Checksum::update(const char *buffer, size_t n)
+{
+  if (alg_ == MD5) MD5_Update(&md5Ctx_, buffer, n);
+  else if (alg_ == CRC32C) crc_ = crc32c(crc_, buffer, n);
+}
+
+const std::string &Checksum::hex()
+{
+  if (final_) return hex_;
+  final_ = true;
+
+  if (alg_ == MD5) {
+    char md5[33] = "";
+    unsigned char digest[16];
+    MD5_Final(digest, &md5Ctx_);   // MD5_final can only be called once
+    util::binToHex(digest, 16, md5);
+    hex_.assign(md5, 32);
+  } else if (alg_ == CRC32C) {
+    char crc[9];
+    snprintf(crc, 9, "%08x", crc_);
+    hex_.assign(crc, 8);
+  }
+  return hex_;
+}
+
+typedef uint32_t (*Crc32cFunc)(uint32_t crc, const char *buffer, size_t n);
+
+/* slice-by-8, table[k][b] is the crc of byte b followed by k zero bytes */
+static uint32_t crc32cTable[8][256];
+
+static void initCrc32cTable()
+{
+  for (uint32_t b = 0; b < 256; ++b) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+    crc32cTable[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; ++b) {
+    for (int k = 1; k < 8; ++k) {
+      uint32_t crc = crc32cTable[k-1][b];
+      crc32cTable[k][b] = (crc >> 8) ^ crc32cTable[0][crc & 0xff];
+    }
+  }
+}
+
+static uint32_t crc32cScalar(uint32_t crc, const char *buffer, size_t n)
+{
+  const unsigned char *p = (const unsigned char *) buffer;
+  crc = ~crc;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;   // little endian
+    crc = crc32cTable[7][lo & 0xff] ^ crc32cTable[6][(lo >> 8) & 0xff] ^
+      crc32cTable[5][(lo >> 16) & 0xff] ^ crc32cTable[4][lo >> 24] ^
+      crc32cTable[3][hi & 0xff] ^ crc32cTable[2][(hi >> 8) & 0xff] ^
+      crc32cTable[1][(hi >> 16) & 0xff] ^ crc32cTable[0][hi >> 24];
+  }
+  for (; n > 0; --n, ++p) crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p) & 0xff];
+
+  return ~crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const char *buffer, size_t n)
+{
+  uint64_t crc64 = ~crc;
+  for (; n >= 8; n -= 8, buffer += 8) {
+    uint64_t v;
+    memcpy(&v, buffer, 8);
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+
+  uint32_t crc32 = (uint32_t) crc64;
+  for (; n > 0; --n, ++buffer) crc32 = _mm_crc32_u8(crc32, (unsigned char) *buffer);
+  return ~crc32;
+}
+#endif
+
+static const char *crc32cName = "scalar";
+
+static Crc32cFunc resolveCrc32c()
+{
+#ifdef CRC32C_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32cName = "sse4.2";
+    return crc32cSse42;
+  }
+#endif
+  initCrc32cTable();
+  return crc32cScalar;
+}
+
+static Crc32cFunc crc32cFunc = resolveCrc32c();
+
+uint32_t crc32c(uint32_t crc, const char *buffer, size_t n)
+{
+  return crc32cFunc(crc, buffer, n);
+}
+
+const char *crc32cImpl()
+{
+  return crc32cName;
+}
@@ -0,0 +1,43 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+
+/* running digest of the lines sent, goes into the END record of a file
+ * so the consumer can verify the file it rebuilt
+ */
+class Checksum {
+public:
+  enum Algorithm { NONE, MD5, CRC32C, NIL };
+  static Algorithm stringToAlgorithm(const char *s);
+  static const char *algorithmToString(Algorithm alg);
+
+  Checksum() : alg_(NONE), crc_(0), final_(false) {}
+
+  void init(Algorithm alg);
+  void update(const char *buffer, size_t n);
+
+  /* hex digest, the digest is finished at the first call */
+  const std::string &hex();
+
+  Algorithm algorithm() const { return alg_; }
+  const char *name() const { return algorithmToString(alg_); }
+
+private:
+  Algorithm   alg_;
+  MD5_CTX     md5Ctx_;
+  uint32_t    crc_;
+  bool        final_;
+  std::string hex_;
+};
+
+/* crc32c(Castagnoli) of buffer, continue from crc, crc32c(0, "123456789", 9) == 0xe3069283 */
+uint32_t crc32c(uint32_t crc, const char *buffer, size_t n);
+
+/* the implementation picked for this cpu, for logs and benchmarks */
+const char *crc32cImpl();
+
+#endif
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstring>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -10,7 +11,8 @@
 #define MAX_ENVP_NUM 511
 extern char **environ;
 
-char * const *CmdNotify::buildEnv(const char *file, const char *oriFile, time_t timestamp, uint64_t size, const char *md5)
+char * const *CmdNotify::buildEnv(const char *file, const char *oriFile, time_t timestamp, uint64_t size,
+                                  const char *checksum, const char *checksumAlg)
 {
   int i = 0;
   static char *envp[MAX_ENVP_NUM+1];
@@ -45,19 +47,31 @@ char * const *CmdNotify::buildEnv(const char *file, const char *oriFile, time_t
     envp[i++] = sizePtr;
   }
 
+  // NOTIFY_FILEMD5 as before, NOTIFY_FILECHECKSUM(ALG) for any algorithm
+  bool md5 = !checksumAlg || !*checksumAlg || strcmp(checksumAlg, "md5") == 0;
   static char md5Ptr[64];
-  if (md5) {
-    snprintf(md5Ptr, 64, "NOTIFY_FILEMD5=%s", md5);
+  if (checksum && md5) {
+    snprintf(md5Ptr, 64, "NOTIFY_FILEMD5=%s", checksum);
     envp[i++] = md5Ptr;
   }
 
+  static char checksumPtr[64];
+  static char checksumAlgPtr[64];
+  if (checksum && checksumAlg && *checksumAlg) {
+    snprintf(checksumPtr, 64, "NOTIFY_FILECHECKSUM=%s", checksum);
+    envp[i++] = checksumPtr;
+    snprintf(checksumAlgPtr, 64, "NOTIFY_FILECHECKSUMALG=%s", checksumAlg);
+    envp[i++] = checksumAlgPtr;
+  }
+
   for (int j = 0; i < MAX_ENVP_NUM && environ[j]; ++j) envp[i++] = environ[j];
 
   envp[i] = 0;
   return envp;
 }
 
-bool CmdNotify::exec(const char *file, const char *oriFile, time_t timestamp, uint64_t size, const char *md5)
+bool CmdNotify::exec(const char *file, const char *oriFile, time_t timestamp, uint64_t size,
+                     const char *checksum, const char *checksumAlg)
 {
   if (!cmd_) return false;
 
@@ -72,7 +86,7 @@ bool CmdNotify::exec(const char *file, const char *oriFile, time_t timestamp, ui
     }
 
     char * const argv[] = { (char *) cmd_, NULL };
-    char * const *envp = buildEnv(file, oriFile, timestamp, size, md5);
+    char * const *envp = buildEnv(file, oriFile, timestamp, size, checksum, checksumAlg);
 
     std::string buffer;
     for (int i = 0; envp[i]; ++i) buffer.append(envp[i]).append(1, ' ');
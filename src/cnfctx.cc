@@ -1,4 +1,8 @@
 #include <memory>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "logger.h"
 #include "sys.h"
@@ -6,6 +10,15 @@
 #include "luactx.h"
 #include "cnfctx.h"
 
+static void deleteLuaCtxs(LuaCtx *ctx)
+{
+  while (ctx) {
+    LuaCtx *next = ctx->next();
+    delete ctx;
+    ctx = next;
+  }
+}
+
 CnfCtx *CnfCtx::loadCnf(const char *dir, char *errbuf)
 {
   std::vector<std::string> luaFiles;
@@ -30,33 +43,17 @@ CnfCtx *CnfCtx::loadCnf(const char *dir, char *errbuf)
   return cnf;
 }
 
-inline bool initPipe(int *accept, int *server, char *errbuf)
-{
-  if (*accept != -1) close(*accept);
-  if (*server != -1) close(*server);
-
-  *accept = *server = -1;
-
-  int fd[2];
-  if (pipe(fd) == -1) {
-    snprintf(errbuf, MAX_ERR_LEN, "pipe error");
-    return false;
-  }
-
-  *accept = fd[0];
-  *server = fd[1];
-  return true;
-}
-
 bool CnfCtx::reset()
 {
+  dropGlobFiles();
   for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
     LuaCtx *ctx = *ite;
     if (!ctx->testFile(ctx->file().c_str(), errbuf_)) return false;
     if (!ctx->loadHistoryFile()) return false;
   }
 
-  if (!initPipe(&accept, &server, errbuf_)) return false;
+  if (!queue.init(errbuf_)) return false;
+  if (!initWakeFd(errbuf_)) return false;
   return true;
 }
 
@@ -94,6 +91,33 @@ CnfCtx *CnfCtx::loadFile(const char *file, char *errbuf)
 
   if (!helper->getInt("partition", &cnf->partition_, -1)) return 0;
   if (!helper->getInt("polllimit", &cnf->pollLimit_, 100)) return 0;
+  if (!helper->getInt("workers", &cnf->workers_, 0)) return 0;
+  if (cnf->workers_ < 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "workers %d must not be negative", cnf->workers_);
+    return 0;
+  }
+  if (!helper->getInt("quantum", &cnf->quantum_, DEFAULT_TAIL_QUANTUM)) return 0;
+  if (cnf->quantum_ <= 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "quantum %d must be positive", cnf->quantum_);
+    return 0;
+  }
+  if (!helper->getInt("maxopenfiles", &cnf->maxOpenFiles_, 0)) return 0;
+  if (cnf->maxOpenFiles_ < 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "maxopenfiles %d must not be negative", cnf->maxOpenFiles_);
+    return 0;
+  }
+  if (!helper->getInt("catchup", &cnf->catchup_, 0)) return 0;
+  if (!helper->getInt("catchuprate", &cnf->catchupRate_, 0)) return 0;
+  if (cnf->catchup_ < 0 || cnf->catchupRate_ < 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "catchup %d and catchuprate %d must not be negative",
+             cnf->catchup_, cnf->catchupRate_);
+    return 0;
+  }
+  if (!helper->getInt("prefetch", &cnf->prefetch_, 0)) return 0;
+  if (cnf->prefetch_ < 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "prefetch %d must not be negative", cnf->prefetch_);
+    return 0;
+  }
   if (!helper->getInt("rotatedelay", &cnf->rotateDelay_, -1)) return 0;
 
   if (!helper->getString("pingbackurl", &cnf->pingbackUrl_, "")) return 0;
@@ -117,7 +141,8 @@ CnfCtx *CnfCtx::loadFile(const char *file, char *errbuf)
 
   cnf->helper_ = helper.release();
 
-  if (!initPipe(&cnf->accept, &cnf->server, errbuf)) return 0;
+  if (!cnf->queue.init(errbuf)) return 0;
+  if (!cnf->initWakeFd(errbuf)) return 0;
 
   cnf->errbuf_ = errbuf;
   return cnf.release();
@@ -126,9 +151,11 @@ CnfCtx *CnfCtx::loadFile(const char *file, char *errbuf)
 void CnfCtx::addLuaCtx(LuaCtx *ctx)
 {
   count_++;
+  std::vector<LuaCtx *> *ctxs = ctx->fileWithGlob() ? &globCtxs_ : &luaCtxs_;
+
   bool find = false;
-  for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin();
-       ite != luaCtxs_.end(); ++ite) {
+  for (std::vector<LuaCtx *>::iterator ite = ctxs->begin();
+       ite != ctxs->end(); ++ite) {
     if ((*ite)->file() == ctx->file()) {
       ctx->setNext(*ite);
       *ite = ctx;
@@ -136,7 +163,91 @@ void CnfCtx::addLuaCtx(LuaCtx *ctx)
       break;
     }
   }
-  if (!find) luaCtxs_.push_back(ctx);
+  if (!find) ctxs->push_back(ctx);
+}
+
+bool CnfCtx::addGlobFile(LuaCtx *glob, const std::string &file, bool created, LuaCtx **ctx)
+{
+  *ctx = getGlobFile(file);
+  if (*ctx) return true;
+
+  for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
+    if (!(*ite)->globTemplate() && (*ite)->file() == file) return true;
+  }
+
+  LuaCtx *head = 0, *tail = 0;
+  for (LuaCtx *tpl = glob; tpl; tpl = tpl->next()) {
+    LuaCtx *instance = tpl->instance(file, created);
+    if (!instance) {
+      deleteLuaCtxs(head);
+      return false;
+    }
+
+    if (tail) tail->setNext(instance);
+    else head = instance;
+    tail = instance;
+  }
+
+  // created while running, the others get readers after fork
+  if (created && !initFileReader(head)) {
+    deleteLuaCtxs(head);
+    return false;
+  }
+
+  log_info(0, "%s matches %s", file.c_str(), glob->file().c_str());
+  luaCtxs_.push_back(head);
+  globFiles_[file] = head;
+  *ctx = head;
+  return true;
+}
+
+LuaCtx *CnfCtx::addCatchupFile(LuaCtx *head, const std::string &file, int chunk)
+{
+  LuaCtx *chain = 0, *tail = 0;
+  for (LuaCtx *ctx = head; ctx; ctx = ctx->next()) {
+    LuaCtx *instance = ctx->catchupInstance(file, chunk);
+    if (!instance) {
+      deleteLuaCtxs(chain);
+      return 0;
+    }
+
+    if (tail) tail->setNext(instance);
+    else chain = instance;
+    tail = instance;
+  }
+
+  if (!initFileReader(chain)) {
+    deleteLuaCtxs(chain);
+    return 0;
+  }
+
+  catchupCtxs_.push_back(chain);
+  return chain;
+}
+
+void CnfCtx::dropCatchupFile(LuaCtx *ctx)
+{
+  std::vector<LuaCtx *>::iterator pos = std::find(catchupCtxs_.begin(), catchupCtxs_.end(), ctx);
+  if (pos != catchupCtxs_.end()) catchupCtxs_.erase(pos);
+  deleteLuaCtxs(ctx);
+}
+
+/* before fork, instances of files gone are dropped, InotifyCtx matches the files again */
+void CnfCtx::dropGlobFiles()
+{
+  std::vector<LuaCtx *> ctxs;
+  for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
+    LuaCtx *ctx = *ite;
+    if (!ctx->globTemplate() || access(ctx->file().c_str(), F_OK) == 0) {
+      ctxs.push_back(ctx);
+      continue;
+    }
+
+    log_info(0, "%s is gone, drop it", ctx->file().c_str());
+    globFiles_.erase(ctx->file());
+    deleteLuaCtxs(ctx);
+  }
+  luaCtxs_.swap(ctxs);
 }
 
 bool CnfCtx::initKafka()
@@ -172,13 +283,18 @@ bool CnfCtx::initFileOff()
 bool CnfCtx::initFileReader()
 {
   for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
-    LuaCtx *ctx = *ite;
-    FileReader *reader = 0;
-    while (ctx) {
-      if (!ctx->initFileReader(reader, errbuf_)) return false;
-      if (!reader) reader = ctx->getFileReader();
-      ctx = ctx->next();
-    }
+    if (!initFileReader(*ite)) return false;
+  }
+  return true;
+}
+
+bool CnfCtx::initFileReader(LuaCtx *ctx)
+{
+  FileReader *reader = 0;
+  while (ctx) {
+    if (!ctx->initFileReader(reader, errbuf_)) return false;
+    if (!reader) reader = ctx->getFileReader();
+    ctx = ctx->next();
   }
   return true;
 }
@@ -191,45 +307,107 @@ void CnfCtx::logStats()
 
   TailStats s;
   stats_.get(&s);
-  log_info(0, "kafka/es status %s, TailStatus,fileRead=%ld,logRead=%ld,logWrite=%ld,logSend=%ld,logRecv=%ld,logError=%ld,queueSize=%ld",
+  log_info(0, "kafka/es status %s, TailStatus,fileRead=%ld,logRead=%ld,logWrite=%ld,logSend=%ld,logRecv=%ld,logError=%ld,queueSize=%ld,queueBytes=%ld,bufferSize=%ld,nulSkip=%ld,rotateCheck=%ld",
            block ? "block" : "ok", s.fileRead(), s.logRead(), s.logWrite(),
-           s.logSend(), s.logRecv(), s.logError(), s.queueSize());
+           s.logSend(), s.logRecv(), s.logError(), s.queueSize(), s.queueBytes(), s.bufferSize(), s.nulSkip(),
+           s.rotateCheck());
   lastLog_ = fasttime();
 }
 
-CnfCtx::CnfCtx() {
+static __thread LuaHelper *threadLuaHelper = 0;
+
+LuaHelper *CnfCtx::getLuaHelper()
+{
+  return threadLuaHelper ? threadLuaHelper : helper_;
+}
+
+void CnfCtx::setThreadLuaHelper(LuaHelper *helper)
+{
+  threadLuaHelper = helper;
+}
+
+CnfCtx::CnfCtx() : queue(MAX_BATCH_QUEUE_SIZE) {
   lastLog_ = 0;
   partition_ = -1;
+  workers_ = 0;
+  quantum_ = DEFAULT_TAIL_QUANTUM;
+  maxOpenFiles_ = 0;
+  catchup_ = catchupRate_ = 0;
+  prefetch_ = 0;
 
   helper_  = 0;
   kafka_   = 0;
   es_      = 0;
   fileOff_ = 0;
 
-  accept = server = -1;
   count_  = 0;
-  gettimeofday(&timeval_, 0);
+  fasttime(true, TIMEUNIT_SECONDS);
 
   tailLimit_ = false;
   flowControl_ = 0;
+  congested_ = 0;
+  wakeFd_ = -1;
 }
 
 CnfCtx::~CnfCtx()
 {
   for (std::vector<LuaCtx *>::iterator ite = luaCtxs_.begin(); ite != luaCtxs_.end(); ++ite) {
-    LuaCtx *ctx = *ite;
-    while (ctx) {
-      LuaCtx *next = ctx->next();
-      delete ctx;
-      ctx = next;
-    }
+    deleteLuaCtxs(*ite);
+  }
+  for (std::vector<LuaCtx *>::iterator ite = globCtxs_.begin(); ite != globCtxs_.end(); ++ite) {
+    deleteLuaCtxs(*ite);
+  }
+  for (std::vector<LuaCtx *>::iterator ite = catchupCtxs_.begin(); ite != catchupCtxs_.end(); ++ite) {
+    deleteLuaCtxs(*ite);
   }
 
   if (helper_)  delete helper_;
   if (kafka_)   delete kafka_;
   if (es_)      delete es_;
   if (fileOff_) delete fileOff_;
+  if (wakeFd_ != -1) close(wakeFd_);
+}
 
-  if (accept != -1) close(accept);
-  if (server != -1) close(server);
+bool CnfCtx::initWakeFd(char *errbuf)
+{
+  if (wakeFd_ != -1) close(wakeFd_);
+
+  wakeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeFd_ == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "eventfd error %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void CnfCtx::wakeupTail()
+{
+  uint64_t n = 1;
+  if (write(wakeFd_, &n, sizeof(n)) != sizeof(n)) log_error(errno, "wakeup tail error");
+}
+
+bool CnfCtx::flowControlOn()
+{
+  if (util::atomic_get(&flowControl_)) return true;
+  if (stats_.queueBytes() <= MAX_FILE_QUEUE_BYTES) return false;
+
+  if (util::atomic_cas(&flowControl_, 0, 1)) {
+    log_info(0, "flow control on, queueBytes %ld", (long) stats_.queueBytes());
+  }
+  // acks between the check and cas did not see it on
+  return !flowControlOff();
+}
+
+bool CnfCtx::flowControlOff()
+{
+  if (stats_.queueBytes() > MAX_FILE_QUEUE_BYTES / 2) return false;
+  if (!util::atomic_cas(&flowControl_, 1, 0)) return false;
+
+  log_info(0, "flow control off, queueBytes %ld", (long) stats_.queueBytes());
+  return true;
+}
+
+void CnfCtx::flowControlCheck()
+{
+  if (util::atomic_get(&flowControl_) && flowControlOff()) wakeupTail();
 }
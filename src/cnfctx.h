@@ -7,6 +7,7 @@
 #include <sys/time.h>
 
 #include "gnuatomic.h"
+#include "mpscqueue.h"
 #include "fileoff.h"
 #include "luahelper.h"
 #include "esctx.h"
@@ -14,14 +15,18 @@
 #include "common.h"
 
 #define QUEUE_ERROR_TIMEOUT 60
-#define MAX_FILE_QUEUE_SIZE 50000
+#define MAX_FILE_QUEUE_BYTES (64 * 1024 * 1024)
+#define MAX_TOPIC_QUEUE_BYTES (16 * 1024 * 1024)
+#define MAX_TOPIC_QUEUE_SIZE  (64 * 1024)
+#define MAX_BATCH_QUEUE_SIZE 8192
+#define DEFAULT_TAIL_QUANTUM (4 * 1024 * 1024)   // bytes a file reads per round
 
 class TailStats {
 public:
   TailStats() :
     fileRead_(0), logRead_(0), logWrite_(0),
     logRecv_(0), logSend_(0), logError_(0),
-    queueSize_(0) {}
+    queueSize_(0), queueBytes_(0), bufferSize_(0), nulSkip_(0), rotateCheck_(0) {}
 
   void fileReadInc(int add = 1) { util::atomic_inc(&fileRead_, add); }
   void logReadInc(int add = 1) { util::atomic_inc(&logRead_, add); }
@@ -31,8 +36,15 @@ public:
   void logSendInc(int add = 1) { util::atomic_inc(&logSend_, add); }
   void logErrorInc(int add = 1) { util::atomic_inc(&logError_, add); }
 
-  void queueSizeInc(int add = 1) { util::atomic_inc(&queueSize_, add); }
-  void queueSizeDec(int add = 1) { util::atomic_dec(&queueSize_, add); }
+  /* records and bytes sent to kafka/es but not yet acked */
+  void queueSizeInc(int add = 1, int bytes = 0) {
+    util::atomic_inc(&queueSize_, add);
+    util::atomic_inc(&queueBytes_, bytes);
+  }
+  void queueSizeDec(int add = 1, int bytes = 0) {
+    util::atomic_dec(&queueSize_, add);
+    util::atomic_dec(&queueBytes_, bytes);
+  }
 
   int64_t fileRead() const { return fileRead_; }
   int64_t logRead() const { return logRead_; }
@@ -43,6 +55,19 @@ public:
   int64_t logError() const { return logError_; }
 
   int64_t queueSize() const { return util::atomic_get((int64_t *) &queueSize_); }
+  int64_t queueBytes() const { return util::atomic_get((int64_t *) &queueBytes_); }
+
+  /* line buffers of all files */
+  void bufferSizeInc(int add) { util::atomic_inc(&bufferSize_, add); }
+  int64_t bufferSize() const { return bufferSize_; }
+
+  /* NUL bytes skipped, holes and preallocated blocks */
+  void nulSkipInc(int64_t add) { util::atomic_inc(&nulSkip_, add); }
+  int64_t nulSkip() const { return nulSkip_; }
+
+  /* rotate checks of the watched files, fstat and access each */
+  void rotateCheckInc(int add = 1) { util::atomic_inc(&rotateCheck_, add); }
+  int64_t rotateCheck() const { return rotateCheck_; }
 
   void get(TailStats *stats) {
     stats->fileRead_ = util::atomic_get(&fileRead_);
@@ -54,6 +79,10 @@ public:
     stats->logError_ = util::atomic_get(&logError_);
 
     stats->queueSize_ = util::atomic_get(&queueSize_);
+    stats->queueBytes_ = util::atomic_get(&queueBytes_);
+    stats->bufferSize_ = util::atomic_get(&bufferSize_);
+    stats->nulSkip_ = util::atomic_get(&nulSkip_);
+    stats->rotateCheck_ = util::atomic_get(&rotateCheck_);
   }
 
 private:
@@ -66,19 +95,23 @@ private:
   int64_t logError_;
 
   int64_t queueSize_;
+  int64_t queueBytes_;
+  int64_t bufferSize_;
+  int64_t nulSkip_;
+  int64_t rotateCheck_;
 };
 
 class RunStatus;
 
 enum TimeUnit {
-  TIMEUNIT_MILLI, TIMEUNIT_SECONDS,
+  TIMEUNIT_MICRO, TIMEUNIT_MILLI, TIMEUNIT_SECONDS,
 };
 
 class CnfCtx {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  int                    accept;
-  int                    server;
+  /* record batches from tail to kafka/es routine */
+  util::MpscQueue        queue;
 
 public:
   static CnfCtx *loadCnf(const char *dir, char *errbuf);
@@ -89,6 +122,21 @@ public:
   ~CnfCtx();
   void addLuaCtx(LuaCtx *ctx);
 
+  /* instances of the glob chain for file, *ctx is 0 if the file is configured already,
+   * a file created while running is read from its start
+   */
+  bool addGlobFile(LuaCtx *glob, const std::string &file, bool created, LuaCtx **ctx);
+  LuaCtx *getGlobFile(const std::string &file) {
+    std::map<std::string, LuaCtx *>::iterator pos = globFiles_.find(file);
+    return pos != globFiles_.end() ? pos->second : 0;
+  }
+
+  /* instances of the head chain reading its history file on a catch-up thread,
+   * dropped when the file is finished and acked
+   */
+  LuaCtx *addCatchupFile(LuaCtx *head, const std::string &file, int chunk = -1);
+  void dropCatchupFile(LuaCtx *ctx);
+
   bool enableKafka() const { return !brokers_.empty(); }
   bool initKafka();
   KafkaCtx *getKafka() { return kafka_; }
@@ -102,6 +150,7 @@ public:
   FileOff *getFileOff() { return fileOff_; }
 
   bool initFileReader();
+  bool initFileReader(LuaCtx *ctx);
 
   void setRunStatus(RunStatus *runStatus) { runStatus_ = runStatus; }
   RunStatus *getRunStatus() { return runStatus_; }
@@ -121,12 +170,21 @@ public:
     return pidfile_.c_str();
   }
 
-  LuaHelper *getLuaHelper() { return helper_; }
+  /* main.lua, or its per-thread copy when tail runs in workers */
+  LuaHelper *getLuaHelper();
+  static void setThreadLuaHelper(LuaHelper *helper);
 
   size_t getLuaCtxSize() const { return count_; }
   std::vector<LuaCtx *> &getLuaCtxs() { return luaCtxs_; }
+  std::vector<LuaCtx *> &getGlobCtxs() { return globCtxs_; }
 
   int getPollLimit() const { return pollLimit_; }
+  int getWorkers() const { return workers_; }
+  int getQuantum() const { return quantum_; }
+  int getMaxOpenFiles() const { return maxOpenFiles_; }
+  int getCatchup() const { return catchup_; }
+  int getCatchupRate() const { return catchupRate_; }
+  int getPrefetch() const { return prefetch_; }
   int getRotateDelay() const { return rotateDelay_; }
   const std::string &pingbackUrl() const { return pingbackUrl_; }
 
@@ -134,13 +192,20 @@ public:
   int partition() const { return partition_; }
   const std::string &host() const { return host_; }
 
+  /* the main thread updates it, workers read it, one atomic word so it is never torn */
   int64_t fasttime(TimeUnit unit = TIMEUNIT_SECONDS) const {
-    if (unit == TIMEUNIT_MILLI) return timeval_.tv_sec * 1000 + timeval_.tv_usec / 1000;
-    else return timeval_.tv_sec;
+    int64_t micro = util::atomic_load(&fastmicro_);
+    if (unit == TIMEUNIT_MICRO) return micro;
+    if (unit == TIMEUNIT_MILLI) return micro / 1000;
+    else return micro / 1000000;
   }
 
   int64_t fasttime(bool force, TimeUnit unit) {
-    if (force) gettimeofday(&timeval_, 0);
+    if (force) {
+      struct timeval tv;
+      gettimeofday(&tv, 0);
+      util::atomic_store(&fastmicro_, (int64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+    }
     return fasttime(unit);
   }
 
@@ -149,16 +214,26 @@ public:
   const std::string &logdir() const { return logdir_; }
   int daemonize() const { return daemonize_; }
 
-  void setTailLimit(bool tailLimit) { tailLimit_ = tailLimit; }
-  bool getTailLimit() const { return tailLimit_; }
+  /* set by the workers, read and cleared by the main thread */
+  void setTailLimit(bool tailLimit) { util::atomic_store(&tailLimit_, tailLimit); }
+  bool getTailLimit() const { return util::atomic_load(&tailLimit_); }
 
-  void flowControl(bool block) { util::atomic_set(&flowControl_, block ? 1 : 0); }
+  /* host wide limit of bytes not yet acked, on above MAX_FILE_QUEUE_BYTES
+   * and off below the half, topics are limited one by one in LuaCtx
+   */
+  bool flowControlOn();
+  void flowControlCheck();
 
-  bool flowControlOn() const {
-    return util::atomic_get((int *) &flowControl_) ||
-      stats_.queueSize() > MAX_FILE_QUEUE_SIZE;
+  /* count of congested topics, tail serves kafka delivery reports while any is blocked */
+  void congestedInc(int add) { util::atomic_inc(&congested_, add); }
+  bool tailBlocked() {
+    return util::atomic_get(&flowControl_) || util::atomic_get(&congested_) > 0;
   }
 
+  /* tail sleeps on it while files are blocked, written when a queue drains */
+  int tailWakeFd() const { return wakeFd_; }
+  void wakeupTail();
+
 private:
   CnfCtx();
 
@@ -170,6 +245,12 @@ private:
   uint32_t    addr_;
   int         partition_;
   int         pollLimit_;
+  int         workers_;
+  int         quantum_;
+  int         maxOpenFiles_;
+  int         catchup_;
+  int         catchupRate_;
+  int         prefetch_;
   int         rotateDelay_;
   std::string pingbackUrl_;
   std::string logdir_;
@@ -178,6 +259,9 @@ private:
 
   size_t                 count_;
   std::vector<LuaCtx *>  luaCtxs_;
+  std::vector<LuaCtx *>  globCtxs_;    // templates, chained by the pattern
+  std::map<std::string, LuaCtx *> globFiles_;
+  std::vector<LuaCtx *>  catchupCtxs_;
 
   std::string                         brokers_;
   std::map<std::string, std::string>  kafkaGlobal_;
@@ -189,7 +273,7 @@ private:
   int          esMaxConns_;
   EsCtx       *es_;
 
-  struct timeval timeval_;
+  int64_t      fastmicro_;   // fasttime in microseconds
   char        *errbuf_;
   RunStatus   *runStatus_;
 
@@ -198,6 +282,12 @@ private:
 
   bool tailLimit_;
   int flowControl_;
+  int congested_;
+  int wakeFd_;
+
+  bool initWakeFd(char *errbuf);
+  void dropGlobFiles();
+  bool flowControlOff();
 };
 
 #endif
@@ -5,6 +5,11 @@
 #include <unistd.h>
 #include <netdb.h>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#define SPLIT_SSE2
+#endif
+
 #include "util.h"
 #include "common.h"
 
@@ -93,6 +98,90 @@ void split(const char *line, size_t nline, std::vector<std::string> *items)
   if (pos < nline) items->push_back(std::string(line + pos, nline - pos));
 }
 
+#define SPAN_PUSH(spans, start, len) do { \
+  (spans)->push_back(start);              \
+  (spans)->push_back(len);                \
+} while (0)
+
+#ifdef SPLIT_SSE2
+/* 16 bytes at a time while outside quotes, spaces end fields, stop at the first \ " [.
+ * returns where the scalar loop goes on
+ */
+static size_t splitPlain(const char *line, size_t nline, size_t i, size_t *pos, std::vector<uint32_t> *spans)
+{
+  const __m128i space = _mm_set1_epi8(' '), quote = _mm_set1_epi8('"');
+  const __m128i bracket = _mm_set1_epi8('['), backslash = _mm_set1_epi8('\\');
+
+  for (; i + 16 <= nline; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (line + i));
+    unsigned spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, space));
+    unsigned stops  = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bracket)),
+                                                     _mm_cmpeq_epi8(v, backslash)));
+    if (stops) spaces &= (stops & -stops) - 1;
+
+    for (; spaces; spaces &= spaces - 1) {
+      size_t at = i + __builtin_ctz(spaces);
+      if (at != *pos) SPAN_PUSH(spans, *pos, at - *pos);
+      *pos = at + 1;
+    }
+    if (stops) return i + __builtin_ctz(stops);
+  }
+  return i;
+}
+
+// inside quotes only the closing byte and \ matter
+static size_t splitQuoted(const char *line, size_t nline, size_t i, char want)
+{
+  const __m128i close = _mm_set1_epi8(want), backslash = _mm_set1_epi8('\\');
+
+  for (; i + 16 <= nline; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (line + i));
+    unsigned stops = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, close), _mm_cmpeq_epi8(v, backslash)));
+    if (stops) return i + __builtin_ctz(stops);
+  }
+  return i;
+}
+#endif
+
+void splitSpans(const char *line, size_t nline, std::vector<uint32_t> *spans)
+{
+  bool esc = false;
+  char want = '\0';
+  size_t pos = 0;
+
+  for (size_t i = 0; i < nline; ++i) {
+#ifdef SPLIT_SSE2
+    if (!esc) {
+      i = want == '\0' ? splitPlain(line, nline, i, &pos, spans) : splitQuoted(line, nline, i, want);
+      if (i == nline) break;
+    }
+#endif
+    if (esc) {
+      esc = false;
+    } else if (line[i] == '\\') {
+      esc = true;
+    } else if (want != '\0') {
+      if (line[i] == want) {
+        want = '\0';
+        SPAN_PUSH(spans, pos, i - pos);
+        pos = i+1;
+      }
+    } else {
+      if (line[i] == '"') {
+        want = '"';
+        pos++;
+      } else if (line[i] == '[') {
+        want = ']';
+        pos++;
+      } else if (line[i] == ' ') {
+        if (i != pos) SPAN_PUSH(spans, pos, i - pos);
+        pos = i+1;
+      }
+    }
+  }
+  if (pos < nline) SPAN_PUSH(spans, pos, nline - pos);
+}
+
 void splitn(const char *line, size_t nline, std::vector<std::string> *items, int limit, char delimiter)
 {
   bool esc = false;
@@ -116,21 +205,147 @@ void splitn(const char *line, size_t nline, std::vector<std::string> *items, int
   if (pos < nline) items->push_back(std::string(line + pos, nline - pos));
 }
 
+void splitnSpans(const char *line, size_t nline, std::vector<uint32_t> *spans, int limit, char delimiter)
+{
+  bool esc = false;
+  size_t pos = 0;
+
+  for (size_t i = 0; i < nline; ++i) {
+    if (esc) {
+      esc = false;
+    } else if (line[i] == '\\') {
+      esc = true;
+    } else if (line[i] == delimiter) {
+      if (i != pos) {
+        if (limit > 0 && (size_t) limit == spans->size() / 2 + 1) i = nline;
+        SPAN_PUSH(spans, pos, i - pos);
+      }
+      pos = i+1;
+    }
+  }
+  if (pos < nline) SPAN_PUSH(spans, pos, nline - pos);
+}
+
 enum DateTimeStatus { WaitYear, WaitMonth, WaitDay, WaitHour, WaitMin, WaitSec };
+enum DateTimeField { YEAR, MONTH, DAY, HOUR, MIN, SEC, NFIELD };
 
 static const char *MonthAlpha[12] = {
   "Jan", "Feb", "Mar", "Apr", "May", "Jun",
   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
-// 28/Feb/2015:12:30:23 +0800 -> 2015-03-30T16:31:53
-bool timeLocalToIso8601(const std::string &t, std::string *iso, time_t *time)
+static int monthAlpha(const char *p)
+{
+  for (int i = 0; i < 12; ++i) {
+    if (p[0] == MonthAlpha[i][0] && p[1] == MonthAlpha[i][1] && p[2] == MonthAlpha[i][2]) return i+1;
+  }
+  return 0;
+}
+
+/* fixed layouts of the time fields, Y M D h m s are digits of a field, bbb is the month name,
+ * ? is ' ' or 'T', anything else must be there as it is
+ */
+static const char *TimeLocalLayout = "DD/bbb/YYYY:hh:mm:ss";
+static const char *Iso8601Layout   = "YYYY-MM-DD?hh:mm:ss";
+#define TIMELOCAL_SEC_POS 18
+#define ISO8601_SEC_POS   17
+
+static bool parseLayout(const char *layout, const char *p, int *f)
+{
+  memset(f, 0, sizeof(int) * NFIELD);
+  for (; *layout; ++layout, ++p) {
+    int idx;
+    switch (*layout) {
+    case 'Y': idx = YEAR; break;
+    case 'M': idx = MONTH; break;
+    case 'D': idx = DAY; break;
+    case 'h': idx = HOUR; break;
+    case 'm': idx = MIN; break;
+    case 's': idx = SEC; break;
+    case 'b':
+      if ((f[MONTH] = monthAlpha(p)) == 0) return false;
+      layout += 2, p += 2;
+      continue;
+    case '?':
+      if (*p != ' ' && *p != 'T') return false;
+      continue;
+    default:
+      if (*p != *layout) return false;
+      continue;
+    }
+    if (*p < '0' || *p > '9') return false;
+    f[idx] = f[idx] * 10 + (*p - '0');
+  }
+  return true;
+}
+
+static inline void fmtDigits(char *p, int v, int n)
+{
+  for (p += n-1; n > 0; --n, --p, v /= 10) *p = '0' + v % 10;
+}
+
+/* the last time seen by this thread, lines of a log share the second, or at least the minute.
+ * key is the raw bytes, a key that differs only in the seconds reuses the minute
+ */
+struct DateTimeCache {
+  char   key[32];
+  size_t nkey;
+  char   iso[20];    // yyyy-mm-ddThh:mm:ss
+  time_t minute;     // mktime of the minute
+};
+
+static __thread DateTimeCache timeLocalCache;
+static __thread DateTimeCache iso8601Cache;
+
+static bool cacheHit(DateTimeCache *cache, const char *t, size_t n, size_t secpos, time_t *time)
+{
+  // an empty field of [] is as long as the empty cache
+  if (n < secpos + 2) return false;
+  if (n != cache->nkey || memcmp(t, cache->key, secpos) != 0 ||
+      memcmp(t + secpos + 2, cache->key + secpos + 2, n - secpos - 2) != 0) return false;
+
+  char s0 = t[secpos], s1 = t[secpos+1];
+  if (s0 < '0' || s0 > '9' || s1 < '0' || s1 > '9') return false;
+
+  cache->key[secpos] = cache->iso[17] = s0;
+  cache->key[secpos+1] = cache->iso[18] = s1;
+  if (time) *time = cache->minute + (s0 - '0') * 10 + (s1 - '0');
+  return true;
+}
+
+// a key too long to keep leaves the cache empty, iso and minute are still the result
+static void cacheFill(DateTimeCache *cache, const char *t, size_t n, const int *f)
+{
+  if (n > sizeof(cache->key)) {
+    cache->nkey = 0;
+  } else {
+    memcpy(cache->key, t, n);
+    cache->nkey = n;
+  }
+
+  char *p = cache->iso;
+  fmtDigits(p, f[YEAR], 4);
+  p[4] = '-';
+  fmtDigits(p + 5, f[MONTH], 2);
+  p[7] = '-';
+  fmtDigits(p + 8, f[DAY], 2);
+  p[10] = 'T';
+  fmtDigits(p + 11, f[HOUR], 2);
+  p[13] = ':';
+  fmtDigits(p + 14, f[MIN], 2);
+  p[16] = ':';
+  fmtDigits(p + 17, f[SEC], 2);
+  p[19] = '\0';
+
+  cache->minute = mktime(f[YEAR], f[MONTH], f[DAY], f[HOUR], f[MIN], 0);
+}
+
+// 28/Feb:12:30:23, 28/Feb/2015:12:30, the layouts the table does not cover
+static bool timeLocalScan(const char *p, size_t n, int *f)
 {
   DateTimeStatus status = WaitDay;
-  int year, mon, day, hour, min, sec;
-  year = mon = day = hour = min = sec = 0;
+  memset(f, 0, sizeof(int) * NFIELD);
 
-  const char *p = t.c_str();
-  while (*p && *p != ' ') {
+  for (const char *end = p + n; p != end && *p != ' '; ++p) {
     if (*p == '/') {
       if (status == WaitDay) status = WaitMonth;
       else if (status == WaitMonth) status = WaitYear;
@@ -141,45 +356,57 @@ bool timeLocalToIso8601(const std::string &t, std::string *iso, time_t *time)
       else if (status == WaitMin) status = WaitSec;
       else return false;
     } else if (*p >= '0' && *p <= '9') {
-      int n = *p - '0';
-      if (status == WaitYear) year = year * 10 + n;
-      else if (status == WaitDay) day = day * 10 + n;
-      else if (status == WaitHour) hour = hour * 10 + n;
-      else if (status == WaitMin) min = min * 10 + n;
-      else if (status == WaitSec) sec = sec * 10 + n;
+      int d = *p - '0';
+      if (status == WaitYear) f[YEAR] = f[YEAR] * 10 + d;
+      else if (status == WaitDay) f[DAY] = f[DAY] * 10 + d;
+      else if (status == WaitHour) f[HOUR] = f[HOUR] * 10 + d;
+      else if (status == WaitMin) f[MIN] = f[MIN] * 10 + d;
+      else if (status == WaitSec) f[SEC] = f[SEC] * 10 + d;
       else return false;
     } else if (status == WaitMonth) {
-      size_t i;
-      for (i = 0; i < 12; ++i) {
-        if (strncmp(p, MonthAlpha[i], 3) == 0) {
-          mon = i+1;
-          break;
-        }
-      }
+      if (end - p >= 3 && monthAlpha(p)) f[MONTH] = monthAlpha(p);
     } else {
       return false;
     }
-    p++;
+  }
+  return true;
+}
+
+// 28/Feb/2015:12:30:23 +0800 -> 2015-02-28T12:30:23, the zone is not used, time is local
+bool timeLocalToIso8601(const char *t, size_t n, std::string *iso, time_t *time)
+{
+  DateTimeCache *cache = &timeLocalCache;
+  if (cacheHit(cache, t, n, TIMELOCAL_SEC_POS, time)) {
+    iso->assign(cache->iso, sizeof(cache->iso)-1);
+    return true;
+  }
+
+  int f[NFIELD];
+  if (n >= TIMELOCAL_SEC_POS + 2 && (n == TIMELOCAL_SEC_POS + 2 || t[TIMELOCAL_SEC_POS + 2] == ' ') &&
+      parseLayout(TimeLocalLayout, t, f)) {
+    cacheFill(cache, t, n, f);
+    if (time) *time = cache->minute + f[SEC];
+    iso->assign(cache->iso, sizeof(cache->iso)-1);
+    return true;
   }
 
-  iso->reserve(sizeof("yyyy-mm-ddThh:mm:ss"));
-  iso->resize(sizeof("yyyy-mm-ddThh:mm:ss")-1);
-  sprintf((char *) iso->data(), "%04d-%02d-%02dT%02d:%02d:%02d",
-          year, mon, day, hour, min, sec);
+  if (!timeLocalScan(t, n, f)) return false;
 
-  if (time) *time = mktime(year, mon, day, hour, min, sec);
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d",
+                     f[YEAR], f[MONTH], f[DAY], f[HOUR], f[MIN], f[SEC]);
+  iso->assign(buf, len);
+
+  if (time) *time = mktime(f[YEAR], f[MONTH], f[DAY], f[HOUR], f[MIN], f[SEC]);
   return true;
 }
 
-// 2018-02-22 17:40:00.000
-bool parseIso8601(const std::string &t, time_t *timestamp)
+static bool iso8601Scan(const char *p, size_t n, int *f)
 {
   DateTimeStatus status = WaitYear;
-  int year, mon, day, hour, min, sec;
-  year = mon = day = hour = min = sec = 0;
+  memset(f, 0, sizeof(int) * NFIELD);
 
-  const char *p = t.c_str();
-  while (*p && *p != '.') {
+  for (const char *end = p + n; p != end && *p != '.'; ++p) {
     if (*p == '-') {
       if (status == WaitYear) status = WaitMonth;
       else if (status == WaitMonth) status = WaitDay;
@@ -192,22 +419,39 @@ bool parseIso8601(const std::string &t, time_t *timestamp)
       else if (status == WaitMin) status = WaitSec;
       else return false;
     } else if (*p >= '0' && *p <= '9') {
-      int n = *p - '0';
-      if (status == WaitYear) year = year * 10 + n;
-      else if (status == WaitMonth) mon = mon * 10 + n;
-      else if (status == WaitDay) day = day * 10 + n;
-      else if (status == WaitHour) hour = hour * 10 + n;
-      else if (status == WaitMin) min = min * 10 + n;
-      else if (status == WaitSec) sec = sec * 10 + n;
+      int d = *p - '0';
+      if (status == WaitYear) f[YEAR] = f[YEAR] * 10 + d;
+      else if (status == WaitMonth) f[MONTH] = f[MONTH] * 10 + d;
+      else if (status == WaitDay) f[DAY] = f[DAY] * 10 + d;
+      else if (status == WaitHour) f[HOUR] = f[HOUR] * 10 + d;
+      else if (status == WaitMin) f[MIN] = f[MIN] * 10 + d;
+      else if (status == WaitSec) f[SEC] = f[SEC] * 10 + d;
       else return false;
     } else {
       return false;
     }
-    p++;
   }
-  if (status != WaitSec) return false;
+  return status == WaitSec;
+}
+
+// 2018-02-22 17:40:00.000, the fraction is dropped, time is local
+bool parseIso8601(const char *t, size_t n, time_t *timestamp)
+{
+  const size_t size = ISO8601_SEC_POS + 2;
+  DateTimeCache *cache = &iso8601Cache;
+
+  int f[NFIELD];
+  if (n >= size && (n == size || t[size] == '.')) {
+    if (cacheHit(cache, t, size, ISO8601_SEC_POS, timestamp)) return true;
+    if (parseLayout(Iso8601Layout, t, f)) {
+      cacheFill(cache, t, size, f);
+      *timestamp = cache->minute + f[SEC];
+      return true;
+    }
+  }
 
-  *timestamp = mktime(year, mon, day, hour, min, sec);
+  if (!iso8601Scan(t, n, f)) return false;
+  *timestamp = mktime(f[YEAR], f[MONTH], f[DAY], f[HOUR], f[MIN], f[SEC]);
   return true;
 }
 
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
 #include <map>
 #include <string>
 #include <vector>
@@ -17,13 +18,40 @@ typedef std::vector<LuaCtx *>              LuaCtxPtrList;
 
 #define MAX_ERR_LEN    512
 
+/* a line in the read buffer, off is where it starts in the file */
+struct LineRef {
+  LineRef(off_t o, const char *l, size_t n) : off(o), line(l), nline(n) {}
+
+  off_t       off;
+  const char *line;
+  size_t      nline;
+};
+
 bool shell(const char *cmd, std::string *output, char *errbuf);
 bool hostAddr(const std::string &host, uint32_t *addr, char *errbuf);
 void split(const char *line, size_t nline, std::vector<std::string> *items);
+/* the same fields as split, as start,len pairs into line, nothing is copied.
+ * spans is reused by the caller, no allocation once it has grown
+ */
+void splitSpans(const char *line, size_t nline, std::vector<uint32_t> *spans);
 void splitn(const char *line, size_t nline, std::vector<std::string> *items,
             int limit = -1, char delimiter = ' ');
-bool timeLocalToIso8601(const std::string &t, std::string *iso, time_t *timestamp = 0);
-bool parseIso8601(const std::string &t, time_t *timestamp);
+/* the same fields as splitn, as start,len pairs */
+void splitnSpans(const char *line, size_t nline, std::vector<uint32_t> *spans,
+                 int limit = -1, char delimiter = ' ');
+/* both keep the last time seen by the calling thread, a line of the same second
+ * or minute skips the parse and mktime
+ */
+bool timeLocalToIso8601(const char *t, size_t n, std::string *iso, time_t *timestamp = 0);
+inline bool timeLocalToIso8601(const std::string &t, std::string *iso, time_t *timestamp = 0)
+{
+  return timeLocalToIso8601(t.data(), t.size(), iso, timestamp);
+}
+bool parseIso8601(const char *t, size_t n, time_t *timestamp);
+inline bool parseIso8601(const std::string &t, time_t *timestamp)
+{
+  return parseIso8601(t.data(), t.size(), timestamp);
+}
 
 inline time_t mktime(int year, int mon, int day, int hour, int min, int sec)
 {
@@ -34,6 +62,7 @@ inline time_t mktime(int year, int mon, int day, int hour, int min, int sec)
   tm.tm_mday = day;
   tm.tm_mon  = mon-1;
   tm.tm_year = year-1900;
+  tm.tm_isdst = -1;
 
   return mktime(&tm);
 }
@@ -44,7 +44,7 @@ void EsUrl::reinit(FileRecord *record, bool move)
   body_ = record->data->c_str();
   nbody_ = record->data->size();
 
-  std::string docIndex = *(record->esIndex);
+  std::string docIndex = record->esIndex->str();
   // docIndex = "debug";
 
   nheader_ = snprintf(header_, MAX_HTTP_HEADER_LEN, ES_CREATE_INDEX_HEADER_TPL,
@@ -738,6 +738,7 @@ bool EsCtx::produce(std::vector<FileRecord *> *records)
   for (std::vector<FileRecord *>::iterator ite = records->begin(), end = records->end();
        ite != end; ++ite) {
     if ((*ite)->off == (off_t) -1) {
+      (*ite)->ctx->queueSizeDec(1, (*ite)->data->size());
       FileRecord::destroy(*ite);
       continue;
     }
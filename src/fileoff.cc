@@ -10,19 +10,26 @@
 #include "cnfctx.h"
 #include "luactx.h"
 #include "filereader.h"
+#include "logger.h"
 #include "fileoff.h"
 
+#define FILEOFF_SPARE 8192   // records for glob and catch-up files
+
 const size_t FileOff::MAX_FILENAME_LENGTH = 256;
 
 FileOff::FileOff()
 {
   cnf_  = 0;
   addr_ = MAP_FAILED;
+  spare_ = 0;
 }
 
 FileOff::~FileOff()
 {
   if (addr_ != MAP_FAILED) munmap(addr_, length_);
+  for (std::vector<FileOffRecord *>::iterator ite = spill_.begin(); ite != spill_.end(); ++ite) {
+    delete *ite;
+  }
 }
 
 bool FileOff::loadFromFile(char *errbuf)
@@ -58,7 +65,8 @@ bool FileOff::init(CnfCtx *cnf, char *errbuf)
 
 bool FileOff::reinit()
 {
-  length_ = sizeof(FileOffRecord) * cnf_->getLuaCtxs().size();
+  size_t spare = cnf_->getGlobCtxs().empty() && cnf_->getCatchup() == 0 ? 0 : FILEOFF_SPARE;
+  length_ = sizeof(FileOffRecord) * (cnf_->getLuaCtxs().size() + spare);
 
   if (addr_ != MAP_FAILED) {
     munmap(addr_, length_);
@@ -90,9 +98,33 @@ bool FileOff::reinit()
     ptr += sizeof(FileOffRecord);
   }
   memset(ptr, 0x00, (length_ - (ptr - (char *) addr_)));
+  spare_ = (FileOffRecord *) ptr;
+  free_.clear();
   return true;
 }
 
+FileOffRecord *FileOff::alloc()
+{
+  if (!free_.empty()) {
+    FileOffRecord *record = free_.back();
+    free_.pop_back();
+    return record;
+  }
+  if (spare_ && (char *) (spare_ + 1) <= (char *) addr_ + length_) return spare_++;
+
+  log_error(0, "fileoff %s has no spare record, offset is not saved", file_.c_str());
+  FileOffRecord *record = new FileOffRecord(0, 0);
+  spill_.push_back(record);
+  return record;
+}
+
+void FileOff::release(FileOffRecord *record)
+{
+  record->inode = 0;
+  record->off   = 0;
+  free_.push_back(record);
+}
+
 off_t FileOff::getOff(ino_t inode) const
 {
   std::map<ino_t, off_t>::const_iterator pos = map_.find(inode);
@@ -2,6 +2,7 @@
 #define _FILE_OFF_H_
 
 #include <map>
+#include <vector>
 #include <string>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,6 +30,12 @@ public:
 
   bool init(CnfCtx *cnf, char *errbuf);
   bool reinit();
+
+  /* a record for a file after reinit, matched by a glob or caught up,
+   * release it when the file is done with
+   */
+  FileOffRecord *alloc();
+  void release(FileOffRecord *record);
   off_t getOff(ino_t inode) const;
   bool setOff(ino_t inode, off_t off);
 
@@ -41,6 +48,9 @@ private:
   std::string  file_;
   void        *addr_;
   size_t      length_;
+  FileOffRecord *spare_;   // free records after the files of reinit
+  std::vector<FileOffRecord *> spill_;  // no spare left, not saved
+  std::vector<FileOffRecord *> free_;   // released, alloc again first
   std::map<ino_t, off_t> map_;
 };
 
@@ -1,6 +1,11 @@
 #include <cstring>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -11,10 +16,10 @@
 #include "sys.h"
 #include "metrics.h"
 #include "luactx.h"
+#include "lineindex.h"
 #include "filereader.h"
 
 #define NL                  '\n'
-#define MAX_LINE_LEN        8 * 1024 * 1024     // 8M
 #define MAX_TAIL_SIZE       50 * MAX_LINE_LEN   // 400M
 
 FileReader::StartPosition FileReader::stringToStartPosition(const char *s)
@@ -30,9 +35,13 @@ FileReader::FileReader(LuaCtx *ctx)
 {
   fd_     = -1;
   ctx_    = ctx;
-  buffer_ = new char[MAX_LINE_LEN];
+  buffer_ = 0;
   npos_   = 0;
+  bufferSize_ = bufferPeak_ = 0;
+  bufferTime_ = 0;
+  maxLineLen_ = MAX_LINE_LEN;
   flags_  = 0;
+  arena_  = new RecordArena;
 
   size_ = dsize_ = 0;
   line_ = dline_ = 0;
@@ -40,13 +49,27 @@ FileReader::FileReader(LuaCtx *ctx)
   fileRotateTime_ = ctx->cnf()->fasttime();
   holdFd_ = -1;
   eof_ = false;
-
+  sleeping_ = false;
+  mmap_ = false;
+  partial_ = 0;
+  zfile_ = 0;
+  budget_ = tailBytes_ = 0;
+  end_ = 0;
+  nulWait_ = true;
+  nulStart_ = nulScan_ = -1;
+  fragIndex_ = 0;
+  behind_ = false;
+  prefetchOff_ = 0;
+
+  fileOffRecord_ = 0;
   parent_ = 0;
 }
 
 FileReader::~FileReader()
 {
-  delete[] buffer_;
+  resizeBuffer(0);
+  arena_->destroy();
+  closeZFile();
   if (fd_ > 0) close(fd_);
   if (holdFd_ > 0) close(holdFd_);
 }
@@ -56,10 +79,12 @@ bool FileReader::tryOpen(char *errbuf)
 {
   const std::string &file = ctx_->datafile();
 
-  for (int i = 0; i < 15; ++i) {
+  // a glob file is opened when it is seen, do not hold the others
+  int tries = ctx_->globTemplate() ? 1 : 15;
+  for (int i = 0; i < tries; ++i) {
     fd_ = open(file.c_str(), O_RDONLY);
-    if (fd_ == -1) sleep(1);
-    else break;
+    if (fd_ != -1) break;
+    if (i+1 < tries) ::sleep(1);
   }
   if (fd_ == -1) {
     snprintf(errbuf, MAX_ERR_LEN, "%s open error: %s", file.c_str(), strerror(errno));
@@ -81,6 +106,14 @@ bool FileReader::init(char *errbuf)
 
   log_info(0, "open file %s fd %d inode %ld", ctx_->datafile().c_str(), fd_, inode_);
 
+  // all topics of the file share one reader, mmap if any of them wants
+  maxLineLen_ = 0;
+  for (LuaCtx *ctx = ctx_; ctx; ctx = ctx->next()) {
+    if (ctx->mmapTail()) mmap_ = true;
+    maxLineLen_ = std::max(maxLineLen_, ctx->maxLineLen());
+  }
+  resizeBuffer(std::min(maxLineLen_, (size_t) MIN_BUFFER_LEN));
+
   bits_set(flags_, FILE_WATCHED);
   if (ctx_->datafile() != ctx_->file()) {
     bits_set(flags_, FILE_HISTORY);
@@ -91,13 +124,45 @@ bool FileReader::init(char *errbuf)
     } else {
       log_info(0, "open file %s fd %d as holdFd", ctx_->file().c_str(), holdFd_);
     }
+
+    if (!openZFile()) {
+      snprintf(errbuf, MAX_ERR_LEN, "history file %s open as compressed error", ctx_->datafile().c_str());
+      return false;
+    }
+    if (!zfile_) ctx_->setHistoryInode(ctx_->datafile(), inode_);
+  } else if (ctx_->catchup() && !openZFile()) {
+    snprintf(errbuf, MAX_ERR_LEN, "catchup file %s open as compressed error", ctx_->file().c_str());
+    return false;
   }
 
-  MD5_Init(&md5Ctx_);
-  md5_.clear();
+  checksum_.init(ctx_->checksum());
   return setStartPosition(st.st_size, errbuf);
 }
 
+/* logrotate may compress the rotated file, read the history file through ZFile if so */
+bool FileReader::openZFile()
+{
+  closeZFile();
+
+  ZFile::Type type = ZFile::detect(fd_);
+  if (type == ZFile::NONE) return true;
+
+  zfile_ = ZFile::create(fd_, type, ctx_->datafile());
+  if (!zfile_) return false;
+
+  log_info(0, "%d %s is %s compressed, read decompressed", fd_, ctx_->datafile().c_str(),
+           ZFile::typeToString(type));
+  return true;
+}
+
+void FileReader::closeZFile()
+{
+  if (zfile_) {
+    delete zfile_;
+    zfile_ = 0;
+  }
+}
+
 bool FileReader::checkRewatch()
 {
   assert(parent_ == 0);
@@ -159,7 +224,7 @@ bool FileReader::reinit()
   bool tryNext = true;
   while (reopen && tryNext) {
     tryNext = false;
-    const std::string &file = ctx_->datafile();
+    const std::string file = ctx_->datafile();
     log_info(0, "reopen %s", file.c_str());
 
     bool doOpen = false;
@@ -174,25 +239,44 @@ bool FileReader::reinit()
       doOpen = true;
     }
 
+    if (fd_ != -1 && bits_test(flags_, FILE_HISTORY) && !openZFile()) {
+      close(fd_);
+      fd_ = -1;
+    }
+
     if (fd_ != -1) {
       struct stat st;
       fstat(fd_, &st);
       size_ = 0;
+      partial_ = 0;
       line_ = 0;
       npos_ = 0;
+      fragIndex_ = 0;
       inode_ = st.st_ino;
       bits_clear(flags_, FILE_OPENONLY);
 
-      MD5_Init(&md5Ctx_);
-      md5_.clear();
+      checksum_.init(ctx_->checksum());
 
       if (doOpen) log_info(0, "open file %s fd %d inode %ld", file.c_str(), fd_, inode_);
       else log_info(0, "%d %s use holdFd instead of reopen inode %ld", fd_, ctx_->datafile().c_str(), inode_);
 
-      tail2kafka(START, &st, buildFileStartRecord(time(0)));
+      off_t off = zfile_ ? compressedOff() : -1;
+      if (off > 0) {   // compressed while half read, go on in the same stream
+        size_ = zfile_->skip(off);
+        log_info(0, "%d %s goes on from fileoff %ld of the file it was compressed from",
+                 fd_, file.c_str(), (long) size_);
+        tail2kafka();
+      } else {
+        if (bits_test(flags_, FILE_HISTORY) && !zfile_) ctx_->setHistoryInode(file, inode_);
+        tail2kafka(START, &st, buildFileStartRecord(time(0)));
+      }
     } else if (bits_test(flags_, FILE_HISTORY)) {
-      if (ctx_->removeHistoryFile()) bits_clear(flags_, FILE_HISTORY);
-      log_fatal(errno, "history file %s reinit error, try next %s", file.c_str(), ctx_->datafile().c_str());
+      if (errno == ENOENT && ctx_->followCompressedHistoryFile()) {
+        log_info(0, "history file %s was compressed, try %s", file.c_str(), ctx_->datafile().c_str());
+      } else {
+        if (ctx_->removeHistoryFile()) bits_clear(flags_, FILE_HISTORY);
+        log_fatal(errno, "history file %s reinit error, try next %s", file.c_str(), ctx_->datafile().c_str());
+      }
       tryNext = true;
     } else {
       log_error(errno, "%s reinit error", file.c_str());
@@ -214,6 +298,23 @@ bool FileReader::setStartPosition(off_t fileSize, char *errbuf)
   assert(parent_ == 0);
 
   StartPosition startPosition = stringToStartPosition(ctx_->getStartPosition());
+
+  // decompressed size is unknown, the compressed history file starts from fileoff or 0
+  if (zfile_) {
+    off_t off = startPosition == FileReader::START ? 0 : ctx_->cnf()->getFileOff()->getOff(inode_);
+    if (off == (off_t) -1) off = compressedOff();
+    if (off == (off_t) -1) {
+      size_ = 0;
+      log_error(0, "%s fileoff notfound, set to start", ctx_->datafile().c_str());
+    } else {
+      size_ = zfile_->skip(off);
+      if (size_ != off) {
+        log_error(0, "%s fileoff %ld exceed, set to end %ld", ctx_->datafile().c_str(), (long) off, (long) size_);
+      }
+    }
+    return true;
+  }
+
   if (startPosition == FileReader::LOG_START) {
     size_ = ctx_->cnf()->getFileOff()->getOff(inode_);
     if (size_ == (off_t) -1 || size_ > fileSize) {
@@ -236,6 +337,31 @@ bool FileReader::setStartPosition(off_t fileSize, char *errbuf)
   return true;
 }
 
+bool FileReader::setRange(off_t start, off_t end)
+{
+  assert(parent_ == 0);
+
+  if (zfile_ || start < 0 || end <= start) {
+    log_fatal(0, "%s range %ld-%ld is invalid", ctx_->file().c_str(), (long) start, (long) end);
+    return false;
+  }
+
+  size_ = start;
+  end_  = end;
+  lseek(fd_, size_, SEEK_SET);
+  return true;
+}
+
+off_t FileReader::compressedOff() const
+{
+  ino_t inode = ctx_->compressedInode();
+  if (inode == 0) return -1;
+
+  // running, the record has the off sent; at startup the one loaded
+  if (fileOffRecord_ && fileOffRecord_->inode == inode) return fileOffRecord_->off;
+  return ctx_->cnf()->getFileOff()->getOff(inode);
+}
+
 void FileReader::initFileOffRecord(FileOffRecord * fileOffRecord)
 {
   assert(parent_ == 0);
@@ -249,7 +375,7 @@ void FileReader::initFileOffRecord(FileOffRecord * fileOffRecord)
 void FileReader::updateFileOffRecord(const FileRecord *record)
 {
   ctx_->cnf()->stats()->logSendInc();
-  ctx_->cnf()->stats()->queueSizeDec();
+  ctx_->queueSizeDec(1, record->data->size());
 
   if (record->off == (off_t) -1) {
     return;
@@ -344,6 +470,7 @@ void FileReader::tagRotate(int action, const char *oldFile, const char *newFile)
 
   if (oldFile && (bits_test(flags_, FILE_MOVED) || bits_test(flags_, FILE_CREATED))) {
     ctx_->setCurrentFile(oldFile);
+    ctx_->setHistoryInode(oldFile, inode_);
   }
 
   if (ctx_->cnf()->fasttime() - fileRotateTime_ < QUEUE_ERROR_TIMEOUT ||
@@ -357,25 +484,62 @@ void FileReader::checkHistoryRotate(const struct stat *stPtr)
 {
   assert(parent_ == 0);
 
-  if (bits_test(flags_, FILE_HISTORY) && stPtr->st_size == size_) {
+  bool historyEnd = zfile_ ? zfile_->eof() : stPtr->st_size == size_ + partial_;
+  if (bits_test(flags_, FILE_HISTORY) && historyEnd) {
     std::string oldFile = ctx_->datafile();
 
     if (tail2kafka(END, stPtr, buildFileEndRecord(time(0), size_, oldFile.c_str()))) {
-      log_info(0, "%d %s size=%lu sendsize=%lu lines=%lu sendlines=%lu md5=%s historyrotate %s",
-               fd_, oldFile.c_str(), size_, dsize_, line_, dline_, md5_.c_str(), oldFile.c_str());
-      util::Metrics::pingback("ROTATE", "file=%s&size=%lu&md5=%s", oldFile.c_str(), size_, md5_.c_str());
+      log_info(0, "%d %s size=%lu sendsize=%lu lines=%lu sendlines=%lu %s=%s historyrotate %s",
+               fd_, oldFile.c_str(), size_, dsize_, line_, dline_, checksum_.name(), checksum_.hex().c_str(),
+               oldFile.c_str());
+      util::Metrics::pingback("ROTATE", "file=%s&size=%lu&%s=%s", oldFile.c_str(), size_,
+                              checksum_.name(), checksum_.hex().c_str());
 
       bits_set(flags_, FILE_OPENONLY);
       if (ctx_->removeHistoryFile()) bits_clear(flags_, FILE_HISTORY);
 
       log_info(0, "history file %s finished, close fd %d try next %s",
                oldFile.c_str(), fd_, ctx_->datafile().c_str());
+      closeZFile();
       close(fd_);
       fd_ = -1;
     }
   }
 }
 
+bool FileReader::finishCatchup()
+{
+  assert(parent_ == 0);
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    log_fatal(errno, "%d %s fstat error", fd_, ctx_->file().c_str());
+    return false;
+  }
+
+  bool end = zfile_ ? zfile_->eof() : (end_ > 0 ? size_ + partial_ == end_ : st.st_size == size_ + partial_);
+  if (!end) return false;
+
+  checkCache();   // aggregate flushes before END
+  if (!tail2kafka(END, &st, buildFileEndRecord(time(0), size_, ctx_->file().c_str()))) return false;
+
+  log_info(0, "%d %s size=%lu sendsize=%lu lines=%lu sendlines=%lu %s=%s catchup finished as %s",
+           fd_, ctx_->file().c_str(), size_, dsize_, line_, dline_, checksum_.name(), checksum_.hex().c_str(),
+           ctx_->host().c_str());
+  util::Metrics::pingback("ROTATE", "file=%s&size=%lu&%s=%s", ctx_->file().c_str(), size_,
+                          checksum_.name(), checksum_.hex().c_str());
+
+  closeZFile();
+  close(fd_);
+  fd_ = -1;
+  return true;
+}
+
+off_t FileReader::readOffset() const
+{
+  return fd_ == -1 ? 0 : lseek(fd_, 0, SEEK_CUR);
+}
+
 // when mv x to x.old, the process may still write to x.old untill reopen x
 // we wait use roateDelay to reduce data lose
 bool FileReader::waitRotate()
@@ -417,8 +581,8 @@ bool FileReader::checkRotate(const struct stat *stPtr, std::string *rotateFileNa
   if (bits_test(flags_, FILE_HISTORY) || fd_ == -1) { // FILE_HISTORY exec flow #HISTORY_ROTATE
     rc = false;
   } else {
-    if (stPtr->st_size != size_) rc = tail2kafka(NIL, stPtr, 0);   // waiting for file sending to complete
-    if (stPtr->st_size == size_) {
+    if (stPtr->st_size != size_ + partial_) rc = tail2kafka(NIL, stPtr, 0);   // waiting for file sending to complete
+    if (stPtr->st_size == size_ + partial_) {
       rc = tail2kafka(END, stPtr, buildFileEndRecord(time(0), size_, oldFileName.c_str()));
     }
   }
@@ -447,6 +611,7 @@ bool FileReader::checkRotate(const struct stat *stPtr, std::string *rotateFileNa
 bool FileReader::remove()
 {
   assert(parent_ == 0);
+  if (sleeping_) return false;
 
   struct stat st;
   if (fstat(fd_, &st) != 0) {
@@ -458,7 +623,7 @@ bool FileReader::remove()
   checkHistoryRotate(&st);
 
   if (st.st_nlink == 0) bits_set(flags_, FILE_DELETED);
-  else if (st.st_size < size_) bits_set(flags_, FILE_TRUNCATED);
+  else if (!zfile_ && st.st_size < size_) bits_set(flags_, FILE_TRUNCATED);
   else if (st.st_ino != inode_) bits_set(flags_, FILE_ICHANGE);
 
   std::string timeFormatFile;
@@ -478,12 +643,15 @@ bool FileReader::remove()
   if (rc) {
     if (closeFd) {
       const char *oldFile = rotateFileName.empty() ? "NIL" : rotateFileName.c_str();
-      log_info(0, "%d %s size=%lu sendsize=%lu lines=%lu sendlines=%lu md5=%s %s %s, close fd %d", fd_, ctx_->file().c_str(),
-               size_, dsize_, line_, dline_, md5_.c_str(), flagsToString(flags_).c_str(), oldFile, fd_);
+      log_info(0, "%d %s size=%lu sendsize=%lu lines=%lu sendlines=%lu %s=%s %s %s, close fd %d", fd_, ctx_->file().c_str(),
+               size_, dsize_, line_, dline_, checksum_.name(), checksum_.hex().c_str(),
+               flagsToString(flags_).c_str(), oldFile, fd_);
 
-      util::Metrics::pingback("ROTATE", "file=%s&size=%lu&md5=%s", oldFile, size_, md5_.c_str());
+      util::Metrics::pingback("ROTATE", "file=%s&size=%lu&%s=%s", oldFile, size_,
+                              checksum_.name(), checksum_.hex().c_str());
 
       // TODO add inode file
+      closeZFile();
       close(fd_);
       fd_ = -1;
       flags_ = 0;
@@ -496,6 +664,81 @@ bool FileReader::remove()
   return rc;
 }
 
+bool FileReader::sleep()
+{
+  assert(parent_ == 0);
+  if (sleeping_ || fd_ == -1 || flags_ != FILE_WATCHED || !eof_ || npos_ != 0 || zfile_ || holdFd_ != -1) {
+    return false;
+  }
+  // wake seeks to size_, a partial line mmap left in the file must be there
+  if (lseek(fd_, 0, SEEK_CUR) != size_) return false;
+
+  log_debug(0, "%d %s idle, close it at %ld", fd_, ctx_->file().c_str(), (long) size_);
+  close(fd_);
+  fd_ = -1;
+  resizeBuffer(0);
+  sleeping_ = true;
+  return true;
+}
+
+/* inode under another name in the directory of file, -1 none */
+static int openInode(const char *file, ino_t inode)
+{
+  std::string dir(file);
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) return -1;
+
+  int fd = -1;
+  struct dirent *ent;
+  while (fd == -1 && (ent = readdir(dp))) {
+    if (ent->d_ino != inode) continue;
+
+    struct stat st;
+    fd = open((dir + "/" + ent->d_name).c_str(), O_RDONLY);
+    if (fd != -1 && (fstat(fd, &st) != 0 || st.st_ino != inode)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  closedir(dp);
+  return fd;
+}
+
+bool FileReader::wake(const char *file)
+{
+  assert(parent_ == 0);
+  if (!sleeping_) return true;
+  sleeping_ = false;
+
+  if (!file) file = ctx_->file().c_str();
+  int fd = open(file, O_RDONLY);
+
+  struct stat st;
+  if (fd != -1 && (fstat(fd, &st) != 0 || st.st_ino != inode_)) {
+    close(fd);
+    fd = -1;
+  }
+  // rotated while closed, the name may be the new file already, the rest of the old one goes first
+  if (fd == -1 && (fd = openInode(file, inode_)) != -1) {
+    log_info(0, "%s inode %ld was rotated while closed, read it on", file, (long) inode_);
+  }
+  if (fd == -1) {
+    // lines written after the close and before the rotate are lost
+    log_error(0, "%s inode %ld was rotated while closed and is gone, read it as a new file", file, (long) inode_);
+    flags_ = 0;
+    return false;
+  }
+
+  fd_ = fd;
+  lseek(fd_, size_, SEEK_SET);
+  resizeBuffer(std::min(maxLineLen_, (size_t) MIN_BUFFER_LEN));
+  log_debug(0, "%d %s wake up at %ld", fd_, file, (long) size_);
+  return true;
+}
+
 bool FileReader::setStartPositionEnd(off_t fileSize, char *errbuf)
 {
   assert(parent_ == 0);
@@ -505,22 +748,26 @@ bool FileReader::setStartPositionEnd(off_t fileSize, char *errbuf)
     return true;
   }
 
-  off_t min = std::min(fileSize, (off_t) MAX_LINE_LEN);
-  lseek(fd_, fileSize - min, SEEK_SET);
-
-  if (read(fd_, buffer_, MAX_LINE_LEN) != min) {
-    snprintf(errbuf, MAX_ERR_LEN, "read %s less min %s", ctx_->file().c_str(), errno == 0 ? "" : strerror(errno));
-    return false;
-  }
+  // scan back for the last NL, one buffer at a time
+  off_t min = std::max(fileSize - (off_t) maxLineLen_, (off_t) 0);
+  for (off_t end = fileSize; end > min; ) {
+    size_t n = std::min(end - min, (off_t) bufferSize_);
+    if (pread(fd_, buffer_, n, end - n) != (ssize_t) n) {
+      snprintf(errbuf, MAX_ERR_LEN, "read %s less min %s", ctx_->file().c_str(), errno == 0 ? "" : strerror(errno));
+      return false;
+    }
 
-  char *pos = (char *) memrchr(buffer_, NL, min);
-  if (!pos) {
-    snprintf(errbuf, MAX_ERR_LEN, "%s line length bigger than %ld", ctx_->file().c_str(), (long) min);
-    return false;
+    char *pos = (char *) memrchr(buffer_, NL, n);
+    if (pos) {
+      size_ = end - n + (pos+1 - buffer_);
+      lseek(fd_, fileSize, SEEK_SET);
+      return true;
+    }
+    end -= n;
   }
 
-  size_ = fileSize - (min - (pos+1 - buffer_));
-  return true;
+  snprintf(errbuf, MAX_ERR_LEN, "%s line length bigger than %ld", ctx_->file().c_str(), (long) (fileSize - min));
+  return false;
 }
 
 bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::string *rawData)
@@ -528,7 +775,14 @@ bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::st
   assert(parent_ == 0);
 
   std::auto_ptr<std::string> rawDataPtr(rawData);
-  if (ctx_->cnf()->flowControlOn()) return false;
+
+  off_t budget = budget_;   // for this call only
+  budget_ = 0;
+  tailBytes_ = 0;
+  if (flowControlOn()) {
+    eof_ = false;   // read on when the queue drains
+    return false;
+  }
 
   struct stat stat;
   if (stPtr == 0) {
@@ -539,28 +793,39 @@ bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::st
     stPtr = &stat;
   }
 
-  off_t off = lseek(fd_, 0, SEEK_CUR);  // get last read seek
+  off_t off = zfile_ ? zfile_->offset() : lseek(fd_, 0, SEEK_CUR);  // get last read seek
   if (off == (off_t) -1) {
     log_fatal(errno, "%d %s lseek error", fd_, ctx_->file().c_str());
     return false;
   }
 
-  if (off > stPtr->st_size) {
+  if (!zfile_ && off > stPtr->st_size) {
     bits_set(flags_, FILE_TRUNCATED);
     return true;
   }
 
   bool fileStart = (pos == START || size_ == 0);
+  nulWait_ = pos != END && !ctx_->catchup();   // trailing NULs may be written yet
 
-  if (stPtr->st_size - off > MAX_TAIL_SIZE) { // limit tailsize
+  off_t diskOff = zfile_ ? lseek(fd_, 0, SEEK_CUR) : off;
+  off_t window = ctx_->cnf()->getPrefetch();
+  behind_ = window > 0 && stPtr->st_size - diskOff > window;
+
+  if (zfile_) {  // decompressed size is known at the end of stream
+    size_ = zfile_->eof() ? off : off + MAX_TAIL_SIZE;
+  } else if (stPtr->st_size - off > MAX_TAIL_SIZE) { // limit tailsize
     log_info(0, "%d %s limit tail, off %ld, size %ld",
              fd_, ctx_->datafile().c_str(), off, stPtr->st_size);
 
     size_ = off + MAX_TAIL_SIZE;
-    ctx_->cnf()->setTailLimit(true);
+    if (!ctx_->catchup()) ctx_->cnf()->setTailLimit(true);  // catch-up threads loop by themselves
   } else {
     size_ = stPtr->st_size;
   }
+  if (end_ > 0 && size_ > end_) size_ = end_;
+
+  bool limited = budget > 0 && size_ - off > budget;
+  if (limited) size_ = off + budget;
 
   if (size_ > 0 && fileStart) {
     if (pos == START) propagateRawData(rawDataPtr.release());
@@ -572,63 +837,414 @@ bool FileReader::tail2kafka(StartPosition pos, const struct stat *stPtr, std::st
 
   eof_ = true;
 
+  off_t start = off;
+  if (!(mmap_ && !zfile_ ? tailMmap(&off, &loff) : tailRead(&off, &loff))) return false;
+  tailBytes_ = off - start;
+  if (limited) eof_ = false;
+  if (behind_) dropBehind(diskOff, lseek(fd_, 0, SEEK_CUR));
+
+  if (zfile_ && !zfile_->eof()) {
+    eof_ = false;
+    if (!ctx_->catchup()) ctx_->cnf()->setTailLimit(true);
+  }
+
+  if (pos == END && size_ > 0) {  // ignore empty file
+    if (!flushPartialLine(&off, &loff)) return false;
+    assert(off == (zfile_ || end_ ? size_ : stPtr->st_size));
+    propagateRawData(rawDataPtr.release());
+  }
+
+  return eof_;
+}
+
+/* lines of the file go to every topic of the chain, one congested topic holds the file */
+bool FileReader::flowControlOn()
+{
+  if (ctx_->cnf()->flowControlOn()) return true;
+  for (LuaCtx *ctx = ctx_; ctx; ctx = ctx->next()) {
+    if (ctx->congested()) return true;
+  }
+  return false;
+}
+
+bool FileReader::tailRead(off_t *offPtr, off_t *loffPtr)
+{
+  off_t off = *offPtr;
   while (off < size_) {
-    size_t min = std::min(size_ - off, (off_t) (MAX_LINE_LEN - npos_));
+    size_t min = std::min(size_ - off, (off_t) (bufferSize_ - npos_));
     assert(min > 0);
-    ssize_t nn = read(fd_, buffer_ + npos_, min);
+    if (behind_) prefetch(zfile_ ? lseek(fd_, 0, SEEK_CUR) : off);
+    ssize_t nn = zfile_ ? zfile_->read(buffer_ + npos_, min) : read(fd_, buffer_ + npos_, min);
     if (nn == -1) {
       log_fatal(errno, "%d %s read error", fd_, ctx_->datafile().c_str());
       return false;
+    } else if (nn == 0 && zfile_) {  // end of stream
+      size_ = off;
+      break;
     } else if (nn == 0) { // file was truncated
       bits_set(flags_, FILE_TRUNCATED);
       break;
     }
     off += nn;
+    npos_ += nn;
+    if (npos_ > bufferPeak_) bufferPeak_ = npos_;
+
+    off_t nulStart, nulEnd;
+    if (!zfile_ && findNul(buffer_ + npos_ - nn, nn, off - nn, &nulStart, &nulEnd)) {
+      npos_ -= off - nulStart;   // lines before the NULs
+      propagateProcessLines(inode_, loffPtr);
+
+      if (nulEnd == -1) {   // read them again when more is written
+        off = size_ = nulStart;
+        lseek(fd_, off, SEEK_SET);
+        break;
+      }
+      skipNul(nulStart, nulEnd, npos_);
+      npos_ = 0;
+      off = *loffPtr = nulEnd;
+      if (off > size_) size_ = off;
+    } else {
+      propagateProcessLines(inode_, loffPtr);
+    }
 
-    propagateTailContent(nn);
-    propagateProcessLines(inode_, &loff);
-
-    if (ctx_->cnf()->flowControlOn()) {
+    if (flowControlOn()) {
       size_ = off;
       eof_ = false;
       break;
     }
   }
 
-  if (pos == END && size_ > 0) {  // ignore empty file
-    assert(off == stPtr->st_size);
-    propagateRawData(rawDataPtr.release());
+  *offPtr = off;
+  return true;
+}
+
+/* a copytruncate while the file is mapped, touching the pages truncated away raises SIGBUS.
+ * the handler maps zero pages over the rest of the mapping and returns, no jump over lua or
+ * the allocator. the scan sees NULs there and tailMmap checks the size again after it
+ */
+static __thread const char *mmapStart = 0;
+static __thread size_t mmapLength = 0;
+static __thread bool mmapFault = false;
+static long pageSize = 0;
+
+static void sigbusHandler(int signo, siginfo_t *info, void *)
+{
+  const char *addr = (const char *) info->si_addr;
+  if (mmapStart && addr >= mmapStart && addr < mmapStart + mmapLength) {
+    char *page = (char *) ((uintptr_t) addr & ~(uintptr_t) (pageSize - 1));
+    size_t length = mmapStart + mmapLength - page;
+    if (mmap(page, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      mmapFault = true;
+      return;
+    }
   }
 
-  return eof_;
+  signal(signo, SIG_DFL);
+  raise(signo);
 }
 
-void FileReader::propagateTailContent(size_t size)
+static pthread_once_t sigbusOnce = PTHREAD_ONCE_INIT;
+
+static void installSigbusHandler()
 {
-  assert(parent_ == 0);
+  pageSize = sysconf(_SC_PAGESIZE);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = sigbusHandler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGBUS, &sa, 0) == -1) log_fatal(errno, "sigaction SIGBUS error");
+}
 
-  LuaCtx *ctx = ctx_->next();
-  while (ctx) {
-    FileReader *f = ctx->getFileReader();
-    memcpy(f->buffer_ + f->npos_, buffer_ + npos_, size);
-    f->npos_ += size;
+/* scan lines straight out of the mapping of [off, size_), no copy no memmove,
+ * the partial trailing line is left in the file, seek back and reread it next time
+ */
+bool FileReader::tailMmap(off_t *offPtr, off_t *loffPtr)
+{
+  const off_t off = *offPtr;
+  partial_ = 0;
+  if (off >= size_) return true;
 
-    ctx = ctx->next();
+  pthread_once(&sigbusOnce, installSigbusHandler);
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    log_fatal(errno, "%d %s fstat error", fd_, ctx_->datafile().c_str());
+    return false;
+  }
+  if (st.st_size < off) {
+    bits_set(flags_, FILE_TRUNCATED);
+    return true;
+  }
+  if (st.st_size < size_) size_ = st.st_size;
+  if (off == size_) return true;
+
+  const off_t start = off & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+  const size_t length = size_ - start;
+
+  char *map = (char *) mmap(0, length, PROT_READ, MAP_SHARED, fd_, start);
+  if (map == MAP_FAILED) {
+    log_fatal(errno, "%d %s mmap %ld-%ld error", fd_, ctx_->datafile().c_str(), (long) off, (long) size_);
+    return false;
+  }
+  madvise(map, length, MADV_SEQUENTIAL);
+  mmapStart = map;
+  mmapLength = length;
+  mmapFault = false;
+
+  const char *buffer = map + (off - start);
+  const size_t size = size_ - off;
+  size_t pos = 0;
+  off_t skipTo = -1;   // NULs go on past the mapping
+
+  while (pos < size) {
+    size_t min = std::min(size - pos, maxLineLen_);
+    if (behind_) prefetch(off + pos);
+
+    off_t nulStart, nulEnd;
+    if (findNul(buffer + pos, min, off + pos, &nulStart, &nulEnd)) {
+      pos += propagateProcessLines(inode_, loffPtr, buffer + pos, nulStart - off - pos);
+      if (mmapFault || nulEnd == -1) break;   // the partial line and NULs are left in the file
+
+      skipNul(nulStart, nulEnd, nulStart - off - pos);
+      *loffPtr = nulEnd;
+      if (nulEnd >= off + (off_t) size) {
+        skipTo = nulEnd;
+        break;
+      }
+      pos = nulEnd - off;
+      continue;
+    }
+
+    size_t n = propagateProcessLines(inode_, loffPtr, buffer + pos, min);
+    if (mmapFault) {
+      pos += n;
+      break;
+    }
+    if (n == 0) {
+      if (min < maxLineLen_) {  // partial line, wait for NL
+        partial_ = min;
+        break;
+      }
+
+      propagateFragment(inode_, loffPtr, buffer + pos, min);
+      n = min;
+    }
+    pos += n;
+
+    if (flowControlOn()) {
+      eof_ = false;
+      break;
+    }
   }
 
-  npos_ += size;
+  munmap(map, length);
+  mmapStart = 0;
+
+  // size_ is what is consumed, the partial line is not, sleep/wake and tailBytes_ see it so
+  size_ = skipTo != -1 ? skipTo : off + pos;
+  lseek(fd_, size_, SEEK_SET);
+  *offPtr = size_;
+
+  if (mmapFault) {
+    partial_ = 0;
+    if (fstat(fd_, &st) == 0 && st.st_size < size_) {
+      log_error(0, "%d %s truncated to %ld while mapped", fd_, ctx_->datafile().c_str(), (long) st.st_size);
+      bits_set(flags_, FILE_TRUNCATED);
+    }
+  }
+  return true;
 }
 
+/* the line is sent as if it ended with NL, read() holds it in buffer_, mmap left it in the file */
+bool FileReader::flushPartialLine(off_t *offPtr, off_t *loffPtr)
+{
+  if (partial_ > 0) {
+    if ((size_t) partial_ >= bufferSize_) resizeBuffer(partial_ + 1);
+    if (pread(fd_, buffer_, partial_, *offPtr) != partial_) {
+      log_fatal(errno, "%d %s pread %ld-%ld error", fd_, ctx_->datafile().c_str(),
+                (long) *offPtr, (long) (*offPtr + partial_));
+      return false;
+    }
+    npos_ = partial_;
+    *offPtr += partial_;
+    size_ = *offPtr;
+    lseek(fd_, size_, SEEK_SET);
+    partial_ = 0;
+  }
+  if (npos_ == 0) return true;
+
+  log_info(0, "%d %s last line without NL at %ld", fd_, ctx_->datafile().c_str(), (long) *loffPtr);
+  if (npos_ == bufferSize_) resizeBuffer(bufferSize_ + 1);
+  buffer_[npos_++] = NL;
+  propagateProcessLines(inode_, loffPtr);
+  return true;
+}
+
+/* WILLNEED the window after pos, again when half of it is read */
+void FileReader::prefetch(off_t pos)
+{
+  off_t window = ctx_->cnf()->getPrefetch();
+  if (prefetchOff_ < pos || prefetchOff_ > pos + window) prefetchOff_ = pos;  // reopened or seeked
+  if (prefetchOff_ - pos > window / 2) return;
+
+  int rc = posix_fadvise(fd_, prefetchOff_, pos + window - prefetchOff_, POSIX_FADV_WILLNEED);
+  if (rc != 0) log_error(rc, "%d %s fadvise WILLNEED at %ld error", fd_, ctx_->datafile().c_str(), (long) pos);
+  prefetchOff_ = pos + window;
+}
+
+/* only whole pages of [start, end), the partial last page is read again next time */
+void FileReader::dropBehind(off_t start, off_t end)
+{
+  const off_t mask = ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+  start &= mask;
+  end &= mask;
+  if (end <= start) return;
+
+  int rc = posix_fadvise(fd_, start, end - start, POSIX_FADV_DONTNEED);
+  if (rc != 0) log_error(rc, "%d %s fadvise DONTNEED at %ld error", fd_, ctx_->datafile().c_str(), (long) start);
+}
+
+/* the first NUL region of buffer at file offset off, a run of MIN_NUL_RUN or more,
+ * or one to the end of the file, -1 end if it may be written yet. shorter runs are data
+ */
+bool FileReader::findNul(const char *buffer, size_t size, off_t off, off_t *start, off_t *end)
+{
+  const char *p = buffer, *last = buffer + size, *zero;
+  while (p < last && (zero = (const char *) memchr(p, 0, last - p))) {
+    size_t r = zeroRun(zero, last - zero);
+    *start = off + (zero - buffer);
+    *end   = *start + r;
+
+    if (zero + r == last && (*end = nulEnd(*start, *end)) == -1) {
+      if (!nulWait_) *end = nulScan_;   // the file is done with, skip the NULs seen
+      return true;
+    }
+    if (*end - *start >= MIN_NUL_RUN) return true;
+    p = zero + r;
+  }
+  return false;
+}
+
+/* end of the NUL run of start going on at off, holes are not read, NULs are read
+ * at most NUL_SCAN_LEN a call. -1 if no data after it yet, nulScan_ is how far it is NUL
+ */
+off_t FileReader::nulEnd(off_t start, off_t off)
+{
+  if (start == nulStart_ && nulScan_ > off) off = nulScan_;   // seen last time
+
+  char buffer[NUL_SCAN_BUFFER];
+  off_t pos = lseek(fd_, 0, SEEK_CUR);
+  off_t end = -1;
+
+  for (off_t scan = 0; scan < NUL_SCAN_LEN; ) {
+    off_t data = lseek(fd_, off, SEEK_DATA);
+    if (data == -1 && errno == ENXIO) {   // a hole to the end
+      struct stat st;
+      if (fstat(fd_, &st) == 0 && st.st_size > off) off = st.st_size;
+      break;
+    }
+    if (data > off) off = data;
+
+    ssize_t n = pread(fd_, buffer, sizeof(buffer), off);
+    if (n <= 0) break;
+
+    size_t z = zeroRun(buffer, n);
+    off += z;
+    if (z < (size_t) n) {
+      end = off;
+      break;
+    }
+    scan += n;
+  }
+  lseek(fd_, pos, SEEK_SET);
+
+  nulStart_ = end == -1 ? start : -1;
+  nulScan_  = off;
+  return end;
+}
+
+void FileReader::skipNul(off_t start, off_t end, size_t partial)
+{
+  if (partial > 0) {
+    log_error(0, "%d %s drop partial line %ld-%ld before NUL", fd_, ctx_->file().c_str(),
+              (long) (start - partial), (long) start);
+  }
+  log_error(0, "%d %s skip NUL %ld-%ld", fd_, ctx_->file().c_str(), (long) start, (long) end);
+
+  ctx_->cnf()->stats()->nulSkipInc(end - start);
+  nulStart_ = -1;
+  fragIndex_ = 0;   // a line sent in fragments is torn too
+  lseek(fd_, end, SEEK_SET);
+}
+
+/* every topic of the file scans the same buffer_, no copy per topic */
 void FileReader::propagateProcessLines(ino_t inode, off_t *off)
 {
   assert(parent_ == 0);
 
+  size_t n = propagateProcessLines(inode, off, buffer_, npos_);
+
+  if (n == 0) {
+    if (npos_ < bufferSize_) {
+      // partial line, wait for NL
+    } else if (bufferSize_ < maxLineLen_) {
+      resizeBuffer(std::min(bufferSize_ * 2, maxLineLen_));
+    } else {
+      propagateFragment(inode, off, buffer_, npos_);
+      npos_ = 0;
+    }
+  } else if (npos_ > n) {
+    npos_ -= n;
+    memmove(buffer_, buffer_ + n, npos_);
+  } else {
+    npos_ = 0;
+  }
+}
+
+// every topic stops at the same NL, so the bytes consumed are the same
+size_t FileReader::propagateProcessLines(ino_t inode, off_t *off, const char *buffer, size_t size)
+{
+  assert(parent_ == 0);
+
+  lines_.clear();
+  bool indexed = false;
+
+  size_t n = 0;
   LuaCtx *ctx = ctx_;
   while (ctx) {
-    ctx->getFileReader()->processLines(inode, off);
+    if (!indexed && !ctx->copyRawRequired()) {
+      indexLines(buffer, size, &lines_);   // index once, shared by all topics
+      indexed = true;
+    }
+
+    n = ctx->getFileReader()->processLines(inode, off, buffer, size, lines_);
     ctx = ctx->next();
     off = 0;   // only first topic have off
   }
+  if (n > 0) fragIndex_ = 0;
+  return n;
+}
+
+void FileReader::propagateFragment(ino_t inode, off_t *off, const char *buffer, size_t size)
+{
+  assert(parent_ == 0);
+
+  off_t *offPtr = off;
+  for (LuaCtx *ctx = ctx_; ctx; ctx = ctx->next()) {
+    std::vector<FileRecord *> *records = RecordArena::batch();
+    int n = ctx->function()->fragment(offPtr ? *offPtr : -1, buffer, size, fragIndex_, false, records);
+    if (n == 0 && fragIndex_ == 0) {
+      log_error(0, "%s %s line length exceed, drop", ctx_->file().c_str(), ctx->topic().c_str());
+    }
+    ctx->getFileReader()->sendLines(inode, records);
+    offPtr = 0;   // only first topic have off
+  }
+
+  if (ctx_->checksum() != Checksum::NONE) checksum_.update(buffer, size);
+  if (off) *off += size;
+  fragIndex_++;
 }
 
 std::string *FileReader::buildFileStartRecord(time_t now)
@@ -639,7 +1255,7 @@ std::string *FileReader::buildFileStartRecord(time_t now)
 
   char buffer[8192];
   int n = snprintf(buffer, 8192, "#%s {\"time\":\"%s\", \"event\":\"START\"}",
-                   ctx_->cnf()->host().c_str(), dt.c_str());
+                   ctx_->host().c_str(), dt.c_str());
   return new std::string(buffer, n);
 }
 
@@ -649,19 +1265,20 @@ std::string *FileReader::buildFileEndRecord(time_t now, off_t size, const char *
 
   std::string dt = sys::timeFormat(now, "%Y-%m-%dT%H:%M:%S");
 
-  if (ctx_->md5sum() && md5_.empty()) {
-    char md5[33] = "";
-    unsigned char digest[16];
-    MD5_Final(digest, &md5Ctx_);   // MD5_final can only be called once
-    util::binToHex(digest, 16, md5);
-    md5_.assign(md5, 32);
-  }
+  // md5 stays for the old consumers, checksum/checksumalg carry any algorithm
+  Checksum::Algorithm alg = ctx_->checksum();
+  const char *checksum = alg != Checksum::NONE ? checksum_.hex().c_str() : "";
 
   char buffer[8192];
   int n = snprintf(buffer, 8192, "#%s {\"time\":\"%s\", \"event\":\"END\", \"file\":\"%s\", "
-                   "\"size\":%lu, \"sendsize\":%lu, \"lines\":%lu, \"sendlines\":%lu, \"md5\":\"%s\"}",
-                   ctx_->cnf()->host().c_str(), dt.c_str(), oldFileName,
-                   size, dsize_, line_, dline_, md5_.c_str());
+                   "\"size\":%lu, \"sendsize\":%lu, \"lines\":%lu, \"sendlines\":%lu, \"md5\":\"%s\"",
+                   ctx_->host().c_str(), dt.c_str(), oldFileName,
+                   size, dsize_, line_, dline_, alg == Checksum::MD5 ? checksum : "");
+  if (alg != Checksum::NONE) {
+    n += snprintf(buffer + n, 8192 - n, ", \"checksum\":\"%s\", \"checksumalg\":\"%s\"",
+                  checksum, Checksum::algorithmToString(alg));
+  }
+  n += snprintf(buffer + n, 8192 - n, "}");
   return new std::string(buffer, n);
 }
 
@@ -673,8 +1290,9 @@ void FileReader::propagateRawData(const std::string *data)
   LuaCtx *ctx = ctx_;
   while (ctx) {
     if (ctx->withhost()) {
-      std::string *raw = new std::string(*data);
-      std::vector<FileRecord *> *records = new std::vector<FileRecord *>(1, FileRecord::create(-1, -1, raw));
+      FileRecord *record = ctx->getFileReader()->arena()->create(-1, -1, *data);
+      std::vector<FileRecord *> *records = RecordArena::batch();
+      records->push_back(record);
       ctx->getFileReader()->sendLines(-1, records);
     }
     ctx = ctx->next();
@@ -682,48 +1300,78 @@ void FileReader::propagateRawData(const std::string *data)
   delete data;
 }
 
-void FileReader::processLines(ino_t inode, off_t *offPtr)
+/* return the bytes consumed, up to and include the last NL */
+size_t FileReader::processLines(ino_t inode, off_t *offPtr, const char *buffer, size_t size,
+                                const std::vector<uint32_t> &lines)
 {
   size_t n = 0;
-  char *pos;
+  bool sum = parent_ == 0 && ctx_->checksum() != Checksum::NONE;
+
+  std::vector<FileRecord *> *records = RecordArena::batch();
+  records->reserve(ctx_->copyRawRequired() ? 2 : lines.size());
+
+  int fragIndex = (parent_ ? parent_ : this)->fragIndex_;
+  if (fragIndex > 0) {   // the rest of a line sent in fragments
+    const char *pos = (const char *) memchr(buffer, NL, size);
+    if (!pos) {
+      RecordArena::releaseBatch(records);
+      return 0;
+    }
+
+    ctx_->function()->fragment(offPtr ? *offPtr : -1, buffer, pos - buffer, fragIndex, true, records);
+    if (offPtr) *offPtr += pos - buffer + 1;
+
+    ctx_->cnf()->stats()->logReadInc();
+    line_++;
+    if (sum) checksum_.update(buffer, pos - buffer + 1);
+    n = (pos+1) - buffer;
+  }
 
-  std::vector<FileRecord *> *records = new std::vector<FileRecord *>;
   if (ctx_->copyRawRequired()) {
-    if ((pos = (char *) memrchr(buffer_, NL, npos_))) {
-      int np = processLine(offPtr ? *offPtr : -1, buffer_, pos - buffer_, records);
+    char *pos;
+    if ((pos = (char *) memrchr(buffer + n, NL, size - n))) {
+      int np = processLine(offPtr ? *offPtr : -1, buffer + n, pos - (buffer + n), records);
 
-      if (offPtr) *offPtr += pos - buffer_ + 1;
+      if (offPtr) *offPtr += pos - (buffer + n) + 1;
 
       if (np > 0) line_++;
-      if (parent_ == 0 && ctx_->md5sum() && pos != buffer_) MD5_Update(&md5Ctx_, buffer_, pos - buffer_ + 1);
-      n = (pos+1) - buffer_;
+      if (sum && pos != buffer + n) checksum_.update(buffer + n, pos - (buffer + n) + 1);
+      n = (pos+1) - buffer;
     }
   } else {
-    while ((pos = (char *) memchr(buffer_ + n, NL, npos_ - n))) {
-      int np = processLine(offPtr ? *offPtr : -1, buffer_ + n, pos - (buffer_ + n), records);
+    bool batch = ctx_->function()->batched();
+    size_t sumn = n;  // checksum runs of lines at once, skip empty line
+    std::vector<uint32_t>::const_iterator ite = lines.begin();
+    if (n > 0) ++ite;   // the NL of the last fragment
+    for (; ite != lines.end(); ++ite) {
+      size_t pos = *ite;
+      if (batch) {
+        if (pos != n) batch_.push_back(LineRef(offPtr ? *offPtr : -1, buffer + n, pos - n));
+      } else {
+        int np = processLine(offPtr ? *offPtr : -1, buffer + n, pos - n, records);
+        if (np > 0) line_++;
+      }
 
-      if (offPtr) *offPtr += pos - (buffer_ + n) + 1;
+      if (offPtr) *offPtr += pos - n + 1;
 
-      if (np > 0) line_++;
-      if (parent_ == 0 && ctx_->md5sum() && pos != buffer_ + n) MD5_Update(&md5Ctx_, buffer_ + n, pos - (buffer_ + n) + 1);
-      n = (pos+1) - buffer_;
-      if (n == npos_) break;
+      if (sum && pos == n) {
+        if (n > sumn) checksum_.update(buffer + sumn, n - sumn);
+        sumn = pos + 1;
+      }
+      n = pos + 1;
     }
-  }
+    if (sum && n > sumn) checksum_.update(buffer + sumn, n - sumn);
 
-  sendLines(inode, records);
-
-  if (n == 0) {
-    if (npos_ == MAX_LINE_LEN) {
-      log_error(0, "%s line length exceed, truncate", ctx_->file().c_str());
-      npos_ = 0;
+    if (!batch_.empty()) {
+      ctx_->cnf()->stats()->logReadInc(batch_.size());
+      int np = ctx_->function()->processBatch(batch_, records);
+      if (np > 0) line_ += np;
+      batch_.clear();
     }
-  } else if (npos_ > n) {
-    npos_ -= n;
-    memmove(buffer_, buffer_ + n, npos_);
-  } else {
-    npos_ = 0;
   }
+
+  sendLines(inode, records);
+  return n;
 }
 
 #define TR_NOTPRINT(line, nline) do {     \
@@ -733,7 +1381,7 @@ void FileReader::processLines(ino_t inode, off_t *offPtr)
 } while (0)
 
 /* line without NL */
-int FileReader::processLine(off_t off, char *line, size_t nline, std::vector<FileRecord *> *records)
+int FileReader::processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
 {
   /* ignore empty line */
   if (nline == 0) return 0;
@@ -748,13 +1396,52 @@ int FileReader::processLine(off_t off, char *line, size_t nline, std::vector<Fil
   return n;
 }
 
+void FileReader::resizeBuffer(size_t size)
+{
+  char *buffer = 0;
+  if (size) {
+    assert(npos_ <= size);
+    buffer = new char[size];
+    memcpy(buffer, buffer_, npos_);
+  }
+  delete[] buffer_;
+
+  ctx_->cnf()->stats()->bufferSizeInc((int) size - (int) bufferSize_);
+  if (size > MIN_BUFFER_LEN && size > bufferSize_) {
+    log_info(0, "%s buffer grow to %ld", ctx_->file().c_str(), (long) size);
+  }
+
+  buffer_ = buffer;
+  bufferSize_ = size;
+  bufferPeak_ = npos_;
+  bufferTime_ = ctx_->cnf()->fasttime();
+}
+
+/* a long line or a burst grows the buffer, give it back when not used for a while */
+void FileReader::shrinkBuffer()
+{
+  if (ctx_->cnf()->fasttime() - bufferTime_ < BUFFER_IDLE_TIMEOUT) return;
+
+  size_t size = bufferSize_;
+  while (size > MIN_BUFFER_LEN && size / 2 >= bufferPeak_) size /= 2;
+
+  if (size < bufferSize_) {
+    log_info(0, "%s buffer shrink from %ld to %ld", ctx_->file().c_str(), (long) bufferSize_, (long) size);
+    resizeBuffer(size);
+  } else {
+    bufferPeak_ = npos_;
+    bufferTime_ = ctx_->cnf()->fasttime();
+  }
+}
+
 bool FileReader::checkCache()
 {
   assert(parent_ == 0);
+  if (buffer_) shrinkBuffer();
 
   LuaCtx *ctx = ctx_;
   while (ctx) {
-    std::vector<FileRecord *> *records = new std::vector<FileRecord *>;
+    std::vector<FileRecord *> *records = RecordArena::batch();
     ctx->getFileReader()->processLine(-1, 0, -1, records);
     ctx->getFileReader()->sendLines(-1, records);
 
@@ -766,34 +1453,27 @@ bool FileReader::checkCache()
 bool FileReader::sendLines(ino_t inode, std::vector<FileRecord *> *records)
 {
   if (records->empty()) {
-    delete records;
+    RecordArena::releaseBatch(records);
     return true;
   } else {
     for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
       (*ite)->inode = inode;
     }
 
+    size_t bytes = 0;
     for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
       (*ite)->ctx = ctx_;
+      bytes += (*ite)->data->size();
       log_debug(0, "%.*s", (int) (*ite)->data->size(), (*ite)->data->c_str());
     }
 
     size_t size = records->size();
 
-    uintptr_t ptr = (uintptr_t) records;
-    ssize_t nn = write(ctx_->cnf()->server, &ptr, sizeof(ptr));
-    if (nn == -1) {
-      if (errno != EINTR) {
-        log_fatal(errno, "write onetaskrequest error");
-        delete records;
-        return false;
-      }
-    }
-
+    // records may be freed by the consumer as soon as pushed
     ctx_->cnf()->stats()->logWriteInc(size);
-    ctx_->cnf()->stats()->queueSizeInc(size);
+    ctx_->queueSizeInc(size, bytes);
 
-    assert(nn != -1 && nn == sizeof(uintptr_t));
+    ctx_->cnf()->queue.push(records);
     return true;
   }
 }
@@ -5,12 +5,21 @@
 #include <vector>
 #include <stdint.h>
 #include <sys/types.h>
-#include <openssl/md5.h>
 
+#include "common.h"
 #include "filerecord.h"
+#include "zfile.h"
+#include "checksum.h"
 class LuaCtx;
 class FileOffRecord;
 
+#define MAX_LINE_LEN        8 * 1024 * 1024     // 8M, default maxlinelen
+#define MIN_BUFFER_LEN      64 * 1024           // buffer starts small, grows with long lines
+#define BUFFER_IDLE_TIMEOUT 60                  // shrink buffer unused this long
+#define MIN_NUL_RUN         512                 // shorter NUL runs are data, longer are skipped
+#define NUL_SCAN_BUFFER     64 * 1024
+#define NUL_SCAN_LEN        4 * 1024 * 1024     // NULs read a call to find where a run ends
+
 enum FileInotifyStatus {
   FILE_MOVED     = 0x0001,
   FILE_CREATED   = 0x0002,
@@ -42,23 +51,80 @@ public:
 
   bool eof() const { return eof_; }
 
+  /* the next tail2kafka reads at most budget bytes, 0 no limit */
+  void setTailBudget(off_t budget) { budget_ = budget; }
+  off_t tailBytes() const { return tailBytes_; }
+
   void tagRotate(int action, const char *oldFile = 0, const char *newFile = 0);
   bool remove();
 
+  /* under maxopenfiles an idle file closes its fd, only when nothing is pending:
+   * watched, at eof, no partial line, no history. wake opens it by name again,
+   * or by the name it was moved to, false if that is not the same inode
+   */
+  bool sleep();
+  bool wake(const char *file = 0);
+  bool sleeping() const { return sleeping_; }
+  bool closed() const { return fd_ == -1 && !sleeping_; }
+  /* nothing pending, no rotate in progress */
+  bool watching() const { return flags_ == FILE_WATCHED; }
+
   bool tail2kafka(StartPosition pos = NIL, const struct stat *stPtr = 0, std::string *rawData = 0);
   bool checkCache();
 
+  /* a backfill chunk reads the lines in [start, end) only, a catch-up file ends at end */
+  bool setRange(off_t start, off_t end);
+
+  /* a catch-up file at its end sends END and closes, false if not yet */
+  bool finishCatchup();
+  /* on disk, compressed bytes for a compressed file */
+  off_t readOffset() const;
+
+  RecordArena *arena() { return arena_; }
+
   void initFileOffRecord(FileOffRecord * fileOffRecord);
   void updateFileOffRecord(const FileRecord *record);
 
 private:
-  void propagateTailContent(size_t size);
   void propagateProcessLines(ino_t inode, off_t *off);
-  void processLines(ino_t inode, off_t *off);
-  int processLine(off_t off, char *line, size_t nline, std::vector<FileRecord *> *records);
+  size_t propagateProcessLines(ino_t inode, off_t *off, const char *buffer, size_t size);
+
+  /* a line longer than maxLineLen_ goes out a buffer at a time, processLines sends
+   * the rest up to NL as the last fragment. topics that can not take fragments drop it
+   */
+  void propagateFragment(ino_t inode, off_t *off, const char *buffer, size_t size);
+  size_t processLines(ino_t inode, off_t *off, const char *buffer, size_t size,
+                      const std::vector<uint32_t> &lines);
+  int processLine(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   bool sendLines(ino_t inode, std::vector<FileRecord *> *records);
 
+  bool flowControlOn();
+  bool tailRead(off_t *off, off_t *loff);
+  void resizeBuffer(size_t size);
+  void shrinkBuffer();
+  bool tailMmap(off_t *off, off_t *loff);
+  /* END, the trailing line without NL is the last line of the file */
+  bool flushPartialLine(off_t *off, off_t *loff);
+
+  /* preallocated blocks or holes of a crash are not lines: a NUL run followed by data
+   * is skipped with the partial line before it, one at the end waits to be written
+   */
+  bool findNul(const char *buffer, size_t size, off_t off, off_t *start, off_t *end);
+  off_t nulEnd(off_t start, off_t off);
+  void skipNul(off_t start, off_t end, size_t partial);
+
+  /* a file far behind is read by the page, let the kernel fetch the next window
+   * while this batch is parsed, and drop the pages read so they don't evict the hot ones
+   */
+  void prefetch(off_t pos);
+  void dropBehind(off_t start, off_t end);
+
+  /* off in fileoff of the plain file datafile was compressed from, -1 none */
+  off_t compressedOff() const;
+
   bool tryOpen(char *errbuf);
+  bool openZFile();
+  void closeZFile();
   bool setStartPosition(off_t fileSize, char *errbuf);
   bool setStartPositionEnd(off_t fileSize, char *errbuf);
 
@@ -77,6 +143,20 @@ private:
   ino_t    inode_;
   uint32_t flags_;
   bool eof_;
+  bool sleeping_;
+  bool mmap_;   // map [off, size_) instead of read into buffer_
+  off_t    partial_;  // mmap, the trailing line without NL left in the file after size_
+  ZFile   *zfile_;  // compressed history file, size_ counts decompressed bytes
+  off_t    budget_;
+  off_t    tailBytes_;  // read by the last tail2kafka
+  off_t    end_;        // backfill range end, 0 the file end
+  bool     nulWait_;    // trailing NULs may be written yet, not at END
+  off_t    nulStart_;   // the NUL run to the end seen last time
+  off_t    nulScan_;    // and how far it is NUL
+  int      fragIndex_;  // fragments sent of the line in buffer, 0 none
+  std::vector<LineRef> batch_;  // lines of a chunk for transform_batch
+  bool     behind_;     // more than prefetch to read, read ahead and drop what is read
+  off_t    prefetchOff_;  // the end of the window read ahead, on disk
 
   time_t   fileRotateTime_;
   int      holdFd_;    // trace moved file when datafile != file
@@ -87,13 +167,18 @@ private:
   size_t dline_;  // send line
   off_t  dsize_;  // send size
 
-  MD5_CTX md5Ctx_;
-  std::string md5_;
+  Checksum checksum_;  // of the lines, only the first reader of the file
 
   FileReader *parent_;
 
-  char         *buffer_;
+  char         *buffer_;  // only the first reader of the file owns buffer, the others scan it
   size_t        npos_;
+  size_t        bufferSize_;
+  size_t        bufferPeak_;  // max npos_ since bufferTime_
+  time_t        bufferTime_;
+  size_t        maxLineLen_;  // max maxlinelen of the topics
+  std::vector<uint32_t> lines_;  // NL offsets of the buffer scanning
+  RecordArena  *arena_;   // records this reader sends
   LuaCtx       *ctx_;
 };
 
@@ -0,0 +1,233 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "gnuatomic.h"
+#include "filerecord.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+#define BATCH_CACHE        256
+#define BATCH_MAX_CAPACITY 4096   // a vector grown by a huge batch is not kept
+
+struct RecordSlab {
+  RecordArena *arena;
+  int          refs;   // records in it, +1 while it is the arena's current slab
+  size_t       size;
+  size_t       used;
+
+  char *buffer() { return (char *) (this + 1); }
+};
+
+/* [FileRecord][RecordData data][RecordData esIndex][data\0][esIndex\0] */
+size_t FileRecord::chunkSize(const std::string *esIndex_, const std::string &data_)
+{
+  size_t n = sizeof(FileRecord) + sizeof(RecordData) * 2 + data_.size() + 1;
+  if (esIndex_) n += esIndex_->size() + 1;
+  return ALIGN8(n);
+}
+
+inline char *initRecordData(RecordData *rd, char *p, const std::string &s)
+{
+  memcpy(p, s.data(), s.size());
+  p[s.size()] = '\0';
+
+  rd->ptr = p;
+  rd->len = s.size();
+  return p + s.size() + 1;
+}
+
+FileRecord *FileRecord::init(void *chunk, ino_t inode_, off_t off_, const std::string *esIndex_,
+                             const std::string &data_)
+{
+  FileRecord *record = (FileRecord *) chunk;
+  RecordData *rd = (RecordData *) (record + 1);
+  char *p = (char *) (rd + 2);
+
+  record->ctx   = 0;
+  record->inode = inode_;
+  record->off   = off_;
+  record->slab  = 0;
+
+  p = initRecordData(rd, p, data_);
+  record->data = rd;
+
+  if (esIndex_) {
+    initRecordData(rd + 1, p, *esIndex_);
+    record->esIndex = rd + 1;
+  } else {
+    record->esIndex = 0;
+  }
+  return record;
+}
+
+size_t FileRecord::chunkSize(const struct iovec *iov, int iovcnt)
+{
+  size_t n = sizeof(FileRecord) + sizeof(RecordData) * 2 + 1;
+  for (int i = 0; i < iovcnt; ++i) n += iov[i].iov_len;
+  return ALIGN8(n);
+}
+
+FileRecord *FileRecord::init(void *chunk, ino_t inode_, off_t off_, const struct iovec *iov, int iovcnt)
+{
+  FileRecord *record = (FileRecord *) chunk;
+  RecordData *rd = (RecordData *) (record + 1);
+  char *p = (char *) (rd + 2);
+
+  record->ctx     = 0;
+  record->inode   = inode_;
+  record->off     = off_;
+  record->slab    = 0;
+  record->esIndex = 0;
+
+  rd->ptr = p;
+  for (int i = 0; i < iovcnt; ++i) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  *p = '\0';
+  rd->len = p - rd->ptr;
+  record->data = rd;
+  return record;
+}
+
+FileRecord *FileRecord::create(ino_t inode_, off_t off_, const std::string *esIndex_,
+                               const std::string &data_)
+{
+  void *chunk = malloc(chunkSize(esIndex_, data_));
+  return init(chunk, inode_, off_, esIndex_, data_);
+}
+
+FileRecord *FileRecord::create(ino_t inode_, off_t off_, const struct iovec *iov, int iovcnt)
+{
+  void *chunk = malloc(chunkSize(iov, iovcnt));
+  return init(chunk, inode_, off_, iov, iovcnt);
+}
+
+void FileRecord::destroy(FileRecord *record)
+{
+  if (record->slab) RecordArena::release(record->slab);
+  else free(record);
+}
+
+RecordArena::RecordArena() : current_(0), refs_(1)
+{
+  cache_.reserve(RECORD_SLAB_CACHE);
+  pthread_mutex_init(&mutex_, 0);
+}
+
+RecordArena::~RecordArena()
+{
+  for (std::vector<RecordSlab *>::iterator ite = cache_.begin(); ite != cache_.end(); ++ite) {
+    free(*ite);
+  }
+  pthread_mutex_destroy(&mutex_);
+}
+
+// n bytes in the current slab, the record made in it sets slab
+char *RecordArena::alloc(size_t n)
+{
+  if (!current_ || current_->used + n > current_->size) {
+    if (current_) release(current_);
+    current_ = newSlab(n > RECORD_SLAB_SIZE ? n : RECORD_SLAB_SIZE);
+  }
+
+  char *chunk = current_->buffer() + current_->used;
+  current_->used += n;
+  util::atomic_inc(&current_->refs);
+  return chunk;
+}
+
+FileRecord *RecordArena::create(ino_t inode, off_t off, const std::string *esIndex, const std::string &data)
+{
+  FileRecord *record = FileRecord::init(alloc(FileRecord::chunkSize(esIndex, data)), inode, off, esIndex, data);
+  record->slab = current_;
+  return record;
+}
+
+FileRecord *RecordArena::create(ino_t inode, off_t off, const struct iovec *iov, int iovcnt)
+{
+  FileRecord *record = FileRecord::init(alloc(FileRecord::chunkSize(iov, iovcnt)), inode, off, iov, iovcnt);
+  record->slab = current_;
+  return record;
+}
+
+static pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::vector<FileRecord *> *> batchCache;
+
+std::vector<FileRecord *> *RecordArena::batch()
+{
+  std::vector<FileRecord *> *records = 0;
+  pthread_mutex_lock(&batchMutex);
+  if (!batchCache.empty()) {
+    records = batchCache.back();
+    batchCache.pop_back();
+  }
+  pthread_mutex_unlock(&batchMutex);
+
+  return records ? records : new std::vector<FileRecord *>;
+}
+
+void RecordArena::releaseBatch(std::vector<FileRecord *> *records)
+{
+  if (records->capacity() <= BATCH_MAX_CAPACITY) {
+    records->clear();
+    pthread_mutex_lock(&batchMutex);
+    if (batchCache.size() < BATCH_CACHE) {
+      batchCache.push_back(records);
+      records = 0;
+    }
+    pthread_mutex_unlock(&batchMutex);
+  }
+  delete records;
+}
+
+RecordSlab *RecordArena::newSlab(size_t size)
+{
+  RecordSlab *slab = 0;
+  if (size == RECORD_SLAB_SIZE) {
+    pthread_mutex_lock(&mutex_);
+    if (!cache_.empty()) {
+      slab = cache_.back();
+      cache_.pop_back();
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  if (!slab) {
+    slab = (RecordSlab *) malloc(sizeof(RecordSlab) + size);
+    slab->arena = this;
+    slab->size  = size;
+  }
+
+  slab->refs = 1;
+  slab->used = 0;
+  util::atomic_inc(&refs_);
+  return slab;
+}
+
+void RecordArena::release(RecordSlab *slab)
+{
+  if (util::atomic_dec(&slab->refs) != 0) return;
+
+  RecordArena *arena = slab->arena;
+  pthread_mutex_lock(&arena->mutex_);
+  if (slab->size == RECORD_SLAB_SIZE && arena->cache_.size() < RECORD_SLAB_CACHE) {
+    arena->cache_.push_back(slab);
+    slab = 0;
+  }
+  pthread_mutex_unlock(&arena->mutex_);
+
+  if (slab) free(slab);
+  arena->unref();
+}
+
+void RecordArena::destroy()
+{
+  if (current_) release(current_);
+  current_ = 0;
+  unref();
+}
+
+void RecordArena::unref()
+{
+  if (util::atomic_dec(&refs_) == 0) delete this;
+}
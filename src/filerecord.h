@@ -2,39 +2,91 @@
 #define _FILE_RECORD_H_
 
 #include <string>
+#include <vector>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 class LuaCtx;
+struct RecordSlab;
+
+/* bytes of a record, NUL terminated, live in the same chunk as the record */
+struct RecordData {
+  const char *ptr;
+  size_t      len;
+
+  const char *c_str() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+  std::string str() const { return std::string(ptr, len); }
+};
 
 struct FileRecord {
   LuaCtx        *ctx;
   ino_t          inode;
   off_t          off;
 
-  const std::string   *esIndex;
-  const std::string   *data;
+  const RecordData *esIndex;
+  const RecordData *data;
+  RecordSlab       *slab;   // 0 if malloc alone
 
-  static FileRecord *create(ino_t inode_, off_t off_, const std::string *data_) {
+  static FileRecord *create(ino_t inode_, off_t off_, const std::string &data_) {
     return create(inode_, off_, 0, data_);
   }
 
   static FileRecord *create(ino_t inode_, off_t off_, const std::string *esIndex_,
-                            const std::string *data_) {
-    FileRecord *record = new FileRecord;
-    record->inode = inode_;
-    record->off   = off_;
-
-    record->esIndex = esIndex_;
-    record->data    = data_;
-    return record;
-  }
+                            const std::string &data_);
+  static void destroy(FileRecord *record);
+
+  /* data is the pieces of iov, copied once into the chunk, no esIndex */
+  static FileRecord *create(ino_t inode_, off_t off_, const struct iovec *iov, int iovcnt);
+
+  static size_t chunkSize(const std::string *esIndex_, const std::string &data_);
+  static size_t chunkSize(const struct iovec *iov, int iovcnt);
+  static FileRecord *init(void *chunk, ino_t inode_, off_t off_, const std::string *esIndex_,
+                          const std::string &data_);
+  static FileRecord *init(void *chunk, ino_t inode_, off_t off_, const struct iovec *iov, int iovcnt);
+};
 
-  static void destroy(FileRecord *record) {
-    if (record->esIndex) delete record->esIndex;
+#define RECORD_SLAB_SIZE  (128 * 1024)
+#define RECORD_SLAB_CACHE 8
 
-    delete record->data;
-    delete record;
+/* records of a reader are bump allocated in slabs, so the lines of one batch
+ * share a contiguous block. a slab goes back to the arena when the last record
+ * in it is destroyed, usually by the kafka/es delivery report in another thread
+ */
+class RecordArena {
+public:
+  RecordArena();
+
+  FileRecord *create(ino_t inode, off_t off, const std::string &data) {
+    return create(inode, off, 0, data);
   }
+  FileRecord *create(ino_t inode, off_t off, const std::string *esIndex, const std::string &data);
+  FileRecord *create(ino_t inode, off_t off, const struct iovec *iov, int iovcnt);
+
+  /* owner gives up the arena, it is freed after the last slab comes back */
+  void destroy();
+
+  static void release(RecordSlab *slab);
+
+  /* the vectors records go to the queue in, the consumer gives them back
+   * when the batch is produced, kept with their capacity
+   */
+  static std::vector<FileRecord *> *batch();
+  static void releaseBatch(std::vector<FileRecord *> *records);
+
+private:
+  ~RecordArena();
+
+  char *alloc(size_t n);
+  RecordSlab *newSlab(size_t size);
+  void unref();
+
+  RecordSlab               *current_;
+  std::vector<RecordSlab *> cache_;
+  pthread_mutex_t           mutex_;
+  int                       refs_;
 };
 
 #endif
@@ -10,18 +10,33 @@ IntegralType atomic_get(IntegralType *ptr) {
   return __sync_add_and_fetch(ptr, 0);
 }
 
+template <class IntegralType>
+IntegralType atomic_load(IntegralType *ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+template <class IntegralType>
+void atomic_store(IntegralType *ptr, IntegralType val) {
+  __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+template <class IntegralType>
+bool atomic_cas(IntegralType *ptr, IntegralType oldval, IntegralType newval) {
+  return __sync_bool_compare_and_swap(ptr, oldval, newval);
+}
+
 template <class IntegralType>
 IntegralType atomic_set(IntegralType *ptr, int val) {
   return __sync_lock_test_and_set(ptr, val);
 }
 
 template <class IntegralType>
-IntegralType atomic_inc(IntegralType *ptr,  int val = 1) {
+IntegralType atomic_inc(IntegralType *ptr, int64_t val = 1) {
   return __sync_add_and_fetch(ptr, val);
 }
 
 template <class IntegralType>
-IntegralType atomic_dec(IntegralType *ptr, int val = 1) {
+IntegralType atomic_dec(IntegralType *ptr, int64_t val = 1) {
   return __sync_sub_and_fetch(ptr, val);
 }
 
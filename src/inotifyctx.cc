@@ -4,32 +4,145 @@
 #include <climits>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <errno.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
-#include <poll.h>
 
 #include "logger.h"
 #include "sys.h"
+#include "util.h"
+#include "luahelper.h"
 #include "cnfctx.h"
 #include "luactx.h"
 #include "filereader.h"
 #include "inotifyctx.h"
 #include "kafkactx.h"
+#include "fileoff.h"
 
 #define MAX_ERR_LEN 512
+#define MAX_DRAIN_TIME        500   // ms, then rotate and rewatch get a turn
+#define LATENCY_LOG_INTERVAL  60
+#define MAX_EPOLL_EVENT       16
+#define COALESCE_FACTOR       10    // read at most 1/COALESCE_FACTOR of the time
+#define ACTIVE_TIMEOUT        (3 * BUFFER_IDLE_TIMEOUT)  // s, idle files leave the 1s checks
+#define CATCHUP_WAIT          100   // ms, a catch-up thread waits for its budget or the queue
+#define CATCHUP_LOG_INTERVAL  60
+#define CHECK_WHEEL_SLOTS     64    // a slot a 1s tick, more than MAX_CHECK_INTERVAL
+#define MAX_CHECK_INTERVAL    32    // s, idle files back off to
 
 /* watch IN_DELETE_SELF does not work
  * luactx hold fd to the deleted file, the file will never be real deleted
- * so DELETE will be inotified
+ * so DELETE will be inotified, except a file closed by maxopenfiles
  */
-static const uint32_t WATCH_EVENT = IN_MODIFY | IN_MOVE_SELF;
+// IN_ATTRIB comes with unlink, the link count changes
+static const uint32_t WATCH_EVENT = IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB;
+static const uint32_t GLOB_DIR_EVENT = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
 static const size_t ONE_EVENT_SIZE = sizeof(struct inotify_event) + NAME_MAX;
 
+class SetLuaHelperTask : public util::TaskQueue::Task {
+public:
+  SetLuaHelperTask(LuaHelper *helper) : helper_(helper) {}
+  bool doIt() {
+    CnfCtx::setThreadLuaHelper(helper_);
+    return true;
+  }
+private:
+  LuaHelper *helper_;
+};
+
+class TailTask : public util::TaskQueue::Task {
+public:
+  TailTask(InotifyCtx *inotify, LuaCtx *ctx) : inotify_(inotify), ctx_(ctx) {}
+  bool doIt() {
+    ctx_->getFileReader()->tail2kafka();
+    inotify_->tailDone();
+    return true;
+  }
+private:
+  InotifyCtx *inotify_;
+  LuaCtx     *ctx_;
+};
+
+class CatchupTask : public util::TaskQueue::Task {
+public:
+  CatchupTask(InotifyCtx *inotify, InotifyCtx::CatchupFile *file) : inotify_(inotify), file_(file) {}
+  bool doIt() {
+    inotify_->catchupRead(file_);
+    return true;
+  }
+private:
+  InotifyCtx              *inotify_;
+  InotifyCtx::CatchupFile *file_;
+};
+
+static int64_t monotonicMilli()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the directories before the first wildcard must exist */
+static std::string globBaseDir(const std::string &pattern)
+{
+  size_t wildcard = pattern.find_first_of("*?[");
+  size_t slash = pattern.rfind('/', wildcard == std::string::npos ? std::string::npos : wildcard);
+
+  if (slash == std::string::npos) return ".";
+  else if (slash == 0) return "/";
+  else return pattern.substr(0, slash);
+}
+
+static std::string joinPath(const std::string &dir, const char *name)
+{
+  if (dir == ".") return name;
+  else if (dir == "/") return dir + name;
+  else return dir + "/" + name;
+}
+
+/* path is a directory the pattern goes through, like a/b of a/ * /c.log */
+static bool globDirMatch(const std::string &pattern, const std::string &path)
+{
+  size_t n = std::count(path.begin(), path.end(), '/');
+  size_t pos = std::string::npos;
+  for (size_t i = 0, start = 0; i <= n; ++i, start = pos + 1) {
+    pos = pattern.find('/', start);
+    if (pos == std::string::npos) return false;  // the last part is the file
+  }
+  return fnmatch(pattern.substr(0, pos).c_str(), path.c_str(), FNM_PATHNAME) == 0;
+}
+
+InotifyCtx::InotifyCtx(CnfCtx *cnf)
+  : cnf_(cnf), wfd_(-1), moveCookie_(0), eventBuffer_(0), eventBufferSize_(0),
+    epfd_(-1), tickFd_(-1), coalesceFd_(-1), coalesceTime_(0), kafkaWatched_(false),
+    wheel_(CHECK_WHEEL_SLOTS), wheelTick_(0),
+    latencyLogTime_(0), instances_(0), sleeping_(0), pending_(0),
+    catchupStop_(0), catchupRate_(0), catchupDone_(0), catchupLogDone_(0), catchupLogTime_(0)
+{
+  pthread_mutex_init(&mutex_, 0);
+  pthread_cond_init(&cond_, 0);
+}
+
 InotifyCtx::~InotifyCtx()
 {
+  stopWorkers();
+  stopCatchup();
   if (wfd_ > 0) close(wfd_);
+  if (eventBuffer_) free(eventBuffer_);
+  if (epfd_ != -1) close(epfd_);
+  if (tickFd_ != -1) close(tickFd_);
+  if (coalesceFd_ != -1) close(coalesceFd_);
+
+  pthread_mutex_destroy(&mutex_);
+  pthread_cond_destroy(&cond_);
 }
 
 bool InotifyCtx::init()
@@ -44,38 +157,504 @@ bool InotifyCtx::init()
   int nb = 1;
   ioctl(wfd_, FIONBIO, &nb);
 
+  eventBufferSize_ = cnf_->getLuaCtxSize() * ONE_EVENT_SIZE * 5;
+  eventBuffer_ = (char *) malloc(eventBufferSize_);
+
+  // files matched now are instances before fork, like the configured ones
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getGlobCtxs().begin();
+       ite != cnf_->getGlobCtxs().end(); ++ite) {
+    if (!watchGlobDir(*ite, globBaseDir((*ite)->file()))) return false;
+  }
+
   for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
        ite != cnf_->getLuaCtxs().end(); ++ite) {
-    LuaCtx *ctx = *ite;
-    const std::string &file = ctx->file();
+    if (!watch(*ite)) return false;
+  }
+  return true;
+}
+
+bool InotifyCtx::watch(LuaCtx *ctx)
+{
+  const std::string &file = ctx->file();
+
+  int wd = inotify_add_watch(wfd_, file.c_str(), WATCH_EVENT);
+  if (wd == -1) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "%s add watch error %d:%s",
+             file.c_str(), errno, strerror(errno));
+    return false;
+  }
+  log_info(0, "add watch %s @%d", file.c_str(), wd);
+
+  // topics of the file share one reader, take the max weight
+  int weight = 1;
+  for (LuaCtx *c = ctx; c; c = c->next()) weight = std::max(weight, c->weight());
+
+  TailSched sched;
+  memset(&sched, 0, sizeof(sched));
+  sched.quantum = (off_t) cnf_->getQuantum() * weight;
+  sched_[ctx] = sched;
+  setWatch(ctx, wd);
+
+  if (ctx->globTemplate()) instances_++;
+  return true;
+}
+
+void InotifyCtx::setWatch(LuaCtx *ctx, int wd)
+{
+  wdToCtx_[wd] = ctx;
+  sched_[ctx].wd = wd;
+  checkSoon(ctx);
+}
+
+/* watch dir for files of the glob to come, then match the entries already there */
+bool InotifyCtx::watchGlobDir(LuaCtx *glob, const std::string &dir)
+{
+  int wd = inotify_add_watch(wfd_, dir.c_str(), GLOB_DIR_EVENT);
+  if (wd == -1) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "%s add watch error %d:%s", dir.c_str(), errno, strerror(errno));
+    return false;
+  }
+  if (globDirs_.insert(std::make_pair(wd, dir)).second) log_info(0, "add watch dir %s @%d", dir.c_str(), wd);
+
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "opendir %s error %d:%s", dir.c_str(), errno, strerror(errno));
+    return false;
+  }
+
+  struct dirent *ent;
+  while ((ent = readdir(dp))) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+    std::string path = joinPath(dir, ent->d_name);
+    bool isdir = ent->d_type == DT_DIR;
+    if (ent->d_type == DT_UNKNOWN) {
+      struct stat st;
+      isdir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    globEntry(glob, path, isdir);
+  }
+  closedir(dp);
+  return true;
+}
+
+void InotifyCtx::globEntry(LuaCtx *glob, const std::string &path, bool isdir)
+{
+  const std::string &pattern = glob->file();
+  if (isdir) {
+    if (globDirMatch(pattern, path) && !watchGlobDir(glob, path)) log_error(0, "%s", cnf_->errbuf());
+  } else if (fnmatch(pattern.c_str(), path.c_str(), FNM_PATHNAME) == 0) {
+    addGlobFile(glob, path);
+  }
+}
+
+/* a file matched while running gets its readers, a fileoff record and a watch at once,
+ * a file matched again was rotated or deleted, its instance reads the new one
+ */
+void InotifyCtx::addGlobFile(LuaCtx *glob, const std::string &file)
+{
+  LuaCtx *ctx = cnf_->getGlobFile(file);
+  if (ctx) {
+    if (running() && wake(ctx)) rewatch(ctx);
+    return;
+  }
+
+  if (!cnf_->addGlobFile(glob, file, running(), &ctx)) {
+    log_error(0, "add glob file %s error %s", file.c_str(), cnf_->errbuf());
+    return;
+  }
+  if (!ctx || !running()) return;
+
+  ctx->getFileReader()->initFileOffRecord(cnf_->getFileOff()->alloc());
+  if (!watch(ctx)) {
+    log_error(0, "%s", cnf_->errbuf());
+    return;
+  }
+
+  // instances run in the lua state of the template
+  if (!workers_.empty()) ctxToWorker_[ctx] = ctxToWorker_[glob];
+  ready(ctx, true);
+}
+
+void InotifyCtx::globDirEvent(const struct inotify_event *event)
+{
+  std::map<int, std::string>::iterator pos = globDirs_.find(event->wd);
+  if (pos == globDirs_.end()) return;
+
+  if (event->mask & IN_IGNORED) {
+    log_info(0, "remove watch dir %s @%d", pos->second.c_str(), event->wd);
+    globDirs_.erase(pos);
+    return;
+  }
+  if (event->len == 0) return;
 
-    int wd = inotify_add_watch(wfd_, file.c_str(), WATCH_EVENT);
-    if (wd == -1) {
-      snprintf(cnf_->errbuf(), MAX_ERR_LEN, "%s add watch error %d:%s",
-               file.c_str(), errno, strerror(errno));
+  std::string path = joinPath(pos->second, event->name);
+  if (event->mask & IN_MOVED_FROM) {
+    moveCookie_ = event->cookie;
+    moveFrom_ = path;
+    return;
+  }
+
+  // a closed file follows its new name, IN_MOVE_SELF of it comes next
+  if ((event->mask & IN_MOVED_TO) && event->cookie == moveCookie_) {
+    LuaCtx *ctx = cnf_->getGlobFile(moveFrom_);
+    if (ctx) wake(ctx, path.c_str());
+    moveCookie_ = 0;
+  }
+
+  bool isdir = event->mask & IN_ISDIR;
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getGlobCtxs().begin();
+       ite != cnf_->getGlobCtxs().end(); ++ite) {
+    globEntry(*ite, path, isdir);
+  }
+}
+
+/* a file closed by maxopenfiles opens again before it is read, rotated or checked,
+ * if it is another inode by then, the instance starts over with the new file
+ */
+bool InotifyCtx::wake(LuaCtx *ctx, const char *file)
+{
+  FileReader *reader = ctx->getFileReader();
+  if (!reader->sleeping()) return true;
+
+  sleeping_--;
+  if (reader->wake(file)) return true;
+
+  int wd = sched_[ctx].wd;
+  inotify_rm_watch(wfd_, wd);
+  wdToCtx_.erase(wd);
+  rewatch(ctx);
+  return false;
+}
+
+/* instances close in the order they went idle, until maxopenfiles are open */
+void InotifyCtx::closeIdleFiles()
+{
+  int max = cnf_->getMaxOpenFiles();
+  while (max > 0 && instances_ - sleeping_ > max && !idle_.empty()) {
+    std::pair<LuaCtx *, int64_t> idle = idle_.front();
+    idle_.pop_front();
+
+    TailSched &sched = sched_[idle.first];
+    if (sched.active || sched.idleTime != idle.second) continue;  // read since
+    if (idle.first->getFileReader()->sleep()) sleeping_++;
+  }
+}
+
+/* threads do not survive fork, start workers in loop */
+bool InotifyCtx::startWorkers()
+{
+  int nworker = cnf_->getWorkers();
+  for (int i = 0; i < nworker; ++i) {
+    // main.lua functions run in the worker's own lua state
+    LuaHelper *helper = new LuaHelper;
+    if (!helper->dofile(cnf_->getLuaHelper()->file(), cnf_->errbuf())) {
+      delete helper;
       return false;
     }
-    fdToCtx_.insert(std::make_pair(wd, ctx));
-    log_info(0, "add watch %s @%d", file.c_str(), wd);
+    workerHelpers_.push_back(helper);
+
+    util::TaskQueue *worker = new util::TaskQueue("tail" + util::toStr(i));
+    workers_.push_back(worker);
+    if (!worker->start(cnf_->errbuf())) return false;
+    worker->submit(new SetLuaHelperTask(helper));
   }
+
+  // templates go first, their instances run in the same lua state
+  std::vector<LuaCtx *> ctxs(cnf_->getGlobCtxs());
+  ctxs.insert(ctxs.end(), cnf_->getLuaCtxs().begin(), cnf_->getLuaCtxs().end());
+
+  size_t i = 0;
+  for (std::vector<LuaCtx *>::iterator ite = ctxs.begin(); nworker > 0 && ite != ctxs.end(); ++ite) {
+    LuaCtx *glob = (*ite)->globTemplate();
+    ctxToWorker_[*ite] = glob ? ctxToWorker_[glob] : workers_[i++ % nworker];
+  }
+
+  if (nworker > 0) log_info(0, "start %d tail workers", nworker);
   return true;
 }
 
-void InotifyCtx::flowControl(RunStatus *runStatus)
+void InotifyCtx::stopWorkers()
 {
-  while (runStatus->get() == RunStatus::WAIT) {
-    bool block = cnf_->stats()->queueSize() > MAX_FILE_QUEUE_SIZE;
-    cnf_->logStats();
+  for (std::vector<util::TaskQueue *>::iterator ite = workers_.begin(); ite != workers_.end(); ++ite) {
+    (*ite)->stop();
+    delete *ite;
+  }
+  workers_.clear();
+  ctxToWorker_.clear();
+
+  for (std::vector<LuaHelper *>::iterator ite = workerHelpers_.begin(); ite != workerHelpers_.end(); ++ite) {
+    delete *ite;
+  }
+  workerHelpers_.clear();
+}
+
+/* lines of a catch-up file run in the thread's own lua states, like the tail workers,
+ * files left by the last run go on even if catchup is turned off
+ */
+bool InotifyCtx::startCatchup()
+{
+  int nworker = cnf_->getCatchup();
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
+       nworker == 0 && ite != cnf_->getLuaCtxs().end(); ++ite) {
+    if (!(*ite)->catchupFiles().empty()) nworker = 1;
+  }
 
-    cnf_->flowControl(block);
-    if (!block) break;
+  for (int i = 0; i < nworker; ++i) {
+    LuaHelper *helper = new LuaHelper;
+    if (!helper->dofile(cnf_->getLuaHelper()->file(), cnf_->errbuf())) {
+      delete helper;
+      return false;
+    }
+    catchupHelpers_.push_back(helper);
 
-    KafkaCtx *kafka = cnf_->getKafka();
-    if (kafka) kafka->poll(10);
-    else sys::millisleep(10);
+    util::TaskQueue *worker = new util::TaskQueue("catchup" + util::toStr(i));
+    catchupWorkers_.push_back(worker);
+    if (!worker->start(cnf_->errbuf())) return false;
+    worker->submit(new SetLuaHelperTask(helper));
+  }
+  catchupSlots_.assign(nworker, (CatchupFile *) 0);
+  if (nworker > 0) catchupRate_ = cnf_->getCatchupRate() / nworker;
 
-    cnf_->fasttime(true, TIMEUNIT_SECONDS);
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin(); ite != cnf_->getLuaCtxs().end(); ++ite) {
+    const std::deque<std::string> &files = (*ite)->catchupFiles();
+    for (std::deque<std::string>::const_iterator f = files.begin(); f != files.end(); ++f) {
+      catchupWait_.push_back(new CatchupFile(*ite, *f));
+    }
   }
+
+  if (nworker > 0) log_info(0, "start %d catchup workers", nworker);
+  return true;
+}
+
+void InotifyCtx::stopCatchup()
+{
+  util::atomic_store(&catchupStop_, 1);
+  for (std::vector<util::TaskQueue *>::iterator ite = catchupWorkers_.begin(); ite != catchupWorkers_.end(); ++ite) {
+    (*ite)->stop();
+    delete *ite;
+  }
+  catchupWorkers_.clear();
+  catchupSlots_.clear();
+
+  for (std::vector<LuaHelper *>::iterator ite = catchupHelpers_.begin(); ite != catchupHelpers_.end(); ++ite) {
+    delete *ite;
+  }
+  catchupHelpers_.clear();
+
+  // records may be in flight, the ctxs go with cnf
+  for (std::vector<CatchupFile *>::iterator ite = catchup_.begin(); ite != catchup_.end(); ++ite) delete *ite;
+  catchup_.clear();
+  for (std::deque<CatchupFile *>::iterator ite = catchupWait_.begin(); ite != catchupWait_.end(); ++ite) delete *ite;
+  catchupWait_.clear();
+}
+
+/* history files after the one being read are handed to the catch-up threads,
+ * a file finished leaves the catchup list, and is dropped when all its records are acked
+ */
+void InotifyCtx::catchupCheck()
+{
+  if (catchupWorkers_.empty()) return;
+
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin(); ite != cnf_->getLuaCtxs().end(); ++ite) {
+    std::vector<std::string> files;
+    if (!(*ite)->catchupHistoryFiles(&files)) continue;
+
+    for (std::vector<std::string>::iterator f = files.begin(); f != files.end(); ++f) {
+      catchupWait_.push_back(new CatchupFile(*ite, *f));
+    }
+  }
+
+  std::vector<CatchupFile *> catchup;
+  for (std::vector<CatchupFile *>::iterator ite = catchup_.begin(); ite != catchup_.end(); ++ite) {
+    CatchupFile *file = *ite;
+    if (util::atomic_load(&file->state) == CATCHUP_RUN) {
+      catchup.push_back(file);
+      continue;
+    }
+
+    if (file->worker != -1) {
+      catchupSlots_[file->worker] = 0;
+      file->worker = -1;
+      file->head->removeCatchupFile(file->file);
+      catchupDone_ += file->size;
+    }
+
+    bool acked = true;
+    for (LuaCtx *ctx = file->ctx; ctx; ctx = ctx->next()) {
+      if (ctx->queueBytes() > 0) acked = false;
+    }
+    if (!acked) {
+      catchup.push_back(file);
+      continue;
+    }
+
+    cnf_->getFileOff()->release(file->fileOff);
+    cnf_->dropCatchupFile(file->ctx);
+    delete file;
+  }
+  catchup_.swap(catchup);
+
+  for (size_t i = 0; i < catchupSlots_.size() && !catchupWait_.empty(); ++i) {
+    while (!catchupSlots_[i] && !catchupWait_.empty()) {
+      CatchupFile *file = catchupWait_.front();
+      catchupWait_.pop_front();
+      if (!catchupStart(file, i)) {
+        file->head->removeCatchupFile(file->file);
+        delete file;
+      }
+    }
+  }
+
+  logCatchup();
+}
+
+bool InotifyCtx::catchupStart(CatchupFile *file, int worker)
+{
+  file->ctx = cnf_->addCatchupFile(file->head, file->file);
+  if (!file->ctx) {
+    log_fatal(0, "catchup %s error %s, skip it", file->file.c_str(), cnf_->errbuf());
+    return false;
+  }
+
+  struct stat st;
+  file->size = stat(file->ctx->file().c_str(), &st) == 0 ? st.st_size : 0;
+  file->offset = 0;
+  file->fileOff = cnf_->getFileOff()->alloc();
+  file->ctx->getFileReader()->initFileOffRecord(file->fileOff);
+
+  file->worker = worker;
+  file->state = CATCHUP_RUN;
+  catchupSlots_[worker] = file;
+  catchup_.push_back(file);
+
+  log_info(0, "catchup %s as %s", file->ctx->file().c_str(), file->ctx->host().c_str());
+  catchupWorkers_[worker]->submit(new CatchupTask(this, file));
+  return true;
+}
+
+/* a thread reads its file to END at catchuprate/catchup bytes a second,
+ * it gives way to the live files while half of the host queue is taken
+ */
+void InotifyCtx::catchupRead(CatchupFile *file)
+{
+  FileReader *reader = file->ctx->getFileReader();
+  off_t rate = catchupRate_;
+  int64_t start = monotonicMilli();
+  off_t total = 0;
+
+  while (!util::atomic_load(&catchupStop_)) {
+    if (cnf_->stats()->queueBytes() > MAX_FILE_QUEUE_BYTES / 2) {
+      sys::millisleep(CATCHUP_WAIT);
+      continue;
+    }
+
+    off_t budget = cnf_->getQuantum();
+    if (rate > 0) {
+      off_t allowed = rate * (monotonicMilli() - start) / 1000;
+      if (allowed - total > rate) total = allowed - rate;  // no burst after a wait
+      budget = std::min(budget, allowed - total);
+      if (budget <= 0) {
+        sys::millisleep(CATCHUP_WAIT);
+        continue;
+      }
+    }
+
+    reader->setTailBudget(budget);
+    bool eof = reader->tail2kafka();
+    total += reader->tailBytes();
+    util::atomic_store(&file->offset, reader->readOffset());
+
+    if (eof && reader->finishCatchup()) {
+      util::atomic_store(&file->state, (int) CATCHUP_END);
+      break;
+    }
+    if (reader->tailBytes() == 0) sys::millisleep(CATCHUP_WAIT);
+  }
+}
+
+/* eta of the backlog by the bytes on disk read in the last interval */
+void InotifyCtx::logCatchup()
+{
+  time_t now = cnf_->fasttime();
+  if (now < catchupLogTime_ + CATCHUP_LOG_INTERVAL) return;
+
+  off_t done = catchupDone_, left = 0;
+  for (std::vector<CatchupFile *>::iterator ite = catchup_.begin(); ite != catchup_.end(); ++ite) {
+    if ((*ite)->worker == -1) continue;
+    off_t offset = util::atomic_load(&(*ite)->offset);
+    done += offset;
+    left += std::max((*ite)->size - offset, (off_t) 0);
+  }
+  for (std::deque<CatchupFile *>::iterator ite = catchupWait_.begin(); ite != catchupWait_.end(); ++ite) {
+    struct stat st;
+    if (stat((*ite)->file.c_str(), &st) == 0) left += st.st_size;
+  }
+
+  if (catchupLogTime_ != 0 && (left > 0 || done > catchupLogDone_)) {
+    long rate = (done - catchupLogDone_) / (now - catchupLogTime_);
+    std::string eta = rate > 0 ? util::toStr(left / rate) + "s" : "NA";
+    log_info(0, "CatchupStatus,files=%d,wait=%d,left=%ld,rate=%ld/s,eta=%s",
+             (int) (catchupSlots_.size() - std::count(catchupSlots_.begin(), catchupSlots_.end(), (CatchupFile *) 0)),
+             (int) catchupWait_.size(), (long) left, rate, eta.c_str());
+  }
+  catchupLogTime_ = now;
+  catchupLogDone_ = done;
+}
+
+void InotifyCtx::tail(LuaCtx *ctx)
+{
+  if (workers_.empty()) {
+    ctx->getFileReader()->tail2kafka();
+    return;
+  }
+
+  pthread_mutex_lock(&mutex_);
+  pending_++;
+  pthread_mutex_unlock(&mutex_);
+
+  ctxToWorker_[ctx]->submit(new TailTask(this, ctx));
+}
+
+void InotifyCtx::tailDone()
+{
+  pthread_mutex_lock(&mutex_);
+  if (--pending_ == 0) pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void InotifyCtx::waitTail()
+{
+  pthread_mutex_lock(&mutex_);
+  while (pending_ > 0) pthread_cond_wait(&cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+/* a topic or the host queue drained, files held back read on */
+void InotifyCtx::wakeup()
+{
+  uint64_t n;
+  if (read(cnf_->tailWakeFd(), &n, sizeof(n)) != sizeof(n)) return;
+
+  for (std::vector<LuaCtx *>::iterator ite = active_.begin(); ite != active_.end(); ++ite) {
+    if (!(*ite)->getFileReader()->eof()) ready(*ite, false);
+  }
+}
+
+bool InotifyCtx::rewatch(LuaCtx *ctx)
+{
+  if (!ctx->getFileReader()->reinit()) return false;
+
+  int wd = inotify_add_watch(wfd_, ctx->file().c_str(), WATCH_EVENT);
+  if (wd == -1) {
+    log_fatal(errno, "rewatch %s error", ctx->file().c_str());
+    return false;
+  }
+  setWatch(ctx, wd);
+
+  log_info(0, "rewatch %s @%d", ctx->file().c_str(), wd);
+  ready(ctx, true);
+  return true;
 }
 
 bool InotifyCtx::tryReWatch()
@@ -84,17 +663,9 @@ bool InotifyCtx::tryReWatch()
        ite != cnf_->getLuaCtxs().end(); ++ite) {
     LuaCtx *ctx = *ite;
 
-    if (ctx->getFileReader()->reinit()) {
-      int wd = inotify_add_watch(wfd_, ctx->file().c_str(), WATCH_EVENT);
-      if (wd == -1) {
-        log_fatal(errno, "rewatch %s error", ctx->file().c_str());
-      } else {
-        fdToCtx_.insert(std::make_pair(wd, ctx));
-
-        log_info(0, "rewatch %s @%d", ctx->file().c_str(), wd);
-        ctx->getFileReader()->tail2kafka();
-      }
-    }
+    // an instance of a file gone waits for IN_CREATE of the directory
+    if (ctx->globTemplate() && ctx->getFileReader()->closed() && access(ctx->file().c_str(), F_OK) != 0) continue;
+    rewatch(ctx);
   }
   return true;
 }
@@ -106,105 +677,399 @@ void InotifyCtx::tryRmWatch(LuaCtx *ctx, int wd)
   ctx->getFileReader()->tagRotate(FILE_MOVED);
 }
 
-/* unlink or truncate */
+/* check ctx for rotate interval ticks later, the sooner one wins,
+ * the later entry left in the wheel is skipped when its slot comes
+ */
+void InotifyCtx::scheduleCheck(LuaCtx *ctx, int interval)
+{
+  TailSched &sched = sched_[ctx];
+  uint64_t tick = wheelTick_ + interval;
+  if (sched.checkTick != 0 && sched.checkTick <= tick) return;
+
+  sched.checkTick = tick;
+  wheel_[tick % CHECK_WHEEL_SLOTS].push_back(ctx);
+}
+
+/* an event of the file, it may be rotating */
+void InotifyCtx::checkSoon(LuaCtx *ctx)
+{
+  sched_[ctx].checkInterval = 1;
+  scheduleCheck(ctx, 1);
+}
+
+/* unlink or truncate of the files due this tick. a file doubles its interval
+ * while nothing happens to it, an event or a rotate in progress brings it back to 1s
+ */
 void InotifyCtx::tryRmWatch()
 {
-  for (std::map<int, LuaCtx *>::iterator ite = fdToCtx_.begin(); ite != fdToCtx_.end(); ) {
-    LuaCtx *ctx = ite->second;
+  std::vector<LuaCtx *> &slot = wheel_[++wheelTick_ % CHECK_WHEEL_SLOTS];
+  std::vector<LuaCtx *> ctxs;
+  for (std::vector<LuaCtx *>::iterator ite = slot.begin(); ite != slot.end(); ++ite) {
+    TailSched &sched = sched_[*ite];
+    if (sched.checkTick != wheelTick_ || getLuaCtx(sched.wd) != *ite) continue;
+    sched.checkTick = 0;
+    ctxs.push_back(*ite);
+  }
+  slot.clear();
 
-    if (ctx->getFileReader()->remove()) {
-      log_info(0, "remove watch %s @%d", ctx->file().c_str(), ite->first);
+  for (size_t i = 0; i < ctxs.size(); ++i) {
+    LuaCtx *ctx = ctxs[i];
+    FileReader *reader = ctx->getFileReader();
+    TailSched &sched = sched_[ctx];
+    cnf_->stats()->rotateCheckInc();
 
-      inotify_rm_watch(wfd_, ite->first);
-      fdToCtx_.erase(ite++);
-    } else {
-      ++ite;
+    if (reader->remove()) {
+      log_info(0, "remove watch %s @%d", ctx->file().c_str(), sched.wd);
+
+      inotify_rm_watch(wfd_, sched.wd);
+      wdToCtx_.erase(sched.wd);
+      continue;
     }
+
+    sched.checkInterval = reader->watching() ? std::min(sched.checkInterval * 2, MAX_CHECK_INTERVAL) : 1;
+    scheduleCheck(ctx, sched.checkInterval);
   }
 }
 
 void InotifyCtx::loop()
 {
   RunStatus *runStatus = cnf_->getRunStatus();
+  if (!startWorkers()) {
+    log_fatal(0, "start tail workers error %s", cnf_->errbuf());
+    stopWorkers();
+    runStatus->set(RunStatus::STOP);
+    return;
+  }
 
-  const size_t eventBufferSize = cnf_->getLuaCtxSize() * ONE_EVENT_SIZE * 5;
-  char *eventBuffer = (char *) malloc(eventBufferSize);
+  if (!startCatchup()) {
+    log_fatal(0, "start catchup workers error %s", cnf_->errbuf());
+    stopWorkers();
+    stopCatchup();
+    runStatus->set(RunStatus::STOP);
+    return;
+  }
 
-  struct pollfd fds[] = {
-    {wfd_, POLLIN, 0 }
-  };
+  if (!initEpoll()) {
+    log_fatal(0, "init epoll error %s", cnf_->errbuf());
+    stopWorkers();
+    stopCatchup();
+    runStatus->set(RunStatus::STOP);
+    return;
+  }
+
+  // every file is read once, then on IN_MODIFY
+  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
+       ite != cnf_->getLuaCtxs().end(); ++ite) {
+    ready(*ite, false);
+  }
+  catchupCheck();
+
+  KafkaCtx *kafka = cnf_->getKafka();
+  struct epoll_event events[MAX_EPOLL_EVENT];
 
-  long savedTime = cnf_->fasttime(true, TIMEUNIT_MILLI);
   while (runStatus->get() == RunStatus::WAIT) {
-    int nfd = poll(fds, 1, cnf_->getTailLimit() ? 1 : 500);
-    cnf_->fasttime(true, TIMEUNIT_SECONDS);
+    // files left unread by the last drain go on at once
+    bool busy = !ready_.empty() && !cnf_->flowControlOn();
+
+    // the routine thread gets no records of blocked files, acks come by delivery reports here
+    if (kafka) watchKafka(cnf_->tailBlocked());
+
+    int nfd = epoll_wait(epfd_, events, MAX_EPOLL_EVENT, busy ? 0 : cnf_->getTailLimit() ? 1 : -1);
+    int64_t now = cnf_->fasttime(true, TIMEUNIT_MILLI);
     cnf_->setTailLimit(false);
 
     if (nfd == -1) {
       if (errno != EINTR) return;
-    } else if (nfd == 0) {
+      continue;
+    }
+
+    bool tick = false;
+    for (int i = 0; i < nfd; ++i) {
+      int fd = events[i].data.fd;
+      uint64_t n;
+
+      if (fd == wfd_) {
+        readEvents();
+      } else if (fd == cnf_->tailWakeFd()) {
+        wakeup();
+      } else if (kafka && fd == kafka->eventFd()) {
+        kafka->drainEventFd();
+        kafka->poll(0);
+      } else if (fd == tickFd_) {
+        if (read(tickFd_, &n, sizeof(n)) == sizeof(n)) tick = true;
+      } else if (fd == coalesceFd_) {
+        if (read(coalesceFd_, &n, sizeof(n)) == sizeof(n)) coalesceTime_ = 0;
+        expireDeferred(now);
+      }
+    }
+    drain();
+
+    // rotate checks of the files due, once a second is enough to see unlink and truncate
+    if (tick) {
+      if (kafka && cnf_->tailBlocked()) kafka->poll(0);  // in case the pipe was drained before
       globalCheck();
-    } else {
-      ssize_t nn = read(wfd_, eventBuffer, eventBufferSize);
-      assert(nn > 0);
-
-      char *p = eventBuffer;
-      while (p < eventBuffer + nn) {
-        /* IN_IGNORED when watch was removed */
-        struct inotify_event *event = (struct inotify_event *) p;
-        if (event->mask & IN_MODIFY) {
-          LuaCtx *ctx = getLuaCtx(event->wd);
-          if (ctx) {
-            log_debug(0, "inotify %s was modified", ctx->file().c_str());
-            ctx->getFileReader()->tail2kafka();
-          } else {
-            log_fatal(0, "@%d could not found ctx", event->wd);
-          }
+      tryRmWatch();
+      catchupCheck();
+    }
+
+    tryReWatch();
+    cnf_->logStats();
+  }
+
+  stopWorkers();
+  stopCatchup();
+  runStatus->set(RunStatus::STOP);
+}
+
+/* files not at eof read on, the others leave the active files after a last checkCache
+ * flushed their caches, IN_MODIFY brings them back
+ */
+void InotifyCtx::globalCheck()
+{
+  int64_t now = cnf_->fasttime(true, TIMEUNIT_MILLI);
+
+  std::vector<LuaCtx *> active;
+  for (std::vector<LuaCtx *>::iterator ite = active_.begin(); ite != active_.end(); ++ite) {
+    LuaCtx *ctx = *ite;
+    FileReader *reader = ctx->getFileReader();
+    TailSched &sched = sched_[ctx];
+
+    reader->checkCache();
+    if (!reader->eof()) {
+      ready(ctx, false);
+    } else if (!sched.ready && !sched.deferTime && now - sched.tailTime >= ACTIVE_TIMEOUT * 1000) {
+      sched.active = false;
+      sched.idleTime = now;
+      if (ctx->globTemplate()) idle_.push_back(std::make_pair(ctx, now));
+      continue;
+    }
+    active.push_back(ctx);
+  }
+  active_.swap(active);
+
+  drain();
+  closeIdleFiles();
+  logLatency();
+}
+
+void InotifyCtx::readEvents()
+{
+  ssize_t nn;
+  while ((nn = read(wfd_, eventBuffer_, eventBufferSize_)) > 0) {
+    char *p = eventBuffer_;
+    while (p < eventBuffer_ + nn) {
+      /* IN_IGNORED when watch was removed */
+      struct inotify_event *event = (struct inotify_event *) p;
+      if (event->mask & (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB)) {
+        LuaCtx *ctx = getLuaCtx(event->wd);
+        if (ctx) checkSoon(ctx);
+      }
+      if (event->mask & IN_MODIFY) {
+        LuaCtx *ctx = getLuaCtx(event->wd);
+        if (ctx) {
+          log_debug(0, "inotify %s was modified", ctx->file().c_str());
+          if (wake(ctx)) ready(ctx, true);
+        } else {
+          log_fatal(0, "@%d could not found ctx", event->wd);
         }
-        if (event->mask & IN_MOVE_SELF) {
-          LuaCtx *ctx = getLuaCtx(event->wd);
-          if (ctx) {
-            log_info(0, "inotify %s was moved", ctx->file().c_str());
-            tryRmWatch(ctx, event->wd);
-          } else {
-            log_fatal(0, "@%d could not found ctx", event->wd);
-          }
+      }
+      if (event->mask & IN_MOVE_SELF) {
+        LuaCtx *ctx = getLuaCtx(event->wd);
+        if (ctx) {
+          log_info(0, "inotify %s was moved", ctx->file().c_str());
+          if (wake(ctx)) tryRmWatch(ctx, event->wd);
+        } else {
+          log_fatal(0, "@%d could not found ctx", event->wd);
         }
-        p += sizeof(struct inotify_event) + event->len;
       }
+      if (event->mask & IN_DELETE_SELF) {
+        LuaCtx *ctx = getLuaCtx(event->wd);
+        if (ctx) wake(ctx);
+      }
+      if (event->mask & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_IGNORED)) globDirEvent(event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+/* a cheap read goes at once, so lines of a quiet file have no delay.
+ * a read costing c ms is followed by one no sooner than COALESCE_FACTOR * c
+ * (at most polllimit) later, writes in between are coalesced into it
+ */
+void InotifyCtx::ready(LuaCtx *ctx, bool modify)
+{
+  TailSched &sched = sched_[ctx];
+  int64_t now = cnf_->fasttime(true, TIMEUNIT_MILLI);
+  if (modify && sched.modifyTime == 0) sched.modifyTime = now;
+  if (!sched.active) {
+    sched.active = true;
+    active_.push_back(ctx);
+  }
+  if (sched.ready || sched.deferTime) return;
 
-      unEofCheck();
+  int64_t interval = std::min((int64_t) cnf_->getPollLimit(), sched.tailCost * COALESCE_FACTOR / 1000);
+  if (modify && interval > 0 && now < sched.tailTime + interval) {
+    sched.deferTime = sched.tailTime + interval;
+    deferred_.push_back(ctx);
+    if (coalesceTime_ == 0 || sched.deferTime < coalesceTime_) {
+      coalesceTime_ = sched.deferTime;
+      armTimer(coalesceFd_, coalesceTime_ - now, false);
     }
+    return;
+  }
 
-    if (cnf_->fasttime() != savedTime) {
-      globalCheck();
-      savedTime = cnf_->fasttime();
+  sched.ready = true;
+  ready_.push_back(ctx);
+}
+
+void InotifyCtx::expireDeferred(int64_t now)
+{
+  std::vector<LuaCtx *> deferred;
+  int64_t next = 0;
+
+  for (std::vector<LuaCtx *>::iterator ite = deferred_.begin(); ite != deferred_.end(); ++ite) {
+    TailSched &sched = sched_[*ite];
+    if (sched.deferTime <= now) {
+      sched.deferTime = 0;
+      ready(*ite, false);
+    } else {
+      if (next == 0 || sched.deferTime < next) next = sched.deferTime;
+      deferred.push_back(*ite);
     }
+  }
+  deferred_.swap(deferred);
 
-    tryRmWatch();
-    tryReWatch();
+  if (next && (coalesceTime_ == 0 || next < coalesceTime_)) {
+    coalesceTime_ = next;
+    armTimer(coalesceFd_, next - now, false);
+  }
+}
+
+void InotifyCtx::armTimer(int fd, int64_t ms, bool repeat)
+{
+  if (ms <= 0) ms = 1;   // 0 disarms the timer
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec  = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000;
+  if (repeat) its.it_interval = its.it_value;
 
-    if (cnf_->getPollLimit()) sys::millisleep(cnf_->getPollLimit());
-    flowControl(runStatus);
+  if (timerfd_settime(fd, 0, &its, 0) == -1) log_fatal(errno, "timerfd_settime error");
+}
+
+bool InotifyCtx::initEpoll()
+{
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  tickFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  coalesceFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epfd_ == -1 || tickFd_ == -1 || coalesceFd_ == -1) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "epoll/timerfd create error %s", strerror(errno));
+    return false;
   }
 
-  runStatus->set(RunStatus::STOP);
+  int fds[] = {wfd_, cnf_->tailWakeFd(), tickFd_, coalesceFd_};
+  for (size_t i = 0; i < sizeof(fds)/sizeof(fds[0]); ++i) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+      snprintf(cnf_->errbuf(), MAX_ERR_LEN, "epoll add %d error %s", fds[i], strerror(errno));
+      return false;
+    }
+  }
+
+  armTimer(tickFd_, 1000, true);
+  return true;
 }
 
-void InotifyCtx::globalCheck()
+void InotifyCtx::watchKafka(bool watch)
 {
-  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
-       ite != cnf_->getLuaCtxs().end(); ++ite) {
-    (*ite)->getFileReader()->checkCache();
+  if (watch == kafkaWatched_) return;
+
+  int fd = cnf_->getKafka()->eventFd();
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd_, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) == -1) {
+    log_fatal(errno, "epoll %s kafka event fd error", watch ? "add" : "del");
+    return;
   }
-  unEofCheck();
+  kafkaWatched_ = watch;
 }
 
-void InotifyCtx::unEofCheck()
+/* every ready file gets its quantum and reads up to the deficit,
+ * it leaves the round robin when it catches up or makes no progress
+ */
+void InotifyCtx::tailRound()
 {
-  for (std::vector<LuaCtx *>::iterator ite = cnf_->getLuaCtxs().begin();
-       ite != cnf_->getLuaCtxs().end(); ++ite) {
-    LuaCtx *ctx = *ite;
-    if (!ctx->getFileReader()->eof()) ctx->getFileReader()->tail2kafka();
+  int64_t start = cnf_->fasttime(true, TIMEUNIT_MICRO);
+  int64_t now = start / 1000;
+
+  for (size_t i = 0; i < ready_.size(); ++i) {
+    TailSched &sched = sched_[ready_[i]];
+    sched.deficit += sched.quantum;
+
+    if (sched.modifyTime) {
+      int64_t latency = now - sched.modifyTime;
+      sched.latencyMax = std::max(sched.latencyMax, latency);
+      sched.latencySum += latency;
+      sched.latencyCnt++;
+      sched.modifyTime = 0;
+    }
+
+    FileReader *reader = ready_[i]->getFileReader();
+    reader->setTailBudget(sched.deficit);
+    tail(ready_[i]);
+  }
+  waitTail();
+
+  // files of a round are read in parallel by workers, each is charged the round
+  int64_t end = cnf_->fasttime(true, TIMEUNIT_MICRO);
+
+  std::vector<LuaCtx *> ready;
+  for (std::vector<LuaCtx *>::iterator ite = ready_.begin(); ite != ready_.end(); ++ite) {
+    FileReader *reader = (*ite)->getFileReader();
+    TailSched &sched = sched_[*ite];
+    sched.tailTime = end / 1000;
+    sched.tailCost = end - start;
+
+    sched.deficit = std::max(sched.deficit - reader->tailBytes(), (off_t) 0);
+    if (reader->eof() || reader->tailBytes() == 0) {
+      sched.deficit = 0;
+      sched.ready = false;
+    } else {
+      ready.push_back(*ite);
+    }
+  }
+  ready_.swap(ready);
+}
+
+/* rounds go on until every file catches up or MAX_DRAIN_TIME,
+ * files modified in the meantime join the next round
+ */
+void InotifyCtx::drain()
+{
+  int64_t start = cnf_->fasttime(true, TIMEUNIT_MILLI);
+  while (!ready_.empty() && !cnf_->flowControlOn()) {
+    tailRound();
+    if (cnf_->fasttime(true, TIMEUNIT_MILLI) - start >= MAX_DRAIN_TIME) break;
+    readEvents();
+  }
+}
+
+void InotifyCtx::logLatency()
+{
+  if (cnf_->fasttime() < latencyLogTime_ + LATENCY_LOG_INTERVAL) return;
+  latencyLogTime_ = cnf_->fasttime();
+
+  for (std::map<LuaCtx *, TailSched>::iterator ite = sched_.begin(); ite != sched_.end(); ++ite) {
+    TailSched &sched = ite->second;
+    if (sched.latencyCnt == 0) continue;
+
+    log_info(0, "%s TailLatency,avg=%ldms,max=%ldms,count=%d", ite->first->file().c_str(),
+             (long) (sched.latencySum / sched.latencyCnt), (long) sched.latencyMax, sched.latencyCnt);
+    sched.latencyMax = sched.latencySum = 0;
+    sched.latencyCnt = 0;
   }
 }
@@ -2,39 +2,181 @@
 #define _INOTIFY_CTX_H_
 
 #include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
 #include "runstatus.h"
+#include "taskqueue.h"
 
 class LuaCtx;
 class CnfCtx;
+class LuaHelper;
+struct FileOffRecord;
+struct inotify_event;
 
 class InotifyCtx {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  InotifyCtx(CnfCtx *cnf) : cnf_(cnf), wfd_(-1) {}
+  InotifyCtx(CnfCtx *cnf);
   ~InotifyCtx();
 
   bool init();
   void loop();
 
+  void tailDone();
+
+  /* history files read on the catch-up threads, each one from START to END,
+   * WAIT until a thread is free, END when the thread is done with it
+   */
+  enum CatchupState { CATCHUP_WAIT, CATCHUP_RUN, CATCHUP_END };
+  struct CatchupFile {
+    CatchupFile(LuaCtx *h, const std::string &f)
+      : head(h), file(f), ctx(0), fileOff(0), worker(-1), state(CATCHUP_WAIT), size(0), offset(0) {}
+
+    LuaCtx        *head;     // the file whose history it is
+    std::string    file;     // as in the catchup list of head
+    LuaCtx        *ctx;
+    FileOffRecord *fileOff;
+    int            worker;
+    int            state;
+    off_t          size;     // on disk
+    off_t          offset;   // on disk, set by the catch-up thread
+  };
+  void catchupRead(CatchupFile *file);
+
 private:
   LuaCtx *getLuaCtx(int wd) {
-    std::map<int, LuaCtx *>::iterator pos = fdToCtx_.find(wd);
-    return pos != fdToCtx_.end() ? pos->second : 0;
+    std::tr1::unordered_map<int, LuaCtx *>::iterator pos = wdToCtx_.find(wd);
+    return pos != wdToCtx_.end() ? pos->second : 0;
   }
 
+  /* readers are set up in the child, the loop starts epoll after that */
+  bool running() const { return epfd_ != -1; }
+
+  bool watch(LuaCtx *ctx);
+  void setWatch(LuaCtx *ctx, int wd);
+  bool watchGlobDir(LuaCtx *glob, const std::string &dir);
+  void globEntry(LuaCtx *glob, const std::string &path, bool isdir);
+  void globDirEvent(const struct inotify_event *event);
+  void addGlobFile(LuaCtx *glob, const std::string &file);
+  bool wake(LuaCtx *ctx, const char *file = 0);
+  void closeIdleFiles();
+
+  void readEvents();
+  void ready(LuaCtx *ctx, bool modify);
+  void tailRound();
+  void drain();
+  void logLatency();
+
+  bool rewatch(LuaCtx *ctx);
   bool tryReWatch();
   void tryRmWatch(LuaCtx *ctx, int wd);
   void tryRmWatch();
+  void scheduleCheck(LuaCtx *ctx, int interval);
+  void checkSoon(LuaCtx *ctx);
   void globalCheck();
-  void unEofCheck();
 
-  void flowControl(RunStatus *runStatus);
+  void wakeup();
+
+  bool initEpoll();
+  void watchKafka(bool watch);
+  void expireDeferred(int64_t now);
+  void armTimer(int fd, int64_t ms, bool repeat);
+
+  bool startWorkers();
+  void stopWorkers();
+
+  bool startCatchup();
+  void stopCatchup();
+  void catchupCheck();
+  bool catchupStart(CatchupFile *file, int worker);
+  void logCatchup();
+  void tail(LuaCtx *ctx);
+  void waitTail();
 
 private:
   CnfCtx *cnf_;
 
   int wfd_;
-  std::map<int, LuaCtx *> fdToCtx_;
+  std::tr1::unordered_map<int, LuaCtx *> wdToCtx_;  // wds are never reused, removed ones are erased
+  std::map<int, std::string>  globDirs_;   // directories glob files may come in
+  uint32_t                    moveCookie_; // IN_MOVED_FROM waits for its IN_MOVED_TO
+  std::string                 moveFrom_;
+  char   *eventBuffer_;
+  size_t  eventBufferSize_;
+
+  /* inotify, tail wakeup, kafka delivery reports and timers in one epoll,
+   * created in loop, it does not survive fork
+   */
+  int     epfd_;
+  int     tickFd_;       // 1s, globalCheck
+  int     coalesceFd_;   // the first deferred file is due
+  int64_t coalesceTime_;
+  bool    kafkaWatched_;
+
+  /* deficit round robin over the files with unread data, each round a file
+   * reads at most its deficit, so a chatty file can not starve the others
+   */
+  struct TailSched {
+    off_t   quantum;   // quantum * weight
+    off_t   deficit;
+    bool    ready;
+    int64_t modifyTime;  // ms, the first IN_MODIFY not read yet
+    int64_t tailTime;    // ms, the last read ends
+    int64_t tailCost;    // us, the last read takes
+    int64_t deferTime;   // ms, writes are coalesced until then
+    int     wd;
+    bool    active;
+    int64_t idleTime;    // ms, left the active files
+    int      checkInterval;  // s, of the rotate check
+    uint64_t checkTick;      // the tick it is due, 0 not in the wheel
+
+    int64_t latencyMax;  // ms from IN_MODIFY to read
+    int64_t latencySum;
+    int     latencyCnt;
+  };
+  std::map<LuaCtx *, TailSched> sched_;
+
+  /* rotate checks by the 1s tick they are due */
+  std::vector<std::vector<LuaCtx *> > wheel_;
+  uint64_t                             wheelTick_;
+  std::vector<LuaCtx *>         ready_;
+  std::vector<LuaCtx *>         deferred_;
+  time_t                        latencyLogTime_;
+
+  /* files read in the last ACTIVE_TIMEOUT, the 1s checks go over these only.
+   * instances gone idle queue up in idle_, the oldest close first over maxopenfiles
+   */
+  std::vector<LuaCtx *>                      active_;
+  std::deque<std::pair<LuaCtx *, int64_t> >  idle_;
+  int                                        instances_;
+  int                                        sleeping_;
+
+  /* each file is pinned to one worker, so its lines are still read in order,
+   * rotate and rewatch run on the inotify thread when all workers are idle
+   */
+  std::vector<util::TaskQueue *>        workers_;
+  std::vector<LuaHelper *>              workerHelpers_;
+  std::map<LuaCtx *, util::TaskQueue *> ctxToWorker_;
+
+  int             pending_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t  cond_;
+
+  std::vector<util::TaskQueue *>  catchupWorkers_;
+  std::vector<LuaHelper *>        catchupHelpers_;
+  std::vector<CatchupFile *>      catchupSlots_;   // by worker, 0 if free
+  std::deque<CatchupFile *>       catchupWait_;
+  std::vector<CatchupFile *>      catchup_;        // read or waiting for acks
+  int                             catchupStop_;
+  off_t                           catchupRate_;    // bytes a second of a thread, 0 no limit
+  off_t                           catchupDone_;    // bytes of the files finished
+  off_t                           catchupLogDone_;
+  time_t                          catchupLogTime_;
 };
 
 #endif
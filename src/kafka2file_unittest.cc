@@ -47,6 +47,21 @@ DEFINE(messageInfoExtrace)
   check(info.host == "zzyong", "info host error %s", PTRS(info.host));
   check(info.file == "oldFileName", "info file error %s", PTRS(info.file));
   check(info.size == 100, "info size error %d", (int) info.size);
+  check(info.checksumAlg.empty(), "info checksumalg error %s", PTRS(info.checksumAlg));
+
+  payload = "#zzyong {'time':'2018-02-13T11:48:57', 'event':'END', 'file':'oldFileName','size':100, 'md5':'', 'checksum':'e3069283', 'checksumalg':'crc32c'}";
+  util::replace(&payload, '\'', '"');
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, false);
+  check(rc, "extrace %s error", PTRS(payload));
+  check(info.checksumAlg == "crc32c", "info checksumalg error %s", PTRS(info.checksumAlg));
+  check(info.checksum == "e3069283", "info checksum error %s", PTRS(info.checksum));
+
+  payload = "#zzyong {'time':'2018-02-13T11:48:57', 'event':'END', 'file':'oldFileName','size':100, 'md5':'7b88e495713969b037e50ca7b9b54af5'}";
+  util::replace(&payload, '\'', '"');
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, false);
+  check(rc, "extrace %s error", PTRS(payload));
+  check(info.checksumAlg == "md5", "info checksumalg error %s", PTRS(info.checksumAlg));
+  check(info.checksum == info.md5, "info checksum error %s", PTRS(info.checksum));
 
   payload = "#zzyong {'time':'2018-02-13T11:48:57', 'event':'START'}";
   util::replace(&payload, '\'', '"');
@@ -61,6 +76,25 @@ DEFINE(messageInfoExtrace)
   check(info.pos == 123456789, "info pos error %lu", info.pos);
   check(info.len == 11, "info payload len error %d", info.len);
   check(strncmp(info.ptr, "Hello World", info.len) == 0, "info payload error %.*s", info.len, info.ptr);
+  check(info.fragIndex == -1, "info fragIndex error %d", info.fragIndex);
+
+  payload = "*zzyong@123456789:0/0 Hello";
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(rc, "extrace %s error", PTRS(payload));
+  check(info.pos == 123456789, "info pos error %lu", info.pos);
+  check(info.fragIndex == 0 && info.fragTotal == 0, "info frag error %d/%d", info.fragIndex, info.fragTotal);
+  check(info.len == 5, "info payload len error %d", info.len);
+
+  payload = "*zzyong@123456794:1/2  World\n";
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(rc, "extrace %s error", PTRS(payload));
+  check(info.pos == 123456794, "info pos error %lu", info.pos);
+  check(info.fragIndex == 1 && info.fragTotal == 2, "info frag error %d/%d", info.fragIndex, info.fragTotal);
+  check(strncmp(info.ptr, " World", info.len) == 0, "info payload error %.*s", info.len, info.ptr);
+
+  payload = "*zzyong@123456789:0 Hello";
+  rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
+  check(!rc, "extrace %s error", PTRS(payload));
 
   payload = "zzyong Hello World\n";
   rc = MessageInfo::extract(payload.c_str(), payload.size(), &info, true);
@@ -1,5 +1,7 @@
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 
 #include "logger.h"
@@ -78,9 +80,24 @@ bool KafkaCtx::initKafka(const char *brokers, const std::map<std::string, std::s
     snprintf(errbuf, MAX_ERR_LEN, "kafka invalid brokers %s", brokers);
     return false;
   }
+
+  // librdkafka writes the pipe when the main queue becomes non-empty
+  if (pipe2(eventFd_, O_NONBLOCK | O_CLOEXEC) == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "kafka event pipe error %s", strerror(errno));
+    return false;
+  }
+  rd_kafka_queue_t *rkq = rd_kafka_queue_get_main(rk_);
+  rd_kafka_queue_io_event_enable(rkq, eventFd_[1], "1", 1);
+  rd_kafka_queue_destroy(rkq);
   return true;
 }
 
+void KafkaCtx::drainEventFd()
+{
+  char buffer[64];
+  while (read(eventFd_[0], buffer, sizeof(buffer)) > 0) {}
+}
+
 rd_kafka_topic_t *KafkaCtx::initKafkaTopic(LuaCtx *ctx, const std::map<std::string, std::string> &tcnf, char *errbuf)
 {
   char errstr[512];
@@ -123,8 +140,13 @@ bool KafkaCtx::init(CnfCtx *cnf, char *errbuf)
   errors_ = new int[cnf->getLuaCtxSize()];
   memset(errors_, 0, cnf->getLuaCtxSize());
 
-  for (LuaCtxPtrList::iterator ite = cnf->getLuaCtxs().begin();
-       ite != cnf->getLuaCtxs().end(); ++ite) {
+  // instances of a glob produce to the template's topic
+  LuaCtxPtrList ctxs(cnf->getGlobCtxs());
+  for (LuaCtxPtrList::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
+    if (!(*ite)->globTemplate()) ctxs.push_back(*ite);
+  }
+
+  for (LuaCtxPtrList::iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
     LuaCtx *ctx = (*ite);
     while (ctx) {
       rd_kafka_topic_t *rkt = initKafkaTopic(ctx, cnf->getKafkaTopicConf(), errbuf);
@@ -145,6 +167,8 @@ KafkaCtx::~KafkaCtx()
 {
   for (size_t i = 0; i < nrkt_; ++i) rd_kafka_topic_destroy(rkts_[i]);
   if (rk_) rd_kafka_destroy(rk_);
+  if (eventFd_[0] != -1) close(eventFd_[0]);
+  if (eventFd_[1] != -1) close(eventFd_[1]);
 
   if (rkts_) delete[] rkts_;
   if (errors_) delete[] errors_;
@@ -184,12 +208,12 @@ bool KafkaCtx::produce(FileRecord *record)
         return false;
       }
 
-      cnf->flowControl(true);
+      record->ctx->congest();
       int nevent = rd_kafka_poll(rk_, 100 * i);
       log_error(0, "%s kafka produce error(#%d) %s, poll event %d",
                 rd_kafka_topic_name(rkt), i++, rd_kafka_err2str(err), nevent);
     } else {
-      cnf->stats()->queueSizeDec();
+      record->ctx->queueSizeDec(1, record->data->size());
       cnf->stats()->logErrorInc();
       log_fatal(0, "%s kafka produce error %s",
                 rd_kafka_topic_name(rkt), rd_kafka_err2str(err));
@@ -198,7 +222,6 @@ bool KafkaCtx::produce(FileRecord *record)
     }
   }
 
-  cnf->flowControl(false);
   return true;
 }
 
@@ -209,7 +232,7 @@ bool KafkaCtx::produce(std::vector<FileRecord *> *datas)
   assert(!datas->empty());
   rd_kafka_topic_t *rkt = rkts_[datas->at(0)->ctx->rktId()];
 
-  std::vector<rd_kafka_message_t> rkmsgs;
+  std::vector<rd_kafka_message_t> &rkmsgs = rkmsgs_;
   rkmsgs.resize(datas->size());
 
   size_t i = 0;
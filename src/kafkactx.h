@@ -13,11 +13,15 @@ class LuaCtx;
 class KafkaCtx {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  KafkaCtx() : rk_(0), nrkt_(0), rkts_(0), errors_(0) {}
+  KafkaCtx() : rk_(0), nrkt_(0), rkts_(0), errors_(0) { eventFd_[0] = eventFd_[1] = -1; }
   ~KafkaCtx();
   bool init(CnfCtx *cnf, char *errbuf);
   bool produce(std::vector<FileRecord *> *datas);
   void poll(int timeout) { rd_kafka_poll(rk_, timeout); }
+
+  /* readable when delivery reports are waiting, call poll(0) after drainEventFd */
+  int eventFd() const { return eventFd_[0]; }
+  void drainEventFd();
   bool ping(LuaCtx *ctx);
 
 private:
@@ -27,6 +31,8 @@ private:
   size_t             nrkt_;
   rd_kafka_topic_t **rkts_;
   int               *errors_;
+  int                eventFd_[2];
+  std::vector<rd_kafka_message_t> rkmsgs_;   // of a batch, reused by the routine thread
 
   static void error_cb(rd_kafka_t *, int, const char *, void *);
 
@@ -0,0 +1,161 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_INDEX_X86
+#endif
+
+#include "lineindex.h"
+
+#define NL '\n'
+
+/* scan buffer[i, size), push the offset of NL relative to buffer */
+typedef size_t (*IndexLinesFunc)(const char *buffer, size_t i, size_t size, std::vector<uint32_t> *index);
+
+static size_t indexLinesScalar(const char *buffer, size_t i, size_t size, std::vector<uint32_t> *index)
+{
+  size_t count = 0;
+  const char *pos, *p = buffer + i, *end = buffer + size;
+  while (p < end && (pos = (const char *) memchr(p, NL, end - p))) {
+    index->push_back(pos - buffer);
+    p = pos + 1;
+    ++count;
+  }
+  return count;
+}
+
+#ifdef LINE_INDEX_X86
+inline size_t pushMask(uint64_t mask, size_t i, std::vector<uint32_t> *index)
+{
+  size_t count = 0;
+  while (mask) {
+    index->push_back(i + __builtin_ctzll(mask));
+    mask &= mask - 1;
+    ++count;
+  }
+  return count;
+}
+
+__attribute__((target("sse2")))
+static size_t indexLinesSse2(const char *buffer, size_t i, size_t size, std::vector<uint32_t> *index)
+{
+  const __m128i nl = _mm_set1_epi8(NL);
+
+  size_t count = 0;
+  for (; i + 64 <= size; i += 64) {
+    uint64_t m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i)), nl));
+    uint64_t m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 16)), nl));
+    uint64_t m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 32)), nl));
+    uint64_t m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 48)), nl));
+    count += pushMask(m0 | (m1 << 16) | (m2 << 32) | (m3 << 48), i, index);
+  }
+  for (; i + 16 <= size; i += 16) {
+    uint64_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i)), nl));
+    count += pushMask(m, i, index);
+  }
+  return count + indexLinesScalar(buffer, i, size, index);
+}
+
+__attribute__((target("avx2")))
+static size_t indexLinesAvx2(const char *buffer, size_t i, size_t size, std::vector<uint32_t> *index)
+{
+  const __m256i nl = _mm256_set1_epi8(NL);
+
+  size_t count = 0;
+  for (; i + 128 <= size; i += 128) {
+    __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i)), nl);
+    __m256i c1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 32)), nl);
+    __m256i c2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 64)), nl);
+    __m256i c3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 96)), nl);
+
+    // long lines, most blocks have no NL
+    __m256i any = _mm256_or_si256(_mm256_or_si256(c0, c1), _mm256_or_si256(c2, c3));
+    if (_mm256_testz_si256(any, any)) continue;
+
+    uint64_t m0 = (uint32_t) _mm256_movemask_epi8(c0) | ((uint64_t) (uint32_t) _mm256_movemask_epi8(c1) << 32);
+    uint64_t m1 = (uint32_t) _mm256_movemask_epi8(c2) | ((uint64_t) (uint32_t) _mm256_movemask_epi8(c3) << 32);
+    count += pushMask(m0, i, index);
+    count += pushMask(m1, i + 64, index);
+  }
+  return count + indexLinesSse2(buffer, i, size, index);
+}
+#endif
+
+typedef size_t (*ZeroRunFunc)(const char *buffer, size_t i, size_t size);
+
+static size_t zeroRunScalar(const char *buffer, size_t i, size_t size)
+{
+  while (i < size && buffer[i] == 0) ++i;
+  return i;
+}
+
+#ifdef LINE_INDEX_X86
+__attribute__((target("sse2")))
+static size_t zeroRunSse2(const char *buffer, size_t i, size_t size)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i)), zero));
+    if (m != 0xffff) return i + __builtin_ctz(~m);
+  }
+  return zeroRunScalar(buffer, i, size);
+}
+
+__attribute__((target("avx2")))
+static size_t zeroRunAvx2(const char *buffer, size_t i, size_t size)
+{
+  for (; i + 64 <= size; i += 64) {
+    __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buffer + i)),
+                                _mm256_loadu_si256((const __m256i *) (buffer + i + 32)));
+    if (!_mm256_testz_si256(v, v)) break;
+  }
+  return zeroRunSse2(buffer, i, size);
+}
+#endif
+
+static const char *indexLinesName = "scalar";
+
+static IndexLinesFunc resolveIndexLines()
+{
+#ifdef LINE_INDEX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    indexLinesName = "avx2";
+    return indexLinesAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    indexLinesName = "sse2";
+    return indexLinesSse2;
+  }
+#endif
+  return indexLinesScalar;
+}
+
+static IndexLinesFunc indexLinesFunc = resolveIndexLines();
+
+static ZeroRunFunc resolveZeroRun()
+{
+#ifdef LINE_INDEX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return zeroRunAvx2;
+  if (__builtin_cpu_supports("sse2")) return zeroRunSse2;
+#endif
+  return zeroRunScalar;
+}
+
+static ZeroRunFunc zeroRunFunc = resolveZeroRun();
+
+size_t indexLines(const char *buffer, size_t size, std::vector<uint32_t> *index)
+{
+  return indexLinesFunc(buffer, 0, size, index);
+}
+
+const char *indexLinesImpl()
+{
+  return indexLinesName;
+}
+
+size_t zeroRun(const char *buffer, size_t size)
+{
+  return zeroRunFunc(buffer, 0, size);
+}
@@ -0,0 +1,19 @@
+#ifndef _LINE_INDEX_H_
+#define _LINE_INDEX_H_
+
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* append the offset of every NL in buffer to index, in one pass,
+ * use AVX2 or SSE2 if the cpu supports, else memchr
+ */
+size_t indexLines(const char *buffer, size_t size, std::vector<uint32_t> *index);
+
+// the implementation indexLines dispatched to, for benchmark
+const char *indexLinesImpl();
+
+/* length of the NUL run at the start of buffer, vectorized the same as indexLines */
+size_t zeroRun(const char *buffer, size_t size);
+
+#endif
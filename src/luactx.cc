@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <errno.h>
@@ -90,6 +91,21 @@ static bool writeHistoryFile(const std::string &libdir, const std::string &name,
   return writeFile("history", file.c_str(), q);
 }
 
+static bool loadCatchupFile(const std::string &libdir, const std::string &name, std::deque<std::string> *q)
+{
+  std::string file = libdir + "/" + name + ".catchup";
+  return loadFile(file.c_str(), q);
+}
+
+static bool writeCatchupFile(const std::string &libdir, const std::string &name, const std::deque<std::string> &q)
+{
+  std::string file = libdir + "/" + name + ".catchup";
+  return writeFile("catchup", file.c_str(), q);
+}
+
+// logrotate compress, the history file becomes one of these
+static const char *compressExts[] = {".gz", ".zst", 0};
+
 static bool parseUserGroup(const char *username, uid_t *uid, gid_t *gid, char *errbuf)
 {
   const char *colon = strchr(username, ':');
@@ -176,6 +192,29 @@ bool LuaCtx::loadHistoryFile()
   if (files.size() == 1 && !files[0].empty()) fcurrent_ = files[0];
   else fcurrent_.clear();
 
+  std::string inode = cnf_->libdir() + "/" + fileAlias_ + ".inode";
+  files.clear();
+  if (!::loadFile(inode.c_str(), &files)) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "load inode file %s error %d:%s",
+             inode.c_str(), errno, strerror(errno));
+    return false;
+  }
+  if (files.size() == 2) {
+    hinodeFile_ = files[0];
+    hinode_     = strtoull(files[1].c_str(), 0, 10);
+  }
+
+  cqueue_.clear();
+  if (!::loadCatchupFile(cnf_->libdir(), fileAlias_, &cqueue_)) {
+    snprintf(cnf_->errbuf(), MAX_ERR_LEN, "load catchup file %s/%s.catchup error %d:%s",
+             cnf_->libdir().c_str(), fileAlias_.c_str(), errno, strerror(errno));
+    return false;
+  }
+
+  // exit between the two writes of catchupHistoryFiles, the catch-up threads have it
+  for (std::deque<std::string>::iterator ite = cqueue_.begin(); ite != cqueue_.end(); ++ite) {
+    fqueue_.erase(std::remove(fqueue_.begin(), fqueue_.end(), *ite), fqueue_.end());
+  }
   return true;
 }
 
@@ -183,8 +222,10 @@ bool LuaCtx::rectifyHistoryFile()
 {
   struct stat st;
   if (!fcurrent_.empty()) {
-    bool exitWhenRotate = fqueue_.empty() && stat(fcurrent_.c_str(), &st) == 0 &&
-      cnf_->getFileOff()->getOff(st.st_ino) != (off_t) -1;
+    // the rotated file may be compressed while tail2kafka is down
+    ino_t inode = stat(fcurrent_.c_str(), &st) == 0 ? st.st_ino : (fcurrent_ == hinodeFile_ ? hinode_ : 0);
+    bool exitWhenRotate = fqueue_.empty() && inode != 0 &&
+      cnf_->getFileOff()->getOff(inode) != (off_t) -1;
 
     bool exitWhenRotateWithHistory = !fqueue_.empty() && fqueue_.back() != fcurrent_;
 
@@ -196,6 +237,10 @@ bool LuaCtx::rectifyHistoryFile()
     std::string f = fqueue_.front();
     rc = stat(f.c_str(), &st) == 0;
     if (!rc && errno == ENOENT) {               // datafile not longer exists
+      if (followCompressedHistoryFile()) {
+        rc = true;
+        break;
+      }
       fqueue_.pop_front();
     } else {
       break;
@@ -223,9 +268,14 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
   }
 
   if (!helper->getBool("fileWithTimeFormat", &ctx->fileWithTimeFormat_, false)) return 0;
+  if (!helper->getBool("fileWithGlob", &ctx->fileWithGlob_, false)) return 0;
+  if (ctx->fileWithGlob_ && (ctx->fileWithTimeFormat_ || ctx->autocreat_)) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s fileWithGlob conflicts with fileWithTimeFormat and autocreat", file);
+    return 0;
+  }
 
   if (!helper->getString("file", &ctx->file_)) return 0;
-  if (!ctx->testFile(file, cnf->errbuf())) return 0;
+  if (!ctx->fileWithGlob_ && !ctx->testFile(file, cnf->errbuf())) return 0;
 
   std::string esIndex, esDoc;
 
@@ -244,7 +294,9 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
   }
 
   if (!helper->getString("fileAlias", &ctx->fileAlias_, ctx->topic_)) return 0;
-  for (std::vector<LuaCtx *>::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
+  std::vector<LuaCtx *> ctxs(cnf->getLuaCtxs());
+  ctxs.insert(ctxs.end(), cnf->getGlobCtxs().begin(), cnf->getGlobCtxs().end());
+  for (std::vector<LuaCtx *>::iterator ite = ctxs.begin(); ite != ctxs.end(); ++ite) {
     for (LuaCtx *existCtx = *ite; existCtx; existCtx = existCtx->next_) {
       if (!ctx->topic_.empty() && ctx->fileAlias_ == existCtx->fileAlias_) {
         snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s and %s has the same fileAlias %s",
@@ -266,8 +318,28 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
     if (!hostAddr(cnf->host(), &ctx->addr_, cnf->errbuf())) return 0;
   }
 
-  if (!helper->getBool("md5sum", &ctx->md5sum_, true)) return 0;
+  bool md5sum;
+  std::string checksum;
+  if (!helper->getBool("md5sum", &md5sum, true)) return 0;
+  if (!helper->getString("checksum", &checksum, md5sum ? "md5" : "none")) return 0;
+  ctx->checksum_ = Checksum::stringToAlgorithm(checksum.c_str());
+  if (ctx->checksum_ == Checksum::NIL) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s unknow checksum %s", file, checksum.c_str());
+    return 0;
+  }
   if (!helper->getBool("rawcopy", &ctx->rawcopy_, false)) return 0;
+  if (!helper->getBool("mmap", &ctx->mmap_, false)) return 0;
+  if (!helper->getBool("ffi", &ctx->ffi_, false)) return 0;
+  if (!helper->getInt("maxlinelen", &ctx->maxLineLen_, MAX_LINE_LEN)) return 0;
+  if (ctx->maxLineLen_ <= 0) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s maxlinelen %d must be positive", file, ctx->maxLineLen_);
+    return 0;
+  }
+  if (!helper->getInt("weight", &ctx->weight_, 1)) return 0;
+  if (ctx->weight_ <= 0) {
+    snprintf(cnf->errbuf(), MAX_ERR_LEN, "%s weight %d must be positive", file, ctx->weight_);
+    return 0;
+  }
   if (!helper->getInt("timeidx", &ctx->timeidx_, -1)) return 0;
   if (!helper->getBool("withtime", &ctx->withtime_, true)) return 0;
   if (!helper->getBool("autonl", &ctx->autonl_, true)) return 0;
@@ -290,6 +362,80 @@ LuaCtx *LuaCtx::loadFile(CnfCtx *cnf, const char *file)
   return ctx.release();
 }
 
+LuaCtx *LuaCtx::copy(const std::string &file)
+{
+  LuaCtx *ctx = new LuaCtx(*this);
+  ctx->fileWithGlob_ = false;
+  ctx->template_     = this;
+  ctx->file_         = file;
+  ctx->function_     = 0;
+  ctx->next_         = 0;
+  ctx->fileReader_   = 0;
+  ctx->fqueue_.clear();
+  ctx->cqueue_.clear();
+  ctx->fcurrent_.clear();
+  ctx->queueSize_ = ctx->queueBytes_ = 0;
+  ctx->congested_ = 0;
+  return ctx;
+}
+
+/* fileAlias of an instance is the template's with the file name,
+ * its fileoff, history and current files are its own
+ */
+LuaCtx *LuaCtx::instance(const std::string &file, bool created)
+{
+  std::auto_ptr<LuaCtx> ctx(copy(file));
+
+  std::string name = file[0] == '/' ? file.substr(1) : file;
+  std::replace(name.begin(), name.end(), '/', '_');
+  if (name.size() > 200) {
+    char crc[9];
+    snprintf(crc, 9, "%08x", crc32c(0, file.c_str(), file.size()));
+    name.assign(crc, 8);
+  }
+  ctx->fileAlias_ = fileAlias_ + "." + name;
+
+  // a file created while running is new, read it all
+  if (created) ctx->startPosition_ = "LOG_START";
+
+  ctx->function_ = function_->clone(ctx.get());
+  if (!ctx->loadHistoryFile()) return 0;
+  return ctx.release();
+}
+
+/* host.name is the same after a restart, even if the file is compressed by then,
+ * so a file half sent goes on in its stream. lua of the topic is loaded again,
+ * the live file calls it on another thread
+ */
+LuaCtx *LuaCtx::catchupInstance(const std::string &file, int chunk)
+{
+  std::string name = file.substr(file.rfind('/') + 1);
+  std::string path = file;
+  for (int i = 0; compressExts[i]; ++i) {
+    if (sys::endsWith(name.c_str(), compressExts[i])) {
+      name.resize(name.size() - strlen(compressExts[i]));
+    } else if (access(file.c_str(), F_OK) != 0 && access((file + compressExts[i]).c_str(), F_OK) == 0) {
+      path = file + compressExts[i];
+    }
+  }
+
+  std::auto_ptr<LuaCtx> ctx(copy(path));
+  ctx->catchup_        = true;
+  ctx->host_           = cnf_->host() + "." + name;
+  ctx->startPosition_  = "LOG_START";
+  if (chunk >= 0) {   // a backfill range, not resumed from fileoff
+    ctx->host_ += "." + util::toStr(chunk);
+    ctx->startPosition_ = "START";
+  }
+
+  std::auto_ptr<LuaHelper> helper(new LuaHelper);
+  if (!helper->dofile(helper_->file(), cnf_->errbuf())) return 0;
+  ctx->helper_ = helper.release();
+
+  ctx->function_ = function_->clone(ctx.get(), ctx->helper_);
+  return ctx.release();
+}
+
 bool LuaCtx::parseEsIndexDoc(const std::string &esIndex, const std::string &esDoc, char errbuf[])
 {
   if (esIndex.size() >= 56) {
@@ -371,6 +517,66 @@ bool LuaCtx::removeHistoryFile()
   return fqueue_.empty();
 }
 
+/* logrotate compress unlinks the history file after it is compressed, follow the compressed one */
+bool LuaCtx::followCompressedHistoryFile()
+{
+  if (fqueue_.empty()) return false;
+  for (int i = 0; compressExts[i]; ++i) {
+    std::string f = fqueue_.front() + compressExts[i];
+    if (access(f.c_str(), F_OK) == 0) {
+      fqueue_.front() = f;
+      writeHistoryFile(cnf_->libdir(), fileAlias_, fqueue_);
+      return true;
+    }
+  }
+  return false;
+}
+
+void LuaCtx::setHistoryInode(const std::string &file, ino_t inode)
+{
+  if (file == hinodeFile_ && inode == hinode_) return;
+  hinodeFile_ = file;
+  hinode_     = inode;
+
+  std::string path = cnf_->libdir() + "/" + fileAlias_ + ".inode";
+  std::vector<std::string> lines;
+  lines.push_back(file);
+  lines.push_back(util::toStr(inode));
+  writeFile("inode", path.c_str(), lines);
+}
+
+ino_t LuaCtx::compressedInode() const
+{
+  if (hinodeFile_.empty()) return 0;
+  for (int i = 0; compressExts[i]; ++i) {
+    if (datafile() == hinodeFile_ + compressExts[i]) return hinode_;
+  }
+  return 0;
+}
+
+/* the front is being read, it goes on in the stream of host */
+bool LuaCtx::catchupHistoryFiles(std::vector<std::string> *files)
+{
+  if (fqueue_.size() < 2) return false;
+
+  files->assign(fqueue_.begin() + 1, fqueue_.end());
+  cqueue_.insert(cqueue_.end(), files->begin(), files->end());
+  writeCatchupFile(cnf_->libdir(), fileAlias_, cqueue_);
+
+  fqueue_.erase(fqueue_.begin() + 1, fqueue_.end());
+  writeHistoryFile(cnf_->libdir(), fileAlias_, fqueue_);
+  return true;
+}
+
+void LuaCtx::removeCatchupFile(const std::string &file)
+{
+  std::deque<std::string>::iterator pos = std::find(cqueue_.begin(), cqueue_.end(), file);
+  if (pos != cqueue_.end()) {
+    cqueue_.erase(pos);
+    writeCatchupFile(cnf_->libdir(), fileAlias_, cqueue_);
+  }
+}
+
 bool LuaCtx::setCurrentFile(const std::string &currentFile) const
 {
   std::string current = cnf_->libdir() + "/" + fileAlias_ + ".current";
@@ -378,6 +584,56 @@ bool LuaCtx::setCurrentFile(const std::string &currentFile) const
   return writeFile("current", current.c_str(), files);
 }
 
+void LuaCtx::queueSizeInc(int n, int bytes)
+{
+  cnf_->stats()->queueSizeInc(n, bytes);
+  util::atomic_inc(&queueSize_, n);
+  util::atomic_inc(&queueBytes_, bytes);
+}
+
+void LuaCtx::queueSizeDec(int n, int bytes)
+{
+  cnf_->stats()->queueSizeDec(n, bytes);
+  util::atomic_dec(&queueSize_, n);
+  util::atomic_dec(&queueBytes_, bytes);
+
+  if (util::atomic_get(&congested_) && uncongest()) cnf_->wakeupTail();
+  cnf_->flowControlCheck();
+}
+
+bool LuaCtx::uncongest()
+{
+  int64_t size = util::atomic_get(&queueSize_);
+  int64_t bytes = util::atomic_get(&queueBytes_);
+  if (size > MAX_TOPIC_QUEUE_SIZE / 2 || bytes > MAX_TOPIC_QUEUE_BYTES / 2) return false;
+  if (!util::atomic_cas(&congested_, 1, 0)) return false;
+  cnf_->congestedInc(-1);
+
+  log_info(0, "%s congestion off, queueSize %ld, queueBytes %ld", topic_.c_str(), (long) size, (long) bytes);
+  return true;
+}
+
+bool LuaCtx::congested()
+{
+  if (util::atomic_get(&congested_)) return true;
+  if (util::atomic_get(&queueSize_) <= MAX_TOPIC_QUEUE_SIZE &&
+      util::atomic_get(&queueBytes_) <= MAX_TOPIC_QUEUE_BYTES) return false;
+
+  congest();
+  // acks between the check and congest() did not see it on
+  return !uncongest();
+}
+
+/* the record that got queue full is counted in queueSize_, its ack turns it off */
+void LuaCtx::congest()
+{
+  if (util::atomic_cas(&congested_, 0, 1)) {
+    cnf_->congestedInc(1);
+    log_info(0, "%s congestion on, queueSize %ld, queueBytes %ld", topic_.c_str(),
+             (long) util::atomic_get(&queueSize_), (long) util::atomic_get(&queueBytes_));
+  }
+}
+
 bool LuaCtx::initFileReader(FileReader *reader, char *errbuf)
 {
   std::auto_ptr<FileReader> fileReader(new FileReader(this));
@@ -395,14 +651,23 @@ LuaCtx::LuaCtx()
   helper_     = 0;
   function_   = 0;
   fileReader_ = 0;
+  fileWithGlob_ = false;
+  template_     = 0;
+  catchup_      = false;
+  hinode_       = 0;
 
   partition_ = -1;
   timeidx_  = -1;
+  ffi_      = false;
+  weight_   = 1;
   next_ = 0;
+
+  queueSize_ = queueBytes_ = 0;
+  congested_ = 0;
 }
 
 LuaCtx::~LuaCtx() {
-  if (helper_) delete helper_;
+  if (helper_ && (!template_ || helper_ != template_->helper_)) delete helper_;  // glob instances share the template's
   if (function_) delete function_;
   if (fileReader_) delete fileReader_;
 }
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 
 #include "sys.h"
+#include "checksum.h"
 #include "luafunction.h"
 #include "cnfctx.h"
 
@@ -26,6 +27,20 @@ public:
   static LuaCtx *loadFile(CnfCtx *cnf, const char *file);
   ~LuaCtx();
 
+  /* file of fileWithGlob is a glob(3) pattern, every file it matches gets
+   * an instance, a copy of the ctx that shares its lua state and kafka topic
+   */
+  bool fileWithGlob() const { return fileWithGlob_; }
+  LuaCtx *globTemplate() const { return template_; }
+  LuaCtx *instance(const std::string &file, bool created);
+
+  /* a history file read on a catch-up thread beside the live file, it is sent
+   * from START to END as host.name, so its lines never mix with the live ones.
+   * chunk >= 0 is a piece of a backfill, sent as host.name.chunk
+   */
+  LuaCtx *catchupInstance(const std::string &file, int chunk = -1);
+  bool catchup() const { return catchup_; }
+
   bool parseEsIndexDoc(const std::string &esIndex, const std::string &esDoc, char errbuf[]);
   void es(std::string *esIndex, bool *esIndexWithTimeFormat, int *esIndexPos,
           int *esDocPos, int *esDocDataFormat) const {
@@ -44,13 +59,25 @@ public:
   FileReader *getFileReader() { return fileReader_; }
 
   void setRktId(int id) { rktId_ = id; }
-  int rktId() { return rktId_; }
+  int rktId() { return template_ ? template_->rktId() : rktId_; }
 
   void setNext(LuaCtx* nxt) { next_ = nxt; }
   LuaCtx *next() { return next_; }
 
   CnfCtx *cnf() { return cnf_; }
 
+  /* records and bytes of the topic sent to kafka/es but not yet acked */
+  void queueSizeInc(int n, int bytes);
+  void queueSizeDec(int n, int bytes);
+
+  /* a congested topic holds back its file, other files go on,
+   * on above MAX_TOPIC_QUEUE_* or kafka queue full, off when half is acked
+   */
+  bool congested();
+  void congest();
+  bool uncongest();
+  int64_t queueBytes() const { return util::atomic_get((int64_t *) &queueBytes_); }
+
   bool copyRawRequired() const {
 #ifdef DISABLE_COPYRAW
     return false;
@@ -80,11 +107,15 @@ public:
   bool withtime() const { return withtime_; }
   int timeidx() const { return timeidx_; }
   bool autonl() const { return autonl_; }
-  bool md5sum() const { return md5sum_; }
+  bool ffi() const { return ffi_; }
+  Checksum::Algorithm checksum() const { return checksum_; }
+  bool mmapTail() const { return mmap_; }
+  size_t maxLineLen() const { return maxLineLen_; }
+  int weight() const { return weight_; }
   const std::string &pkey() const { return pkey_; }
 
   const char *getStartPosition() const { return startPosition_.c_str(); }
-  const std::string &host() const { return cnf_->host(); }
+  const std::string &host() const { return host_.empty() ? cnf_->host() : host_; }
 
   int getRotateDelay() const { return rotateDelay_ <= 0 ? cnf_->getRotateDelay() : rotateDelay_; }
   bool fileWithTimeFormat() const { return fileWithTimeFormat_; }
@@ -112,6 +143,17 @@ public:
 
   bool addHistoryFile(const std::string &historyFile);
   bool removeHistoryFile();
+  bool followCompressedHistoryFile();
+  /* fileoff is keyed by inode, compress makes a new one. the inode of the plain
+   * history file being read is kept in libdir, the compressed file goes on from its off
+   */
+  void setHistoryInode(const std::string &file, ino_t inode);
+  ino_t compressedInode() const;
+
+  /* history files after the one being read move to the catchup list */
+  bool catchupHistoryFiles(std::vector<std::string> *files);
+  const std::deque<std::string> &catchupFiles() const { return cqueue_; }
+  void removeCatchupFile(const std::string &file);
   bool setCurrentFile(const std::string &file) const;
 
   const std::string &topic() const { return topic_; }
@@ -124,6 +166,7 @@ public:
 
 private:
   LuaCtx();
+  LuaCtx *copy(const std::string &file);
 
 private:
   /* default set to topic_, it must be unique
@@ -154,14 +197,25 @@ private:
 
   bool          fileWithTimeFormat_;
   std::string   timeFormatFile_;
+  bool          fileWithGlob_;
+  LuaCtx       *template_;
   std::deque<std::string> fqueue_;
   std::string             fcurrent_;
+  std::string             hinodeFile_;
+  ino_t                   hinode_;
+  std::deque<std::string> cqueue_;   // history files on the catch-up threads
+  bool          catchup_;
+  std::string   host_;               // cnf host if empty
 
   uint32_t      addr_;
   bool          autoparti_;
   int           partition_;
   bool          rawcopy_;
-  bool          md5sum_;
+  Checksum::Algorithm checksum_;
+  bool          mmap_;
+  bool          ffi_;
+  int           maxLineLen_;
+  int           weight_;
 
   LuaFunction  *function_;
   std::string   startPosition_;
@@ -172,6 +226,10 @@ private:
   LuaHelper    *helper_;
 
   size_t rktId_;
+
+  int64_t queueSize_;
+  int64_t queueBytes_;
+  int     congested_;
 };
 
 #endif
@@ -1,10 +1,14 @@
 #include <memory>
 
+#include "logger.h"
 #include "util.h"
 #include "luactx.h"
+#include "filereader.h"
 #include "luafunction.h"
 
 #define PADDING_LEN 13
+#define FFI_OUT_LEN (64 * 1024)   // a longer result comes back as a lua string
+#define BATCH_LINES 1024          // lines of a transform_batch call, bounds the lua table
 
 const char *LuaFunction::typeToString(Type type)
 {
@@ -12,6 +16,7 @@ const char *LuaFunction::typeToString(Type type)
   case FILTER: return "filter";
   case GREP: return "grep";
   case TRANSFORM: return "transform";
+  case TRANSFORM_BATCH: return "transform_batch";
   case AGGREGATE: return "aggregate";
   case INDEXDOC: return "indexdoc";
   case ESPLAIN: return "esplain";
@@ -20,18 +25,38 @@ const char *LuaFunction::typeToString(Type type)
   }
 }
 
+LuaHelper *LuaFunction::helper()
+{
+  return helper_ ? helper_ : ctx_->cnf()->getLuaHelper();
+}
+
+FileRecord *LuaFunction::createRecord(off_t off, const std::string *esIndex, const std::string &data)
+{
+  FileReader *reader = ctx_->getFileReader();
+  if (reader) return reader->arena()->create(0, off, esIndex, data);
+  else return FileRecord::create(0, off, esIndex, data);
+}
+
+FileRecord *LuaFunction::createRecord(off_t off, const struct iovec *iov, int iovcnt)
+{
+  FileReader *reader = ctx_->getFileReader();
+  if (reader) return reader->arena()->create(0, off, iov, iovcnt);
+  else return FileRecord::create(0, off, iov, iovcnt);
+}
+
 LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
 {
   std::auto_ptr<LuaFunction> function(new LuaFunction(ctx));
 
   if (!helper->getArray("filter", &function->filters_, false)) return 0;
+  if (!helper->getMatch("match", &function->match_)) return 0;
   if (!function->filters_.empty()) {
     function->init(helper, "filter", FILTER);
     return function.release();
   }
 
   std::string value;
-  Type types[] = {GREP, TRANSFORM, AGGREGATE, INDEXDOC};
+  Type types[] = {GREP, TRANSFORM, TRANSFORM_BATCH, AGGREGATE, INDEXDOC};
 
   for (size_t i = 0; i < sizeof(types)/sizeof(Type); ++i) {
     std::string fun = typeToString(types[i]);
@@ -44,7 +69,7 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
       fun = value;
       if (!ctx->cnf()->getLuaHelper()->getFunction(fun.c_str(), &value, "")) return 0;
       if (value == fun) {
-        function->init(ctx->cnf()->getLuaHelper(), value, types[i]);
+        function->init(0, value, types[i]);
       }
     }
   }
@@ -61,12 +86,32 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
     return 0;
   }
 
+  if (!function->match_.empty() && function->type_ != GREP && function->type_ != AGGREGATE &&
+      function->type_ != KAFKAPLAIN) {
+    snprintf(ctx->cnf()->errbuf(), MAX_ERR_LEN, "%s match works with filter, grep, aggregate or a plain topic",
+             helper->file());
+    return 0;
+  }
+
+  if (ctx->ffi()) {
+    if (function->type_ != GREP && function->type_ != TRANSFORM && function->type_ != INDEXDOC) {
+      snprintf(ctx->cnf()->errbuf(), MAX_ERR_LEN, "%s ffi works with grep, transform or indexdoc", helper->file());
+      return 0;
+    }
+    if (function->type_ == GREP && ctx->timeidx() >= 0) {
+      // the time field would be rewritten, spans only point into the line
+      snprintf(ctx->cnf()->errbuf(), MAX_ERR_LEN, "%s ffi grep can not have timeidx", helper->file());
+      return 0;
+    }
+    function->out_.resize(FFI_OUT_LEN);
+  }
+
   if (ctx->withhost()) {
     if (function->type_ == KAFKAPLAIN || function->type_ == FILTER ||
-        function->type_ == GREP || function->type_ == TRANSFORM) {
-      function->extraSize_ = 1 + ctx->cnf()->host().size() + 1 + PADDING_LEN + 1;  // *host@off
+        function->type_ == GREP || function->type_ == TRANSFORM || function->type_ == TRANSFORM_BATCH) {
+      function->extraSize_ = 1 + ctx->host().size() + 1 + PADDING_LEN + 1;  // *host@off
     } else {
-      function->extraSize_ = ctx->cnf()->host().size() + 1; // host
+      function->extraSize_ = ctx->host().size() + 1; // host
     }
   } else {
     function->extraSize_ = 0;
@@ -75,6 +120,18 @@ LuaFunction *LuaFunction::create(LuaCtx *ctx, LuaHelper *helper, Type defType)
   return function.release();
 }
 
+LuaFunction *LuaFunction::clone(LuaCtx *ctx, LuaHelper *helper) const
+{
+  LuaFunction *function = new LuaFunction(ctx);
+  function->init(helper_ && helper ? helper : helper_, funName_, type_);
+  function->out_.resize(out_.size());
+  // a catch-up ctx has a longer host
+  function->extraSize_ = extraSize_ ? extraSize_ + ctx->host().size() - ctx_->host().size() : 0;
+  function->filters_   = filters_;
+  function->match_     = match_;
+  return function;
+}
+
 inline std::string *addHost(std::string *ptr, const std::string &host, off_t off, bool space) {
   ptr->append(1, '*').append(host);
   if (off != (off_t) -1) ptr->append(1, '@').append(util::toStr(off, PADDING_LEN));
@@ -82,84 +139,177 @@ inline std::string *addHost(std::string *ptr, const std::string &host, off_t off
   return ptr;
 }
 
-int LuaFunction::filter(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records)
+int LuaFunction::filter(off_t off, const char *line, const std::vector<uint32_t> &spans,
+                        std::vector<FileRecord *> *records)
 {
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, false);
+  size_t nfield = spans.size() / 2;
+  if (nfield == 0) return 0;
+
+  int timeidx = -1;
+  if (ctx_->timeidx() >= 0) {
+    timeidx = absidx(ctx_->timeidx(), nfield);
+    if (timeidx < 0 || (size_t) timeidx >= nfield) return 0;
+  }
+
+  std::string *result = &data_;
+  result->clear();
+  if (ctx_->withhost()) result = addHost(result, ctx_->host(), off, false);
 
   for (std::vector<int>::iterator ite = filters_.begin(), end = filters_.end();
        ite != end; ++ite) {
-    int idx = absidx(*ite, fields.size());
-    if (idx < 0 || (size_t) idx >= fields.size()) continue;
+    int idx = absidx(*ite, nfield);
+    if (idx < 0 || (size_t) idx >= nfield) continue;
 
     if (!result->empty()) result->append(1, ' ');
-    result->append(fields[idx]);
+    if (idx == timeidx) {
+      std::string iso;
+      timeLocalToIso8601(line + spans[idx * 2], spans[idx * 2 + 1], &iso);
+      result->append(iso);
+    } else {
+      result->append(line + spans[idx * 2], spans[idx * 2 + 1]);
+    }
   }
 
-  records->push_back(FileRecord::create(0, off, result));
+  records->push_back(createRecord(off, 0, *result));
   return 1;
 }
 
 int LuaFunction::grep(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records)
 {
-  if (!helper_->call(funName_.c_str(), fields, 1)) return -1;
-  if (helper_->callResultNil()) return 0;
+  if (!helper()->call(funName_.c_str(), fields, 1)) return -1;
+  if (helper()->callResultNil()) return 0;
 
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, true);
+  std::string *result = &data_;
+  result->clear();
+  if (ctx_->withhost()) result = addHost(result, ctx_->host(), off, true);
 
-  if (helper_->callResultListAsString(funName_.c_str(), result)) {
-    records->push_back(FileRecord::create(0, off, result));
+  if (helper()->callResultListAsString(funName_.c_str(), result)) {
+    records->push_back(createRecord(off, 0, *result));
     return 1;
   } else {
-    delete result;
     return -1;
   }
 }
 
 int LuaFunction::transform(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
 {
-  if (!helper_->call(funName_.c_str(), line, nline)) return -1;
-  if (helper_->callResultNil()) return 0;
+  if (!helper()->call(funName_.c_str(), line, nline)) return -1;
+  if (helper()->callResultNil()) return 0;
 
-  std::string *result = new std::string;
-  if (ctx_->withhost()) result = addHost(result, ctx_->cnf()->host(), off, true);
+  std::string *result = &data_;
+  result->clear();
+  if (ctx_->withhost()) result = addHost(result, ctx_->host(), off, true);
 
-  if (helper_->callResultString(funName_.c_str(), result, true)) {
-    records->push_back(FileRecord::create(0, off, result));
+  if (helper()->callResultString(funName_.c_str(), result, true)) {
+    records->push_back(createRecord(off, 0, *result));
     return 1;
   } else {
-    delete result;
     return -1;
   }
 }
 
+/* the line is copied once, from the buffer straight into the record */
 int LuaFunction::kafkaPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
 {
-  std::string *ptr = new std::string;
+  std::string *ptr = &data_;
+  ptr->clear();
+  if (ctx_->withhost()) addHost(ptr, ctx_->host(), off, true);
 
-  if (ctx_->withhost()) addHost(ptr, ctx_->cnf()->host(), off, true);
-  ptr->append(line, nline);
-  if (ctx_->autonl()) ptr->append(1, '\n');
+  struct iovec iov[3] = {{(void *) ptr->data(), ptr->size()}, {(void *) line, nline}, {(void *) "\n", 1}};
+  records->push_back(createRecord(off, iov, ctx_->autonl() ? 3 : 2));
+  return 1;
+}
+
+int LuaFunction::fragment(off_t off, const char *buffer, size_t size, int index, bool last,
+                          std::vector<FileRecord *> *records)
+{
+  // only the mirror puts the pieces together
+  if (type_ != KAFKAPLAIN || !ctx_->withhost()) return 0;
 
-  records->push_back(FileRecord::create(0, off, ptr));
+  std::string *ptr = &data_;
+  ptr->clear();
+
+  addHost(ptr, ctx_->host(), off, false);
+  ptr->append(1, ':').append(util::toStr(index)).append(1, '/').append(util::toStr(last ? index + 1 : 0));
+  ptr->append(1, ' ');
+
+  struct iovec iov[3] = {{(void *) ptr->data(), ptr->size()}, {(void *) buffer, size}, {(void *) "\n", 1}};
+  records->push_back(createRecord(off, iov, last && ctx_->autonl() ? 3 : 2));
   return 1;
 }
 
+/* grep and transform records are the same as without ffi, only the calling convention differs */
+int LuaFunction::ffiCall(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
+{
+  if (match_.empty()) {   // else process has split the line
+    spans_.clear();
+    if (type_ == GREP) splitSpans(line, nline, &spans_);
+  }
+  const uint32_t *spans = spans_.empty() ? 0 : &spans_[0];
+
+  int nret = type_ == INDEXDOC ? 2 : 1;
+  if (!helper()->callFfi(funName_.c_str(), line, nline, spans, spans_.size() / 2, &out_[0], out_.size(), nret)) {
+    return -1;
+  }
+  if (helper()->callResultNil()) return 0;
+
+  if (type_ == INDEXDOC) {
+    if (!helper()->callResultOut(funName_.c_str(), &out_[0], out_.size(), &index_, &data_)) return -1;
+    records->push_back(createRecord(off, &index_, data_));
+  } else {
+    std::string *result = &data_;
+    result->clear();
+    if (ctx_->withhost()) result = addHost(result, ctx_->host(), off, true);
+
+    if (!helper()->callResultOut(funName_.c_str(), &out_[0], out_.size(), result, true)) return -1;
+    records->push_back(createRecord(off, 0, *result));
+  }
+  return 1;
+}
+
+int LuaFunction::processBatch(const std::vector<LineRef> &lines, std::vector<FileRecord *> *records)
+{
+  int n = 0;
+  bool error = false;
+  for (size_t start = 0; start < lines.size(); start += BATCH_LINES) {
+    size_t size = std::min(lines.size() - start, (size_t) BATCH_LINES);
+    if (!helper()->call(funName_.c_str(), &lines[start], size) ||
+        !helper()->callResultArray(funName_.c_str(), size, &batch_, &batchLens_)) {
+      log_error(0, "%s, %d lines lost", helper()->errbuf(), (int) size);
+      error = true;
+      continue;
+    }
+
+    const char *ptr = batch_.data();
+    for (size_t i = 0; i < size; ++i) {
+      if (batchLens_[i] < 0) continue;
+
+      const LineRef &line = lines[start + i];
+      std::string *result = &data_;
+      result->clear();
+      if (ctx_->withhost()) result = addHost(result, ctx_->host(), line.off, true);
+      result->append(ptr, batchLens_[i]);
+      ptr += batchLens_[i];
+
+      records->push_back(createRecord(line.off, 0, *result));
+      ++n;
+    }
+  }
+  return n == 0 && error ? -1 : n;
+}
+
 int LuaFunction::indexdoc(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
 {
-  if (!helper_->call(funName_.c_str(), line, nline, 2)) return -1;
-  if (helper_->callResultNil()) return 0;
+  if (!helper()->call(funName_.c_str(), line, nline, 2)) return -1;
+  if (helper()->callResultNil()) return 0;
 
-  std::string *index = new std::string;
-  std::string *doc = new std::string;
+  std::string *index = &index_;
+  std::string *doc = &data_;
 
-  if (helper_->callResultString(funName_.c_str(), index, doc)) {
-    records->push_back(FileRecord::create(0, off, index, doc));
+  if (helper()->callResultString(funName_.c_str(), index, doc)) {
+    records->push_back(createRecord(off, index, *doc));
     return 1;
   } else {
-    delete index;
-    delete doc;
     return -1;
   }
 }
@@ -167,10 +317,10 @@ int LuaFunction::indexdoc(off_t off, const char *line, size_t nline, std::vector
 #define hex2int(hex) ((hex) >= 'A' ? 10 + (hex) - 'A' : (hex) - '0')
 
 // {\x22receiver\x22:\x22bb_up\x22} -> {"receiver":"bb_up"}
-void LuaFunction::transformEsDocNginxLog(const std::string &src, std::string *dst)
+void LuaFunction::transformEsDocNginxLog(const char *src, size_t n, std::string *dst)
 {
-  for (size_t i = 0; i < src.size(); ++i) {
-    if (src[i] == '\\' && i+3 < src.size() && src[i+1] == 'x') {
+  for (size_t i = 0; i < n; ++i) {
+    if (src[i] == '\\' && i+3 < n && src[i+1] == 'x') {
       dst->append(1, hex2int(src[i+2]) * 16 + hex2int(src[i+3]));
       i += 3;
     } else {
@@ -180,15 +330,15 @@ void LuaFunction::transformEsDocNginxLog(const std::string &src, std::string *ds
 }
 
 // "{\"receiver\":\"bb_up\"}\n" -> {"receiver":"bb_up"}
-void LuaFunction::transformEsDocNginxJson(const std::string &src, std::string *dst)
+void LuaFunction::transformEsDocNginxJson(const char *src, size_t n, std::string *dst)
 {
   size_t slen = 1;
-  if (src.size() > 3 && src[src.size()-3] == '\\' && src[src.size()-2] == 'n') {
+  if (n > 3 && src[n-3] == '\\' && src[n-2] == 'n') {
     slen = 3;
   }
 
-  for (size_t i = 1; i+slen < src.size(); ++i) {
-    if (src[i] == '\\' && i+1 < src.size() && src[i+1] == '"') {
+  for (size_t i = 1; i+slen < n; ++i) {
+    if (src[i] == '\\' && i+1 < n && src[i+1] == '"') {
       dst->append(1, '"');
       i += 1;
     } else {
@@ -213,39 +363,39 @@ int LuaFunction::esPlain(off_t off, const char *line, size_t nline, std::vector<
     esIndex.assign(buf, n);
   }
 
-  std::string *doc = 0, *index = 0;
+  std::string *doc = &data_, *index = &index_;
   if (esDocPos == 1) {
-    index = new std::string(esIndex);
-    doc = new std::string(line, nline);
+    index->assign(esIndex);
+    doc->assign(line, nline);
   } else {
-    std::vector<std::string> v;
-    splitn(line, nline, &v, esDocPos);
-    if ((int) v.size() != esDocPos) {
+    spans_.clear();
+    splitnSpans(line, nline, &spans_, esDocPos);
+    if ((int) spans_.size() != esDocPos * 2) {
       return -1;
     }
 
     if (esIndexPos > 0) {
-      index = new std::string(v[esIndexPos-1] + esIndex);
+      index->assign(line + spans_[(esIndexPos-1) * 2], spans_[(esIndexPos-1) * 2 + 1]).append(esIndex);
     } else {
-      index = new std::string(esIndex);
+      index->assign(esIndex);
     }
+    const char *src = line + spans_[(esDocPos-1) * 2];
+    size_t nsrc = spans_[(esDocPos-1) * 2 + 1];
     if (esDocDataFormat == ESDOC_DATAFORMAT_NGINX_LOG) {
-      doc = new std::string;
-      transformEsDocNginxLog(v[esDocPos-1], doc);
+      doc->clear();
+      transformEsDocNginxLog(src, nsrc, doc);
 			if (doc->compare("-") == 0) doc->clear();
     } else if (esDocDataFormat == ESDOC_DATAFORMAT_NGINX_JSON) {
-      doc = new std::string;
-      transformEsDocNginxJson(v[esDocPos-1], doc);
+      doc->clear();
+      transformEsDocNginxJson(src, nsrc, doc);
 			if (doc->compare("-") == 0) doc->clear();
     } else {
-      doc = new std::string(v[esDocPos-1]);
+      doc->assign(src, nsrc);
     }
   }
 
-	if (doc->empty()) {
-		delete doc;
-	} else {
-		records->push_back(FileRecord::create(0, off, index, doc));
+	if (!doc->empty()) {
+		records->push_back(createRecord(off, index, *doc));
 	}
   return 0;
 }
@@ -257,7 +407,8 @@ int LuaFunction::serializeCache(std::vector<FileRecord *> *records)
   int n = 0;
   for (std::map<std::string, std::map<std::string, int> >::iterator ite = aggregateCache_.begin();
        ite != aggregateCache_.end(); ++ite) {
-    std::string *s = new std::string;
+    std::string *s = &data_;
+    s->clear();
     if (ctx_->withhost()) s->append(ctx_->host()).append(1, ' ');
     if (ctx_->withtime()) s->append(lasttime_).append(1, ' ');
 
@@ -265,7 +416,7 @@ int LuaFunction::serializeCache(std::vector<FileRecord *> *records)
     for (std::map<std::string, int>::iterator jte = ite->second.begin(); jte != ite->second.end(); ++jte) {
       s->append(1, ' ').append(jte->first).append(1, '=').append(util::toStr(jte->second));
     }
-    records->push_back(FileRecord::create(0, -1, s));
+    records->push_back(createRecord(-1, 0, *s));
     ++n;
   }
   aggregateCache_.clear();
@@ -281,12 +432,12 @@ int LuaFunction::aggregate(const std::vector<std::string> &fields, std::vector<F
   }
   lasttime_ = curtime;
 
-  if (!helper_->call(funName_.c_str(), fields, 2)) return false;
-  if (helper_->callResultNil()) return true;
+  if (!helper()->call(funName_.c_str(), fields, 2)) return false;
+  if (helper()->callResultNil()) return true;
 
   std::string pkey;
   std::map<std::string, int> map;
-  if (!helper_->callResult(funName_.c_str(), &pkey, &map)) return false;
+  if (!helper()->callResult(funName_.c_str(), &pkey, &map)) return false;
 
   for (std::map<std::string, int>::iterator ite = map.begin(), end = map.end(); ite != end; ++ite) {
     aggregateCache_[pkey][ite->first] += ite->second;
@@ -298,11 +449,22 @@ int LuaFunction::aggregate(const std::vector<std::string> &fields, std::vector<F
 
 int LuaFunction::process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records)
 {
-  if (type_ == TRANSFORM) {
+  if (!match_.empty() || type_ == FILTER) {
+    spans_.clear();
+    splitSpans(line, nline, &spans_);
+    if (!match_.match(line, spans_)) return 0;
+    if (type_ == FILTER) return filter(off, line, spans_, records);
+  }
+
+  if (!out_.empty()) {
+    return ffiCall(off, line, nline, records);
+  } else if (type_ == TRANSFORM) {
     return transform(off, line, nline, records);
+  } else if (type_ == TRANSFORM_BATCH) {
+    return processBatch(std::vector<LineRef>(1, LineRef(off, line, nline)), records);
   } else if (type_ == INDEXDOC) {
     return indexdoc(off, line, nline, records);
-  } else if (type_ == AGGREGATE || type_ == GREP || type_ == FILTER) {
+  } else if (type_ == AGGREGATE || type_ == GREP) {
     std::vector<std::string> fields;
     split(line, nline, &fields);
 
@@ -314,12 +476,8 @@ int LuaFunction::process(off_t off, const char *line, size_t nline, std::vector<
 
     if (type_ == AGGREGATE) {
       return aggregate(fields, records);
-    } else if (type_ == GREP) {
-      return grep(off, fields, records);
-    } else if (type_ == FILTER) {
-      return filter(off, fields, records);
     } else {
-      return 0;
+      return grep(off, fields, records);
     }
   } else if (type_ == KAFKAPLAIN) {
     return kafkaPlain(off, line, nline, records);
@@ -6,16 +6,31 @@
 #include <sys/types.h>
 
 #include "luahelper.h"
+#include "matchexpr.h"
 #include "luactx.h"
 #include "filerecord.h"
 
 class LuaFunction {
   template<class T> friend class UNITTEST_HELPER;
 public:
-  enum Type { FILTER, GREP, TRANSFORM, AGGREGATE, INDEXDOC, KAFKAPLAIN, ESPLAIN, NIL };
+  enum Type { FILTER, GREP, TRANSFORM, TRANSFORM_BATCH, AGGREGATE, INDEXDOC, KAFKAPLAIN, ESPLAIN, NIL };
 
   static LuaFunction *create(LuaCtx *ctx, LuaHelper *helper, Type defType);
+  /* the same function for another ctx, caches are not shared,
+   * lua state of the topic is, unless helper has the topic loaded again
+   */
+  LuaFunction *clone(LuaCtx *ctx, LuaHelper *helper = 0) const;
   int process(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
+  /* transform_batch, lines go to lua many at a time, each record keeps the off of its line.
+   * returns the records made, -1 if lua failed
+   */
+  int processBatch(const std::vector<LineRef> &lines, std::vector<FileRecord *> *records);
+  bool batched() const { return type_ == TRANSFORM_BATCH; }
+  /* a piece of a line longer than maxlinelen, *host@off:index/total data.
+   * total is 0 while more follow, index+1 on the last one. 0 if the topic can not take it
+   */
+  int fragment(off_t off, const char *buffer, size_t size, int index, bool last,
+               std::vector<FileRecord *> *records);
   int serializeCache(std::vector<FileRecord *> *records);
 
   Type getType() const { return type_; }
@@ -24,6 +39,14 @@ public:
 private:
   static const char *typeToString(Type type);
 
+  /* function in main.lua, helper_ is 0, lookup every call, tail may run in worker */
+  LuaHelper *helper();
+
+  /* record bytes are built in data_/index_, then copied to the reader's arena */
+  FileRecord *createRecord(off_t off, const std::string *esIndex, const std::string &data);
+  /* or gathered from the line itself, without the copy in data_ */
+  FileRecord *createRecord(off_t off, const struct iovec *iov, int iovcnt);
+
   LuaFunction(LuaCtx *ctx) : ctx_(ctx), helper_(0), type_(NIL) {}
   void init(LuaHelper *helper, const std::string &funName, Type type) {
     helper_  = helper;
@@ -31,17 +54,20 @@ private:
     type_    = type;
   }
 
-  int filter(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
+  /* fields of filters_ from the spans of the line, only the time field is copied */
+  int filter(off_t off, const char *line, const std::vector<uint32_t> &spans, std::vector<FileRecord *> *records);
   int grep(off_t off, const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
   int transform(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   int aggregate(const std::vector<std::string> &fields, std::vector<FileRecord *> *records);
   int kafkaPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
 
   int indexdoc(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
+  /* ffi = true, the line is not copied into lua, results come back in out_ */
+  int ffiCall(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
   int esPlain(off_t off, const char *line, size_t nline, std::vector<FileRecord *> *records);
 
-  static void transformEsDocNginxLog(const std::string &src, std::string *dst);
-  static void transformEsDocNginxJson(const std::string &src, std::string *dst);
+  static void transformEsDocNginxLog(const char *src, size_t n, std::string *dst);
+  static void transformEsDocNginxJson(const char *src, size_t n, std::string *dst);
 
 private:
   LuaCtx      *ctx_;
@@ -51,6 +77,16 @@ private:
   size_t      extraSize_;
 
   std::vector<int> filters_;
+  MatchExpr        match_;    // lines it rejects never reach lua
+
+  std::string data_;
+  std::string index_;
+
+  std::vector<uint32_t> spans_;
+  std::vector<char>     out_;   // empty unless ffi
+
+  std::string      batch_;      // results of a transform_batch call
+  std::vector<int> batchLens_;
 
   std::string                                        lasttime_;
   std::map<std::string, std::map<std::string, int> > aggregateCache_;
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 extern "C" {
 #include <lua.h>
@@ -11,6 +12,7 @@ extern "C" {
 }
 
 #include "common.h"
+#include "matchexpr.h"
 
 class LuaHelper {
 public:
@@ -21,6 +23,7 @@ public:
   }
 
   const char *file() const { return file_.c_str(); }
+  const char *errbuf() const { return errbuf_; }
 
   bool dofile(const char *f, char *errbuf) {
     lua_State *L = luaL_newstate();
@@ -287,6 +290,29 @@ public:
     return rc;
   }
 
+  /* match = {cond...} and-ed, or a single cond. cond is {idx, op, value}
+   * or {"and"|"or"|"not", cond...}, see matchexpr.h
+   */
+  bool getMatch(const char *name, MatchExpr *expr) {
+    bool rc = true;
+    lua_getglobal(L_, name);
+
+    if (lua_isnil(L_, 1)) {
+      // no match
+    } else if (lua_istable(L_, 1)) {
+      lua_rawgeti(L_, 1, 1);
+      bool list = lua_istable(L_, -1);
+      lua_pop(L_, 1);
+      rc = list ? matchLogic(name, 1, 1, MatchExpr::AND, expr) : matchCond(name, 1, expr);
+    } else {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s must be array", file_.c_str(), name);
+      rc = false;
+    }
+
+    lua_settop(L_, 0);
+    return rc;
+  }
+
   bool callResultNil() {
     if (lua_isnil(L_, 1)) {
       lua_settop(L_, 0);
@@ -349,6 +375,54 @@ public:
     return true;
   }
 
+  /* function(lines), one call for n lines, lines is an array of strings */
+  bool call(const char *name, const LineRef *lines, size_t n) {
+    lua_getglobal(L_, name);
+    lua_createtable(L_, n, 0);
+    for (size_t i = 0; i < n; ++i) {
+      lua_pushlstring(L_, lines[i].line, lines[i].nline);
+      lua_rawseti(L_, -2, i+1);
+    }
+
+    if (lua_pcall(L_, 1, 1, 0) != 0) {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s error %s", file_.c_str(), name, lua_tostring(L_, -1));
+      lua_settop(L_, 0);
+      return false;
+    }
+    return true;
+  }
+
+  /* return #1 is an array of n, element i goes to results, lens[i] is -1 if it is nil or false */
+  bool callResultArray(const char *name, size_t n, std::string *results, std::vector<int> *lens) {
+    if (!lua_istable(L_, 1)) {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #1 must be table", file_.c_str(), name);
+      lua_settop(L_, 0);
+      return false;
+    }
+
+    results->clear();
+    lens->clear();
+    for (size_t i = 0; i < n; ++i) {
+      lua_rawgeti(L_, 1, i+1);
+      if (lua_isnil(L_, -1) || lua_isboolean(L_, -1)) {
+        lens->push_back(-1);
+      } else if (lua_isstring(L_, -1)) {
+        size_t len;
+        const char *ptr = lua_tolstring(L_, -1, &len);
+        results->append(ptr, len);
+        lens->push_back(len);
+      } else {
+        snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #1[%d] must be string(nil)", file_.c_str(), name, (int) i+1);
+        lua_settop(L_, 0);
+        return false;
+      }
+      lua_pop(L_, 1);
+    }
+
+    lua_settop(L_, 0);
+    return true;
+  }
+
   bool callResultString(const char *name, std::string *result, bool append = false) {
     if (!lua_isstring(L_, 1)) {
       snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #1 must be string(nil)", file_.c_str(), name);
@@ -377,6 +451,44 @@ public:
     return true;
   }
 
+  /* luajit ffi, function(line, nline, spans, nspans, out, nout), line spans and out are
+   * lightuserdata for ffi.cast, spans are start,len pairs of the fields, nil if not split.
+   * no lua string is made unless the function asks for one
+   */
+  bool callFfi(const char *name, const char *line, size_t nline, const uint32_t *spans, size_t nspans,
+               char *out, size_t nout, int nret = 1) {
+    lua_getglobal(L_, name);
+    lua_pushlightuserdata(L_, (void *) line);
+    lua_pushinteger(L_, nline);
+    if (spans) lua_pushlightuserdata(L_, (void *) spans);
+    else lua_pushnil(L_);
+    lua_pushinteger(L_, nspans);
+    lua_pushlightuserdata(L_, out);
+    lua_pushinteger(L_, nout);
+
+    if (lua_pcall(L_, 6, nret, 0) != 0) {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s error %s", file_.c_str(), name, lua_tostring(L_, -1));
+      lua_settop(L_, 0);
+      return false;
+    }
+    return true;
+  }
+
+  /* return #i is the bytes written to out after the previous return, or a string */
+  bool callResultOut(const char *name, const char *out, size_t nout, std::string *result, bool append = false) {
+    size_t pos = 0;
+    bool rc = resultOut(name, 1, out, nout, &pos, result, append);
+    lua_settop(L_, 0);
+    return rc;
+  }
+
+  bool callResultOut(const char *name, const char *out, size_t nout, std::string *r1, std::string *r2) {
+    size_t pos = 0;
+    bool rc = resultOut(name, 1, out, nout, &pos, r1, false) && resultOut(name, 2, out, nout, &pos, r2, false);
+    lua_settop(L_, 0);
+    return rc;
+  }
+
   bool callResult(const char *name, std::string *s, std::map<std::string, int> *map) {
     if (!lua_isstring(L_, 1)) {
       snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #1 must be string", file_.c_str(), name);
@@ -412,6 +524,59 @@ public:
   }
 
 private:
+  // conditions of the table at index from first on are children of op
+  bool matchLogic(const char *name, int index, int first, MatchExpr::Op op, MatchExpr *expr) {
+    int size = lua_objlen(L_, index);
+    if (size < first || (op == MatchExpr::NOT && size != first)) {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s %s needs %s", file_.c_str(), name,
+               op == MatchExpr::NOT ? "not" : "and/or", op == MatchExpr::NOT ? "one condition" : "conditions");
+      return false;
+    }
+
+    size_t node = expr->open(op);
+    for (int i = first; i <= size; ++i) {
+      lua_rawgeti(L_, index, i);
+      bool rc = lua_istable(L_, -1);
+      if (!rc) snprintf(errbuf_, MAX_ERR_LEN, "%s %s condition must be array", file_.c_str(), name);
+      else rc = matchCond(name, lua_gettop(L_), expr);
+      lua_pop(L_, 1);
+      if (!rc) return false;
+    }
+    expr->close(node);
+    return true;
+  }
+
+  bool matchCond(const char *name, int index, MatchExpr *expr) {
+    lua_rawgeti(L_, index, 1);
+    lua_rawgeti(L_, index, 2);
+    lua_rawgeti(L_, index, 3);
+
+    bool rc = true;
+    MatchExpr::Op op = lua_type(L_, -2) == LUA_TSTRING ? MatchExpr::stringToOp(lua_tostring(L_, -2)) : MatchExpr::NIL;
+    if (lua_type(L_, -3) == LUA_TSTRING) {
+      op = MatchExpr::stringToOp(lua_tostring(L_, -3));
+      lua_pop(L_, 3);
+      if (op != MatchExpr::AND && op != MatchExpr::OR && op != MatchExpr::NOT) {
+        snprintf(errbuf_, MAX_ERR_LEN, "%s %s unknown logic op", file_.c_str(), name);
+        return false;
+      }
+      return matchLogic(name, index, 2, op, expr);
+    } else if (lua_type(L_, -3) != LUA_TNUMBER || op == MatchExpr::NIL ||
+               (lua_type(L_, -1) != LUA_TSTRING && lua_type(L_, -1) != LUA_TNUMBER)) {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s condition must be {idx, op, value}", file_.c_str(), name);
+      rc = false;
+    } else {
+      char errbuf[MAX_ERR_LEN];
+      bool number = lua_type(L_, -1) == LUA_TNUMBER;   // luaString turns it into a string
+      if (!expr->cond((int) lua_tointeger(L_, -3), op, luaString(L_, -1), number, errbuf)) {
+        snprintf(errbuf_, MAX_ERR_LEN, "%s %s %s", file_.c_str(), name, errbuf);
+        rc = false;
+      }
+    }
+    lua_pop(L_, 3);
+    return rc;
+  }
+
    void initInputTableBeforeCall(const std::vector<std::string> &fields) {
     lua_newtable(L_);
     int table = lua_gettop(L_);
@@ -423,6 +588,27 @@ private:
     }
   }
 
+  bool resultOut(const char *name, int i, const char *out, size_t nout, size_t *pos,
+                 std::string *result, bool append) {
+    if (lua_type(L_, i) == LUA_TNUMBER) {
+      lua_Integer n = lua_tointeger(L_, i);
+      if (n < 0 || (size_t) n > nout - *pos) {
+        snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #%d %ld is out of %ld", file_.c_str(), name, i,
+                 (long) n, (long) (nout - *pos));
+        return false;
+      }
+      if (append) result->append(out + *pos, n);
+      else result->assign(out + *pos, n);
+      *pos += n;
+    } else if (lua_type(L_, i) == LUA_TSTRING) {
+      luaString(L_, i, result, append);
+    } else {
+      snprintf(errbuf_, MAX_ERR_LEN, "%s %s return #%d must be number or string", file_.c_str(), name, i);
+      return false;
+    }
+    return true;
+  }
+
 private:
   lua_State   *L_;
   std::string  file_;
@@ -0,0 +1,185 @@
+#include <cstdio>
+#include <cstring>
+
+#include "common.h"
+#include "matchexpr.h"
+
+MatchExpr::Op MatchExpr::stringToOp(const char *s)
+{
+  if (strcmp(s, "and") == 0) return AND;
+  else if (strcmp(s, "or") == 0) return OR;
+  else if (strcmp(s, "not") == 0) return NOT;
+  else if (strcmp(s, "==") == 0) return EQ;
+  else if (strcmp(s, "~=") == 0 || strcmp(s, "!=") == 0) return NE;
+  else if (strcmp(s, "<") == 0) return LT;
+  else if (strcmp(s, "<=") == 0) return LE;
+  else if (strcmp(s, ">") == 0) return GT;
+  else if (strcmp(s, ">=") == 0) return GE;
+  else if (strcmp(s, "prefix") == 0) return PREFIX;
+  else if (strcmp(s, "contains") == 0) return CONTAINS;
+  else if (strcmp(s, "regex") == 0) return REGEX;
+  else return NIL;
+}
+
+MatchExpr &MatchExpr::operator=(const MatchExpr &other)
+{
+  if (this != &other) {
+    clear();
+    copy(other);
+  }
+  return *this;
+}
+
+// regex_t can not be copied, every copy compiles its own
+void MatchExpr::copy(const MatchExpr &other)
+{
+  nodes_ = other.nodes_;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i].re) {
+      char errbuf[MAX_ERR_LEN];
+      bool ok = compile(&nodes_[i], errbuf);
+      assert(ok);
+      (void) ok;
+    }
+  }
+}
+
+void MatchExpr::clear()
+{
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i].re) {
+      regfree(nodes_[i].re);
+      delete nodes_[i].re;
+    }
+  }
+  nodes_.clear();
+}
+
+size_t MatchExpr::open(Op op)
+{
+  Node node;
+  node.op     = op;
+  node.next   = 0;
+  node.idx    = 0;
+  node.number = false;
+  node.num    = 0;
+  node.re     = 0;
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+bool MatchExpr::compile(Node *node, char *errbuf)
+{
+  node->re = new regex_t;
+  int rc = regcomp(node->re, node->str.c_str(), REG_EXTENDED | REG_NOSUB);
+  if (rc != 0) {
+    char buf[256];
+    regerror(rc, node->re, buf, sizeof(buf));
+    snprintf(errbuf, MAX_ERR_LEN, "regex %s error %s", node->str.c_str(), buf);
+    delete node->re;
+    node->re = 0;
+    return false;
+  }
+  return true;
+}
+
+bool MatchExpr::cond(int idx, Op op, const std::string &value, bool number, char *errbuf)
+{
+  if (idx == 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "field index 0, starts from 1");
+    return false;
+  }
+  if (op < EQ || op == NIL) {
+    snprintf(errbuf, MAX_ERR_LEN, "field %d needs a compare op", idx);
+    return false;
+  }
+  if (number && op > GE) {
+    snprintf(errbuf, MAX_ERR_LEN, "field %d prefix, contains and regex take a string", idx);
+    return false;
+  }
+
+  Node *node = &nodes_[open(op)];
+  node->idx    = idx;
+  node->number = number;
+  node->str    = value;
+  if (number) node->num = strtod(value.c_str(), 0);
+  close(nodes_.size() - 1);
+
+  if (op == REGEX && !compile(node, errbuf)) {
+    nodes_.pop_back();
+    return false;
+  }
+  return true;
+}
+
+// digits with a sign and a fraction, 200 0.005 -1; - of nginx is not a number
+static bool toNumber(const char *p, size_t n, double *v)
+{
+  size_t i = 0;
+  bool neg = false;
+  if (i < n && p[i] == '-') neg = true, ++i;
+
+  double r = 0;
+  size_t digits = 0;
+  for (; i < n && p[i] >= '0' && p[i] <= '9'; ++i, ++digits) r = r * 10 + (p[i] - '0');
+  if (i < n && p[i] == '.') {
+    double scale = 0.1;
+    for (++i; i < n && p[i] >= '0' && p[i] <= '9'; ++i, ++digits, scale /= 10) r += (p[i] - '0') * scale;
+  }
+  if (digits == 0 || i != n) return false;
+
+  *v = neg ? -r : r;
+  return true;
+}
+
+bool MatchExpr::eval(size_t i, const char *line, const std::vector<uint32_t> &spans) const
+{
+  const Node &node = nodes_[i];
+  if (node.op == AND || node.op == OR) {
+    for (size_t j = i + 1; j < node.next; j = nodes_[j].next) {
+      if (eval(j, line, spans) == (node.op == OR)) return node.op == OR;
+    }
+    return node.op == AND;
+  } else if (node.op == NOT) {
+    return !eval(i + 1, line, spans);
+  }
+
+  // a missing field matches nothing
+  size_t nfield = spans.size() / 2;
+  if (nfield == 0) return false;
+  int idx = absidx(node.idx, nfield);
+  if (idx < 0 || (size_t) idx >= nfield) return false;
+
+  const char *p = line + spans[idx * 2];
+  size_t n = spans[idx * 2 + 1];
+
+  int cmp;
+  if (node.number) {
+    double v;
+    if (!toNumber(p, n, &v)) return false;
+    cmp = v < node.num ? -1 : (v > node.num ? 1 : 0);
+  } else if (node.op == PREFIX) {
+    return n >= node.str.size() && memcmp(p, node.str.data(), node.str.size()) == 0;
+  } else if (node.op == CONTAINS) {
+    return memmem(p, n, node.str.data(), node.str.size()) != 0;
+  } else if (node.op == REGEX) {
+    // the field is not NUL terminated, REG_STARTEND bounds it, ^ anchors at the field
+    regmatch_t pmatch[1];
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = n;
+    return regexec(node.re, p, 1, pmatch, REG_STARTEND) == 0;
+  } else {
+    cmp = memcmp(p, node.str.data(), std::min(n, node.str.size()));
+    if (cmp == 0) cmp = n < node.str.size() ? -1 : (n > node.str.size() ? 1 : 0);
+  }
+
+  switch (node.op) {
+  case EQ: return cmp == 0;
+  case NE: return cmp != 0;
+  case LT: return cmp < 0;
+  case LE: return cmp <= 0;
+  case GT: return cmp > 0;
+  case GE: return cmp >= 0;
+  default: return false;
+  }
+}
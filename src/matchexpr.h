@@ -0,0 +1,53 @@
+#ifndef _MATCH_EXPR_H_
+#define _MATCH_EXPR_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <regex.h>
+
+/* match = {{9, ">=", 500}, {7, "contains", "/api/"}} of a topic, compiled once and
+ * evaluated on the field spans of splitSpans, no lua, nothing copied.
+ * conditions of an array are and-ed, {"or", cond...} {"and", cond...} {"not", cond} nest
+ */
+class MatchExpr {
+public:
+  enum Op { AND, OR, NOT, EQ, NE, LT, LE, GT, GE, PREFIX, CONTAINS, REGEX, NIL };
+  static Op stringToOp(const char *s);
+
+  MatchExpr() {}
+  MatchExpr(const MatchExpr &other) { copy(other); }
+  MatchExpr &operator=(const MatchExpr &other);
+  ~MatchExpr() { clear(); }
+
+  /* nodes are in prefix order, the nodes added between open and close are children of a logic node */
+  size_t open(Op op);
+  void close(size_t node) { nodes_[node].next = nodes_.size(); }
+  /* field idx, 1 based, negative from the end, op value. a number value compares numerically */
+  bool cond(int idx, Op op, const std::string &value, bool number, char *errbuf);
+
+  bool empty() const { return nodes_.empty(); }
+  bool match(const char *line, const std::vector<uint32_t> &spans) const {
+    return nodes_.empty() || eval(0, line, spans);
+  }
+
+private:
+  struct Node {
+    Op          op;
+    size_t      next;    // the node after the subtree
+    int         idx;
+    bool        number;
+    double      num;
+    std::string str;
+    regex_t    *re;
+  };
+
+  bool eval(size_t i, const char *line, const std::vector<uint32_t> &spans) const;
+  bool compile(Node *node, char *errbuf);
+  void copy(const MatchExpr &other);
+  void clear();
+
+  std::vector<Node> nodes_;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "sys.h"
+#include "gnuatomic.h"
+#include "mpscqueue.h"
+
+#define MAX_ERR_LEN 512
+
+using namespace util;
+
+MpscQueue::MpscQueue(size_t n) : efd_(-1), enqueuePos_(0), dequeuePos_(0), idle_(0)
+{
+  size_t size = 1;
+  while (size < n) size <<= 1;
+
+  mask_  = size - 1;
+  cells_ = new Cell[size];
+  for (size_t i = 0; i < size; ++i) {
+    cells_[i].seq = i;
+    cells_[i].ptr = 0;
+  }
+}
+
+MpscQueue::~MpscQueue()
+{
+  if (efd_ != -1) close(efd_);
+  delete[] cells_;
+}
+
+bool MpscQueue::init(char *errbuf)
+{
+  if (efd_ != -1) close(efd_);
+
+  efd_ = eventfd(0, EFD_CLOEXEC);
+  if (efd_ == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "eventfd error %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool MpscQueue::tryPush(void *ptr)
+{
+  Cell *cell;
+  size_t pos = atomic_load(&enqueuePos_);
+  while (true) {
+    cell = &cells_[pos & mask_];
+    intptr_t diff = (intptr_t) atomic_load(&cell->seq) - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_cas(&enqueuePos_, pos, pos + 1)) break;
+      pos = atomic_load(&enqueuePos_);
+    } else if (diff < 0) {
+      return false;  // full
+    } else {
+      pos = atomic_load(&enqueuePos_);
+    }
+  }
+
+  cell->ptr = ptr;
+  atomic_store(&cell->seq, pos + 1);
+
+  // cas is a full barrier, pairs with the one in pop
+  if (atomic_cas(&idle_, 1, 0)) wakeup();
+  return true;
+}
+
+void MpscQueue::push(void *ptr)
+{
+  while (!tryPush(ptr)) sys::millisleep(1);
+}
+
+bool MpscQueue::tryPop(void **ptr)
+{
+  Cell *cell = &cells_[dequeuePos_ & mask_];
+  if (atomic_load(&cell->seq) != dequeuePos_ + 1) return false;
+
+  *ptr = cell->ptr;
+  atomic_store(&cell->seq, dequeuePos_ + mask_ + 1);
+  ++dequeuePos_;
+  return true;
+}
+
+void *MpscQueue::pop()
+{
+  void *ptr;
+  while (!tryPop(&ptr)) {
+    atomic_cas(&idle_, 0, 1);
+
+    // producer may push before it sees idle_
+    if (tryPop(&ptr)) {
+      atomic_cas(&idle_, 1, 0);
+      break;
+    }
+
+    uint64_t n;
+    if (read(efd_, &n, sizeof(n)) == -1 && errno != EINTR) return 0;
+  }
+  return ptr;
+}
+
+void MpscQueue::wakeup()
+{
+  uint64_t n = 1;
+  while (write(efd_, &n, sizeof(n)) == -1 && errno == EINTR) {}
+}
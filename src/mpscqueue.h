@@ -0,0 +1,52 @@
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+#include <cstddef>
+
+namespace util {
+
+/* bounded lock-free ring of pointers, many producers and one consumer.
+ * the consumer sleeps on an eventfd, producers write it only when the consumer is idle
+ */
+class MpscQueue {
+public:
+  MpscQueue(size_t n);
+  ~MpscQueue();
+
+  /* (re)create eventfd, call before fork the consumer */
+  bool init(char *errbuf);
+
+  /* block when the queue is full */
+  void push(void *ptr);
+  bool tryPush(void *ptr);
+
+  /* block when the queue is empty, return 0 if eventfd error */
+  void *pop();
+  bool tryPop(void **ptr);
+
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  struct Cell {
+    size_t  seq;
+    void   *ptr;
+  };
+
+  void wakeup();
+
+  Cell   *cells_;
+  size_t  mask_;
+  int     efd_;
+
+  /* producers and consumer write different cache lines */
+  char    pad0_[64];
+  size_t  enqueuePos_;
+  char    pad1_[64];
+  size_t  dequeuePos_;
+  int     idle_;
+  char    pad2_[64];
+};
+
+}  // namespace util
+
+#endif
@@ -194,4 +194,49 @@ bool file2vector(const char *file, std::vector<std::string> *lines, size_t start
   return true;
 }
 
+static off_t nextLineStart(int fd, off_t off, off_t size)
+{
+  char buffer[8192];
+  if (off == 0) return 0;
+
+  --off;   // the NL before off
+  while (off < size) {
+    ssize_t n = pread(fd, buffer, sizeof(buffer), off);
+    if (n <= 0) break;
+
+    const char *nl = (const char *) memchr(buffer, '\n', n);
+    if (nl) return off + (nl - buffer) + 1;
+    off += n;
+  }
+  return size;
+}
+
+bool splitLines(const char *file, off_t start, off_t end, int n, std::vector<off_t> *bounds, char *errbuf)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) {
+    snprintf(errbuf, MAX_ERR_LEN, "open %s error %s", file, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  if (end == (off_t) -1 || end > st.st_size) end = st.st_size;
+  if (start < 0 || start > end || n <= 0) {
+    snprintf(errbuf, MAX_ERR_LEN, "%s invalid range %ld-%ld/%d", file, (long) start, (long) end, n);
+    close(fd);
+    return false;
+  }
+
+  bounds->clear();
+  for (int i = 0; i <= n; ++i) {
+    off_t off = nextLineStart(fd, i == n ? end : start + (end - start) * i / n, st.st_size);
+    if (bounds->empty() || off > bounds->back()) bounds->push_back(off);
+  }
+  if (bounds->size() == 1) bounds->clear();
+
+  close(fd);
+  return true;
+}
+
 } // sys
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <time.h>
+#include <sys/types.h>
 #include "runstatus.h"
 
 namespace sys {
@@ -58,6 +59,11 @@ bool isdir(const char *dir, char *errbuf);
 
 bool file2vector(const char *file, std::vector<std::string> *files, size_t start = 0, size_t end = -1);
 
+/* split the lines starting in [start, end) of file into at most n chunks, bounds move on to line starts,
+ * end -1 is the file size. bounds gets the chunk starts and the end, empty chunks are dropped
+ */
+bool splitLines(const char *file, off_t start, off_t end, int n, std::vector<off_t> *bounds, char *errbuf);
+
 bool initSingleton(const char *pidfile, char *errbuf);
 
 } // sys
@@ -54,7 +54,7 @@ DEFINE(transformEsDocNginxLog)
 {
   std::string log = fileGetContent(ETCDIR"/nginx_log.log");
   std::string *doc = new std::string;
-  LuaFunction::transformEsDocNginxLog(log, doc);
+  LuaFunction::transformEsDocNginxLog(log.data(), log.size(), doc);
   std::string expectDoc = "{\"y\":\"\\ufffd\\ufffd\"}";
   check(*doc == expectDoc, "got %s, expect %s", PTRS(*doc), PTRS(expectDoc));
   delete doc;
@@ -64,7 +64,7 @@ DEFINE(transformEsDocNginxJson)
 {
   std::string log = fileGetContent(ETCDIR"/nginx_json.log");
   std::string *doc = new std::string;
-  LuaFunction::transformEsDocNginxJson(log, doc);
+  LuaFunction::transformEsDocNginxJson(log.data(), log.size(), doc);
   std::string expectDoc = "{\"receiver\":\"bb_up\"}";
   check(*doc == expectDoc, "got %s, expect %s", PTRS(*doc), PTRS(expectDoc));
   delete doc;
@@ -168,8 +168,8 @@ DEFINE(basic)
   const char *json = "{\"x\": 1}";
   function->process(0, s1, strlen(s1), &datas);
   check(datas.size() == 1, "datas size %d", (int) datas.size());
-  check(*datas[0]->esIndex == index, "expect %s, got %s", index, PTRS(*datas[0]->esIndex));
-  check(*datas[0]->data == "{\"x\": 1}", "expect %s, got %s", json, PTRS(*datas[0]->data));
+  check(datas[0]->esIndex->str() == index, "expect %s, got %s", index, PTRS(*datas[0]->esIndex));
+  check(datas[0]->data->str() == "{\"x\": 1}", "expect %s, got %s", json, PTRS(*datas[0]->data));
 }
 
 DEFINE(indexdoc)
@@ -182,8 +182,8 @@ DEFINE(indexdoc)
   const char *s1 = "{\"x\": 1}";
   check(function->process(0, s1, strlen(s1), &datas) > 0, "indexdoc error %s", cnf->errbuf());
   check(datas.size() == 1, "data size %d", (int) datas.size());
-  check(*datas[0]->esIndex == "indexdoc", "expect indexdoc, got %s", PTRS(*datas[0]->esIndex));
-  check(*datas[0]->data == s1, "expect %s, got %s", s1, PTRS(*datas[0]->data));
+  check(datas[0]->esIndex->str() == "indexdoc", "expect indexdoc, got %s", PTRS(*datas[0]->esIndex));
+  check(datas[0]->data->str() == s1, "expect %s, got %s", s1, PTRS(*datas[0]->data));
 }
 
 DEFINE(initEs)
@@ -209,9 +209,8 @@ DEFINE(esProduce)
     x = random();
     snprintf(json, 64, "{\x22x\x22: %ld, \x22timestamp\x22: %ld}", x, cnf->fasttime(true, TIMEUNIT_MILLI));
 
-    std::string *index = new std::string("indexdoc");
-    std::string *data = new std::string(json);
-    FileRecord *record = FileRecord::create(0, 0, index, data);
+    std::string index = "indexdoc";
+    FileRecord *record = FileRecord::create(0, 0, &index, json);
     record->ctx = ctx;
     datas.assign(1, record);
 
@@ -164,19 +164,9 @@ void *routine(void *data)
 
   RunStatus *runStatus = cnf->getRunStatus();
 
-  uintptr_t ptr;
   while (runStatus->get() == RunStatus::WAIT) {
-    ssize_t nn = read(cnf->accept, &ptr, sizeof(ptr));
-    if (nn == -1) {
-      if (errno != EINTR) break;
-      else continue;
-    } else if (nn == 0) {
-      break;
-    }
-
-    assert(nn == sizeof(ptr));
-
-    if (!ptr) break;  // terminate task
+    void *ptr = cnf->queue.pop();
+    if (!ptr) break;  // terminate task or eventfd error
 
     if (kafka && !kafka->produce((std::vector<FileRecord*>*) ptr)) {
       log_fatal(0, "rd_kafka_poll timeout, librdkafka may have bug or kafka service is unavailable, exit");
@@ -186,7 +176,7 @@ void *routine(void *data)
       log_fatal(0, "es_poll timeout, es service may unavailable, exit");
       runStatus->set(RunStatus::STOP);
     }
-    delete (std::vector<FileRecord*>*)ptr;
+    RecordArena::releaseBatch((std::vector<FileRecord*>*) ptr);
   }
 
   runStatus->set(RunStatus::STOP);
@@ -196,8 +186,7 @@ void *routine(void *data)
 
 inline void terminateRoutine(CnfCtx *ctx)
 {
-  uintptr_t ptr = 0;
-  write(ctx->server, &ptr, sizeof(ptr));
+  ctx->queue.push(0);
 }
 
 void run(InotifyCtx *inotify, CnfCtx *cnf)
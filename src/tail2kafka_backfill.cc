@@ -0,0 +1,329 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "sys.h"
+#include "util.h"
+#include "runstatus.h"
+#include "metrics.h"
+#include "luahelper.h"
+#include "luactx.h"
+#include "cnfctx.h"
+#include "fileoff.h"
+#include "filereader.h"
+#include "kafkactx.h"
+#include "esctx.h"
+#include "zfile.h"
+#include "common.h"
+
+LOGGER_INIT();
+
+#define BACKFILL_WAIT         100
+#define BACKFILL_LOG_INTERVAL 5
+
+/* one chunk of the file, read by its own thread with its own lua states,
+ * sent as host.name.chunk so kafka2file rebuilds every chunk in order
+ */
+struct Chunk {
+  CnfCtx        *cnf;
+  LuaCtx        *ctx;
+  LuaHelper     *helper;    // main.lua of the thread
+  FileOffRecord  fileOff;   // acked offset, not saved
+  off_t          start;
+  off_t          end;       // 0 a compressed file, read to the end of stream
+  off_t          offset;
+  bool           done;
+  pthread_t      tid;
+
+  Chunk(CnfCtx *cnf_, off_t start_, off_t end_)
+    : cnf(cnf_), ctx(0), helper(0), fileOff(0, start_), start(start_), end(end_), offset(start_), done(false) {}
+};
+
+static volatile bool stop = false;
+
+static void onSignal(int)
+{
+  stop = true;
+}
+
+static int64_t nowMilli()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/* the topic lua of file, by file, the history file name starts with it, or fileWithGlob */
+static LuaCtx *findLuaCtx(CnfCtx *cnf, const std::string &file)
+{
+  LuaCtx *head = 0;
+  for (std::vector<LuaCtx *>::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
+    const std::string &f = (*ite)->file();
+    if (file.compare(0, f.size(), f) == 0 && (!head || f.size() > head->file().size())) head = *ite;
+  }
+  if (head) return head;
+
+  for (std::vector<LuaCtx *>::iterator ite = cnf->getGlobCtxs().begin(); ite != cnf->getGlobCtxs().end(); ++ite) {
+    if (fnmatch((*ite)->file().c_str(), file.c_str(), FNM_PATHNAME) == 0) return *ite;
+  }
+  return 0;
+}
+
+static void *readChunk(void *data)
+{
+  Chunk *chunk = (Chunk *) data;
+  CnfCtx *cnf = chunk->cnf;
+  FileReader *reader = chunk->ctx->getFileReader();
+
+  CnfCtx::setThreadLuaHelper(chunk->helper);
+
+  while (!stop && cnf->getRunStatus()->get() != RunStatus::STOP) {
+    if (cnf->stats()->queueBytes() > MAX_FILE_QUEUE_BYTES / 2) {
+      sys::millisleep(BACKFILL_WAIT);
+      continue;
+    }
+
+    reader->setTailBudget(cnf->getQuantum());
+    bool eof = reader->tail2kafka();
+    util::atomic_store(&chunk->offset, chunk->end ? reader->readOffset() : chunk->offset + reader->tailBytes());
+
+    if (eof && reader->finishCatchup()) {
+      util::atomic_store(&chunk->done, true);
+      break;
+    }
+    if (reader->tailBytes() == 0) sys::millisleep(BACKFILL_WAIT);
+  }
+  return 0;
+}
+
+static void *routine(void *data)
+{
+  CnfCtx *cnf = (CnfCtx *) data;
+
+  KafkaCtx *kafka = cnf->getKafka();
+  EsCtx *es = cnf->getEs();
+
+  while (true) {
+    void *ptr = cnf->queue.pop();
+    if (!ptr) break;
+
+    if (kafka && !kafka->produce((std::vector<FileRecord*>*) ptr)) {
+      log_fatal(0, "rd_kafka_poll timeout, kafka service may be unavailable, stop");
+      cnf->getRunStatus()->set(RunStatus::STOP);
+    } else if (es && !es->produce((std::vector<FileRecord*>*) ptr)) {
+      log_fatal(0, "es_poll timeout, es service may unavailable, stop");
+      cnf->getRunStatus()->set(RunStatus::STOP);
+    }
+    RecordArena::releaseBatch((std::vector<FileRecord*>*) ptr);
+  }
+  return NULL;
+}
+
+static bool acked(LuaCtx *ctx)
+{
+  for (; ctx; ctx = ctx->next()) {
+    if (ctx->queueBytes() > 0) return false;
+  }
+  return true;
+}
+
+static bool initChunks(CnfCtx *cnf, LuaCtx *head, const std::string &file,
+                       const std::vector<off_t> &bounds, std::vector<Chunk *> *chunks)
+{
+  for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+    Chunk *chunk = new Chunk(cnf, bounds[i], bounds[i+1]);
+    chunks->push_back(chunk);
+
+    chunk->ctx = cnf->addCatchupFile(head, file, i);
+    if (!chunk->ctx) return false;
+
+    FileReader *reader = chunk->ctx->getFileReader();
+    if (chunk->end && !reader->setRange(chunk->start, chunk->end)) return false;
+    reader->initFileOffRecord(&chunk->fileOff);
+
+    chunk->helper = new LuaHelper;
+    if (!chunk->helper->dofile(cnf->getLuaHelper()->file(), cnf->errbuf())) return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3 || argc == 5 || argc > 6) {
+    fprintf(stderr, "%s confdir file [jobs [start end]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *dir = argv[1];
+  std::string file = argv[2];
+  int jobs = argc > 3 ? atoi(argv[3]) : 4;
+  off_t start = argc > 4 ? atol(argv[4]) : 0;
+  off_t end = argc > 5 ? atol(argv[5]) : -1;
+  char errbuf[MAX_ERR_LEN] = {0};
+
+  if (jobs <= 0) {
+    fprintf(stderr, "jobs must be > 0\n");
+    return EXIT_FAILURE;
+  }
+
+  CnfCtx *cnf = CnfCtx::loadCnf(dir, errbuf);
+  if (!cnf) {
+    fprintf(stderr, "load cnf error %s\n", errbuf);
+    return EXIT_FAILURE;
+  }
+
+  if (cnf->logdir() != "-") {
+    if (!Logger::create(cnf->logdir() + "/tail2kafka_backfill.log", Logger::DAY, true)) {
+      fprintf(stderr, "%d:%s init logger error\n", errno, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  LuaCtx *head = findLuaCtx(cnf, file);
+  if (!head) {
+    fprintf(stderr, "%s is not the file of any topic\n", file.c_str());
+    return EXIT_FAILURE;
+  }
+
+  // a compressed file can not seek to a line, read it as one chunk
+  std::vector<off_t> bounds;
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "open %s error %s\n", file.c_str(), strerror(errno));
+    return EXIT_FAILURE;
+  }
+  ZFile::Type type = ZFile::detect(fd);
+  close(fd);
+
+  if (type != ZFile::NONE) {
+    if (argc > 4) {
+      fprintf(stderr, "%s is %s compressed, no range\n", file.c_str(), ZFile::typeToString(type));
+      return EXIT_FAILURE;
+    }
+    bounds.push_back(0);
+    bounds.push_back(0);
+  } else if (!sys::splitLines(file.c_str(), start, end, jobs, &bounds, errbuf)) {
+    fprintf(stderr, "split %s error %s\n", file.c_str(), errbuf);
+    return EXIT_FAILURE;
+  }
+  if (bounds.empty()) {
+    fprintf(stderr, "%s has no line in range\n", file.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  RunStatus *runStatus = RunStatus::create();
+  runStatus->set(RunStatus::WAIT);
+  cnf->setRunStatus(runStatus);
+
+  const char *pingbackUrl = cnf->pingbackUrl().empty() ? 0 : cnf->pingbackUrl().c_str();
+  if (!util::Metrics::create(pingbackUrl, cnf->errbuf())) {
+    log_fatal(0, "Metrics::create error %s", cnf->errbuf());
+  }
+
+  if (cnf->enableKafka()) {
+    if (!cnf->initKafka()) {
+      fprintf(stderr, "init kafka error %s\n", cnf->errbuf());
+      return EXIT_FAILURE;
+    }
+  } else if (cnf->enableEs()) {
+    if (!cnf->initEs()) {
+      fprintf(stderr, "init es error %s\n", cnf->errbuf());
+      return EXIT_FAILURE;
+    }
+  }
+
+  // instances copy the rkt of the topic, kafka goes first
+  std::vector<Chunk *> chunks;
+  if (!initChunks(cnf, head, file, bounds, &chunks)) {
+    fprintf(stderr, "init chunks error %s\n", cnf->errbuf());
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  off_t total = bounds.back() - bounds.front();
+  log_info(0, "backfill %s %ld-%ld in %d chunks as %s", file.c_str(), (long) bounds.front(), (long) bounds.back(),
+           (int) chunks.size(), chunks[0]->ctx->host().c_str());
+
+  int64_t startTime = nowMilli();
+  pthread_t tid;
+  pthread_create(&tid, NULL, routine, cnf);
+  for (std::vector<Chunk *>::iterator ite = chunks.begin(); ite != chunks.end(); ++ite) {
+    pthread_create(&(*ite)->tid, NULL, readChunk, *ite);
+  }
+
+  KafkaCtx *kafka = cnf->getKafka();
+  int64_t logTime = startTime, stopTime = 0;
+  off_t logDone = 0, done = 0;
+  bool finish = false;
+
+  while (!finish && runStatus->get() != RunStatus::STOP) {
+    if (kafka) kafka->poll(BACKFILL_WAIT);
+    else sys::millisleep(BACKFILL_WAIT);
+    cnf->fasttime(true, TIMEUNIT_SECONDS);
+
+    finish = !stop;
+    done = 0;
+    for (std::vector<Chunk *>::iterator ite = chunks.begin(); ite != chunks.end(); ++ite) {
+      done += util::atomic_load(&(*ite)->offset) - (*ite)->start;
+      if (!util::atomic_load(&(*ite)->done) || !acked((*ite)->ctx)) finish = false;
+    }
+
+    // acks in flight have a while after a signal, the chunks are sent again anyway
+    int64_t now = nowMilli();
+    if (stop && stopTime == 0) stopTime = now;
+    if (stop && (cnf->stats()->queueSize() == 0 || now - stopTime > BACKFILL_LOG_INTERVAL * 1000)) break;
+    if (now - logTime >= BACKFILL_LOG_INTERVAL * 1000) {
+      long rate = (done - logDone) * 1000 / (now - logTime);
+      std::string eta = rate > 0 && type == ZFile::NONE ? util::toStr((total - done) / rate) + "s" : "NA";
+      log_info(0, "BackfillStatus,done=%ld,left=%ld,rate=%ld/s,eta=%s,queueSize=%ld",
+               (long) done, type == ZFile::NONE ? (long) (total - done) : -1L, rate, eta.c_str(),
+               (long) cnf->stats()->queueSize());
+      logTime = now;
+      logDone = done;
+    }
+  }
+
+  stop = true;
+  for (std::vector<Chunk *>::iterator ite = chunks.begin(); ite != chunks.end(); ++ite) {
+    pthread_join((*ite)->tid, NULL);
+  }
+  cnf->queue.push(0);
+  pthread_join(tid, NULL);
+
+  double seconds = (nowMilli() - startTime) / 1000.0;
+  if (seconds <= 0) seconds = 0.001;
+
+  TailStats s;
+  cnf->stats()->get(&s);
+  const char *status = finish ? "finished" : "stopped";
+  log_info(0, "backfill %s %s, %ld bytes %ld lines sent %ld in %.1fs, %.1f MB/s, %.0f lines/s",
+           file.c_str(), status, (long) done, (long) s.logRead(), (long) s.logSend(), seconds,
+           done / seconds / (1024 * 1024), s.logRead() / seconds);
+  printf("%s %s, %ld bytes %ld lines sent %ld in %.1fs, %.1f MB/s, %.0f lines/s, %d chunks as %s.N\n",
+         file.c_str(), status, (long) done, (long) s.logRead(), (long) s.logSend(), seconds,
+         done / seconds / (1024 * 1024), s.logRead() / seconds, (int) chunks.size(),
+         chunks[0]->ctx->host().substr(0, chunks[0]->ctx->host().rfind('.')).c_str());
+
+  // librdkafka may wait for the records not acked, leave them to exit
+  if (!finish) return EXIT_FAILURE;
+
+  for (std::vector<Chunk *>::iterator ite = chunks.begin(); ite != chunks.end(); ++ite) {
+    delete (*ite)->helper;
+    delete *ite;
+  }
+  delete cnf;
+  delete runStatus;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,754 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "unittesthelper.h"
+#include "sys.h"
+#include "util.h"
+#include "runstatus.h"
+#include "luahelper.h"
+#include "luactx.h"
+#include "cnfctx.h"
+#include "filereader.h"
+#include "lineindex.h"
+#include "mpscqueue.h"
+#include "checksum.h"
+#include "inotifyctx.h"
+
+#define ETCDIR "blackboxtest/tail2kafka"
+#define LOG(f) "logs/"f
+#define LINE_LEN 200
+
+LOGGER_INIT();
+
+static CnfCtx *cnf = 0;
+static off_t fileSize = 256 * 1024 * 1024;
+
+static LuaCtx *getLuaCtx(const char *topic)
+{
+  for (std::vector<LuaCtx *>::iterator ite = cnf->getLuaCtxs().begin(); ite != cnf->getLuaCtxs().end(); ++ite) {
+    for (LuaCtx *ctx = *ite; ctx; ctx = ctx->next()) {
+      if (ctx->topic() == topic) return ctx;
+    }
+  }
+  return 0;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// act as kafka, free the records as soon as possible
+static void *drain(void *)
+{
+  void *ptr;
+  while ((ptr = cnf->queue.pop())) {
+    std::vector<FileRecord *> *records = (std::vector<FileRecord *> *) ptr;
+    for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+      (*ite)->ctx->queueSizeDec(1, (*ite)->data->size());
+      FileRecord::destroy(*ite);
+    }
+    RecordArena::releaseBatch(records);
+  }
+  return 0;
+}
+
+static const char *files[] = {
+  LOG("basic.log"),
+  LOG("filter.log"),
+  LOG("aggregate.log"),
+  LOG("grep.log"),
+  LOG("transform.log"),
+  0
+};
+
+DEFINE(prepare)
+{
+  mkdir(LOG(""), 0755);
+  for (int i = 0; files[i]; ++i) {
+    int fd = creat(files[i], 0644);
+    if (fd != -1) close(fd);
+  }
+
+  char line[LINE_LEN];
+  memset(line, 'x', LINE_LEN-1);
+  line[LINE_LEN-1] = '\n';
+
+  FILE *fp = fopen(LOG("basic.log"), "w");
+  check(fp, "open %s error", LOG("basic.log"));
+  for (off_t n = 0; n < fileSize; n += LINE_LEN) fwrite(line, 1, LINE_LEN, fp);
+  fclose(fp);
+
+  static char errbuf[MAX_ERR_LEN];
+  cnf = CnfCtx::loadCnf(ETCDIR, errbuf);
+  check(cnf, "loadCnf %s", errbuf);
+  check(cnf->initFileOff(), "%s", cnf->errbuf());
+  check(cnf->initFileReader(), "%s", cnf->errbuf());
+}
+
+static bool tailMmap = false;
+
+DEFINE(tail)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  ctx->checksum_ = Checksum::NONE;
+
+  FileReader *reader = ctx->getFileReader();
+  reader->mmap_ = tailMmap;
+  reader->size_ = 0;
+  reader->npos_ = 0;
+  lseek(reader->fd_, 0, SEEK_SET);
+
+  double start = now();
+  do {
+    if (!reader->tail2kafka()) sys::millisleep(1);
+  } while (reader->size_ < fileSize);
+  while (cnf->stats()->queueBytes() > 0) sys::millisleep(1);
+  double cost = now() - start;
+
+  printf("%-8s %ld bytes %.3fs %.1f MB/s\n", tailMmap ? "mmap" : "read",
+         (long) fileSize, cost, fileSize / cost / (1024 * 1024));
+}
+
+#define INDEX_BUFFER_LEN (8 * 1024 * 1024)
+#define INDEX_LOOP       20
+
+static size_t indexLineLen = 0;
+
+// the processLines loop before indexLines
+static size_t memchrLines(const char *buffer, size_t size, std::vector<uint32_t> *index)
+{
+  const char *pos;
+  size_t n = 0;
+  while ((pos = (const char *) memchr(buffer + n, '\n', size - n))) {
+    index->push_back(pos - buffer);
+    n = (pos+1) - buffer;
+    if (n == size) break;
+  }
+  return index->size();
+}
+
+DEFINE(indexLines)
+{
+  std::string buffer(INDEX_BUFFER_LEN, 'x');
+  for (size_t i = indexLineLen - 1; i < buffer.size(); i += indexLineLen) buffer[i] = '\n';
+
+  std::vector<uint32_t> index;
+  index.reserve(buffer.size() / indexLineLen + 1);
+
+  double start = now();
+  for (int i = 0; i < INDEX_LOOP; ++i) {
+    index.clear();
+    memchrLines(buffer.data(), buffer.size(), &index);
+  }
+  double memchrCost = now() - start;
+  size_t expect = index.size();
+
+  start = now();
+  for (int i = 0; i < INDEX_LOOP; ++i) {
+    index.clear();
+    indexLines(buffer.data(), buffer.size(), &index);
+  }
+  double indexCost = now() - start;
+  check(index.size() == expect, "%d != %d", (int) index.size(), (int) expect);
+
+  double mb = (double) INDEX_LOOP * buffer.size() / (1024 * 1024);
+  printf("linelen %-8d memchr %.1f MB/s, %s %.1f MB/s\n", (int) indexLineLen,
+         mb / memchrCost, indexLinesImpl(), mb / indexCost);
+}
+
+#define CHECKSUM_BUFFER_LEN (8 * 1024 * 1024)
+#define CHECKSUM_LOOP       20
+
+DEFINE(checksum)
+{
+  std::string buffer(CHECKSUM_BUFFER_LEN, 'x');
+  double mb = (double) CHECKSUM_LOOP * buffer.size() / (1024 * 1024);
+
+  Checksum::Algorithm algs[] = {Checksum::MD5, Checksum::CRC32C};
+  for (size_t i = 0; i < sizeof(algs)/sizeof(algs[0]); ++i) {
+    Checksum checksum;
+    checksum.init(algs[i]);
+
+    double start = now();
+    for (int j = 0; j < CHECKSUM_LOOP; ++j) checksum.update(buffer.data(), buffer.size());
+    checksum.hex();
+    double cost = now() - start;
+
+    printf("%-6s %-6s %.1f MB/s\n", checksum.name(), algs[i] == Checksum::CRC32C ? crc32cImpl() : "",
+           mb / cost);
+  }
+}
+
+#define LATENCY_LINES    2000
+#define LATENCY_INTERVAL 5      // ms between lines, an idle file
+
+static std::vector<double> latencies;
+static int latencyCount = 0;
+
+// act as kafka, each line is the time it was written
+static void *latencyDrain(void *)
+{
+  void *ptr;
+  while ((ptr = cnf->queue.pop())) {
+    double t = now();
+    std::vector<FileRecord *> *records = (std::vector<FileRecord *> *) ptr;
+    for (std::vector<FileRecord *>::iterator ite = records->begin(); ite != records->end(); ++ite) {
+      std::string line = (*ite)->data->str();
+      size_t pos = line.rfind(' ');
+      if (pos != std::string::npos) {
+        latencies.push_back(t - atof(line.c_str() + pos + 1));
+        util::atomic_inc(&latencyCount);
+      }
+      (*ite)->ctx->queueSizeDec(1, (*ite)->data->size());
+      FileRecord::destroy(*ite);
+    }
+    RecordArena::releaseBatch(records);
+  }
+  return 0;
+}
+
+static void *watchLoop(void *data)
+{
+  InotifyCtx *inotify = (InotifyCtx *) data;
+  inotify->loop();
+  return 0;
+}
+
+/* write to read latency through the inotify loop */
+DEFINE(latency)
+{
+  RunStatus *runStatus = RunStatus::create();
+  runStatus->set(RunStatus::WAIT);
+  cnf->setRunStatus(runStatus);
+
+  LuaCtx *ctx = getLuaCtx("basic");
+  ctx->rawcopy_ = false;
+
+  InotifyCtx inotify(cnf);
+  check(inotify.init(), "%s", cnf->errbuf());
+
+  pthread_t drainTid, loopTid;
+  pthread_create(&drainTid, NULL, latencyDrain, 0);
+  pthread_create(&loopTid, NULL, watchLoop, &inotify);
+  sys::millisleep(100);
+
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  for (int i = 0; i < LATENCY_LINES; ++i) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "latency %.6f\n", now());
+    write(fd, line, n);
+    sys::millisleep(LATENCY_INTERVAL);
+  }
+  close(fd);
+
+  for (int i = 0; i < 1000 && util::atomic_get(&latencyCount) < LATENCY_LINES; ++i) sys::millisleep(1);
+  runStatus->set(RunStatus::STOP);
+  pthread_join(loopTid, 0);
+  cnf->queue.push(0);
+  pthread_join(drainTid, 0);
+
+  check(latencies.size() == LATENCY_LINES, "%d", (int) latencies.size());
+  std::sort(latencies.begin(), latencies.end());
+  printf("polllimit %d, %d lines every %dms, p50 %.3fms p99 %.3fms max %.3fms\n",
+         cnf->getPollLimit(), LATENCY_LINES, LATENCY_INTERVAL,
+         latencies[LATENCY_LINES / 2] * 1000, latencies[LATENCY_LINES * 99 / 100] * 1000,
+         latencies.back() * 1000);
+}
+
+#define HANDOFF_NPTR    (4 * 1024 * 1024)
+#define HANDOFF_PINGPONG 20000
+
+/* the pipe of cnf->server/accept before MpscQueue */
+class PipeHandoff {
+public:
+  PipeHandoff() { if (pipe(fd_) == -1) fd_[0] = fd_[1] = -1; }
+  ~PipeHandoff() { close(fd_[0]); close(fd_[1]); }
+  void push(void *ptr) {
+    uintptr_t nptr = (uintptr_t) ptr;
+    write(fd_[1], &nptr, sizeof(nptr));
+  }
+  void *pop() {
+    uintptr_t nptr = 0;
+    read(fd_[0], &nptr, sizeof(nptr));
+    return (void *) nptr;
+  }
+private:
+  int fd_[2];
+};
+
+class QueueHandoff {
+public:
+  QueueHandoff() : queue_(MAX_BATCH_QUEUE_SIZE) { queue_.init(errbuf_); }
+  void push(void *ptr) { queue_.push(ptr); }
+  void *pop() { return queue_.pop(); }
+private:
+  char errbuf_[MAX_ERR_LEN];
+  util::MpscQueue queue_;
+};
+
+template <class Handoff>
+struct HandoffCtx {
+  Handoff   handoff;
+  int       nproducer;
+  uintptr_t nptr;
+  uintptr_t ack;
+};
+
+template <class Handoff>
+static void *handoffProducer(void *data)
+{
+  HandoffCtx<Handoff> *ctx = (HandoffCtx<Handoff> *) data;
+  for (uintptr_t i = 1; i <= ctx->nptr; ++i) ctx->handoff.push((void *) i);
+  return 0;
+}
+
+template <class Handoff>
+static void *handoffPingpong(void *data)
+{
+  HandoffCtx<Handoff> *ctx = (HandoffCtx<Handoff> *) data;
+  for (uintptr_t i = 1; i <= ctx->nptr; ++i) {
+    ctx->handoff.push((void *) i);
+    while (util::atomic_load(&ctx->ack) != i) {}
+  }
+  return 0;
+}
+
+template <class Handoff>
+static void handoff(const char *name, int nproducer)
+{
+  HandoffCtx<Handoff> ctx;
+  ctx.nproducer = nproducer;
+  ctx.nptr = HANDOFF_NPTR / nproducer;
+
+  // throughput, consumer is always busy
+  std::vector<pthread_t> tids(nproducer);
+  double start = now();
+  for (int i = 0; i < nproducer; ++i) pthread_create(&tids[i], 0, handoffProducer<Handoff>, &ctx);
+  for (uintptr_t i = 0; i < ctx.nptr * nproducer; ++i) ctx.handoff.pop();
+  double cost = now() - start;
+  for (int i = 0; i < nproducer; ++i) pthread_join(tids[i], 0);
+
+  // latency, consumer is idle when every pointer arrives
+  ctx.nptr = HANDOFF_PINGPONG;
+  ctx.ack = 0;
+  double pstart = now();
+  pthread_create(&tids[0], 0, handoffPingpong<Handoff>, &ctx);
+  for (uintptr_t i = 1; i <= ctx.nptr; ++i) {
+    ctx.handoff.pop();
+    util::atomic_store(&ctx.ack, i);
+  }
+  double pcost = now() - pstart;
+  pthread_join(tids[0], 0);
+
+  printf("%-5s producer %d %.2f Mptr/s, pingpong %.2f us\n", name, nproducer,
+         HANDOFF_NPTR / cost / 1000000, pcost * 1000000 / HANDOFF_PINGPONG);
+}
+
+static int handoffProducerN = 1;
+
+DEFINE(handoff)
+{
+  handoff<PipeHandoff>("pipe", handoffProducerN);
+  handoff<QueueHandoff>("mpsc", handoffProducerN);
+}
+
+#define STAT_FILES  1000
+#define STAT_ROUNDS 1000
+
+/* the 1s check of every file and a round of active files, a fstat each */
+DEFINE(fstat)
+{
+  mkdir(LOG("fstat"), 0755);
+  std::vector<int> fds;
+  for (int i = 0; i < STAT_FILES; ++i) {
+    std::string file = LOG("fstat/") + util::toStr(i);
+    int fd = open(file.c_str(), O_CREAT | O_WRONLY, 0644);
+    check(fd != -1, "open %s error", file.c_str());
+    fds.push_back(fd);
+  }
+
+  struct stat st;
+  double start = now();
+  for (int i = 0; i < STAT_ROUNDS; ++i) {
+    for (int j = 0; j < STAT_FILES; ++j) fstat(fds[j], &st);
+  }
+  double cost = now() - start;
+  printf("%d files fstat %.1f us a round\n", STAT_FILES, cost * 1000000 / STAT_ROUNDS);
+
+  for (int i = 0; i < STAT_FILES; ++i) {
+    close(fds[i]);
+    unlink((LOG("fstat/") + util::toStr(i)).c_str());
+  }
+  rmdir(LOG("fstat"));
+}
+
+#define SPLIT_LINES 1000000
+
+/* split makes a string per field, splitSpans fills spans that are reused
+ * and goes through the line 16 bytes at a time, quotes stop it less often
+ */
+DEFINE(splitFields)
+{
+  std::vector<std::string> ngxLines, plainLines;
+  for (int i = 0; i < SPLIT_LINES / 10; ++i) {
+    char line[256];
+    snprintf(line, sizeof(line), "127.0.0.%d - - [28/Feb/2015:12:30:23 +0800] \"GET /index.html?id=%d HTTP/1.1\" "
+             "200 612 \"-\" \"curl/7.29.0\" %d.%03d", i % 256, i, i / 1000 % 10, i % 1000);
+    ngxLines.push_back(line);
+    snprintf(line, sizeof(line), "2015-02-28T12:30:23 127.0.0.%d GET /index.html?id=%d 200 612 - curl/7.29.0 %d.%03d "
+             "upstream=10.0.0.%d:8080 cache=MISS", i % 256, i, i / 1000 % 10, i % 1000, i % 16);
+    plainLines.push_back(line);
+  }
+
+  std::vector<std::string> *lineSets[] = {&ngxLines, &plainLines};
+  const char *names[] = {"nginx", "no quote"};
+  for (int k = 0; k < 2; ++k) {
+    const std::vector<std::string> &lines = *lineSets[k];
+    size_t nfield = 0, nspan = 0;
+
+    double start = now();
+    for (int i = 0; i < SPLIT_LINES; ++i) {
+      const std::string &line = lines[i % lines.size()];
+      std::vector<std::string> fields;
+      split(line.data(), line.size(), &fields);
+      nfield += fields.size();
+    }
+    double splitCost = now() - start;
+
+    std::vector<uint32_t> spans;
+    start = now();
+    for (int i = 0; i < SPLIT_LINES; ++i) {
+      const std::string &line = lines[i % lines.size()];
+      spans.clear();
+      splitSpans(line.data(), line.size(), &spans);
+      nspan += spans.size() / 2;
+    }
+    double spanCost = now() - start;
+    check(nfield == nspan, "%d != %d", (int) nfield, (int) nspan);
+
+    printf("%-8s split %.0f lines/s, splitSpans %.0f lines/s\n", names[k], SPLIT_LINES / splitCost, SPLIT_LINES / spanCost);
+  }
+}
+
+#define TIME_LINES 1000000
+
+/* time_local of lines that share the second, that share the minute, and of a new minute every line.
+ * strptime, mktime and strftime for every line is the cost without the cache
+ */
+DEFINE(timeLocal)
+{
+  int steps[] = {0, 1, 60};    // seconds between lines, 0 is 100 lines a second
+  const char *names[] = {"second", "minute", "miss"};
+  for (int k = 0; k < 3; ++k) {
+    std::vector<std::string> times;
+    for (int i = 0; i < TIME_LINES / 100; ++i) {
+      time_t t = 1425097823 + (steps[k] == 0 ? i / 100 : (time_t) i * steps[k]);
+      struct tm tm;
+      localtime_r(&t, &tm);
+      char buf[64];
+      strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+      times.push_back(buf);
+    }
+
+    std::string iso;
+    time_t sum = 0;
+    double start = now();
+    for (int i = 0; i < TIME_LINES; ++i) {
+      const std::string &s = times[i % times.size()];
+      time_t timestamp;
+      timeLocalToIso8601(s.data(), s.size(), &iso, &timestamp);
+      sum += timestamp;
+    }
+    double cacheCost = now() - start;
+
+    time_t sumRef = 0;
+    start = now();
+    for (int i = 0; i < TIME_LINES; ++i) {
+      const std::string &s = times[i % times.size()];
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      strptime(s.c_str(), "%d/%b/%Y:%H:%M:%S", &tm);
+      tm.tm_isdst = -1;
+      char buf[32];
+      strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+      iso.assign(buf);
+      sumRef += mktime(&tm);
+    }
+    double refCost = now() - start;
+    check(sum == sumRef, "%ld != %ld", (long) sum, (long) sumRef);
+
+    printf("%-6s strptime %.0f lines/s, timeLocalToIso8601 %.0f lines/s\n", names[k],
+           TIME_LINES / refCost, TIME_LINES / cacheCost);
+  }
+}
+
+#define FFI_LINES 1000000
+#define FFI_OUT   (64 * 1024)
+#define FFI_BATCH 1024
+
+static const char *ffiLua =
+  "local ffi = require('ffi')\n"
+  "local error = '[error]'\n"
+  "function grep(fields) return {fields[1], fields[4], fields[7]} end\n"
+  "function transform(line)\n"
+  "  if string.sub(line, 1, 7) == error then return line end\n"
+  "end\n"
+  "local function field(p, s, i, o, n)\n"
+  "  local start, len = s[i*2], s[i*2+1]\n"
+  "  if n > 0 then o[n] = 32; n = n + 1 end\n"
+  "  ffi.copy(o + n, p + start, len)\n"
+  "  return n + len\n"
+  "end\n"
+  "function grepFfi(line, nline, spans, nspans, out, nout)\n"
+  "  local p = ffi.cast('const char *', line)\n"
+  "  local s = ffi.cast('const uint32_t *', spans)\n"
+  "  local o = ffi.cast('char *', out)\n"
+  "  return field(p, s, 6, o, field(p, s, 3, o, field(p, s, 0, o, 0)))\n"
+  "end\n"
+  "function transformBatch(lines)\n"
+  "  local results = {}\n"
+  "  for i = 1, #lines do\n"
+  "    results[i] = string.sub(lines[i], 1, 7) == error and lines[i]\n"
+  "  end\n"
+  "  return results\n"
+  "end\n"
+  "function transformFfi(line, nline, spans, nspans, out, nout)\n"
+  "  local p = ffi.cast('const char *', line)\n"
+  "  if nline < 7 or ffi.string(p, 7) ~= error then return nil end\n"
+  "  ffi.copy(out, p, nline)\n"
+  "  return nline\n"
+  "end\n";
+
+/* the lua string and table per line, against pointers into the line through luajit ffi,
+ * and against many lines a call
+ */
+DEFINE(luaFfi)
+{
+  FILE *fp = fopen(LOG("ffi.lua"), "w");
+  check(fp, "open %s error", LOG("ffi.lua"));
+  fputs(ffiLua, fp);
+  fclose(fp);
+
+  char errbuf[MAX_ERR_LEN];
+  LuaHelper helper;
+  check(helper.dofile(LOG("ffi.lua"), errbuf), "%s", errbuf);
+
+  /* every line differs, as in a log, lua interns each string. luajit 2.0 hashes
+   * only a few words of a string, lines alike there collide in a batch, so end
+   * with a request time as nginx does
+   */
+  std::vector<std::string> lines;
+  for (int i = 0; i < FFI_LINES; ++i) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s 127.0.0.%d - - [28/Feb/2015:12:30:23 +0800] \"GET /index.html?id=%d HTTP/1.1\" "
+             "200 612 \"-\" \"curl/7.29.0\" %d.%03d", i % 2 ? "[info]" : "[error]", i % 256, i, i / 1000 % 10, i % 1000);
+    lines.push_back(line);
+  }
+  std::vector<char> out(FFI_OUT);
+  std::string result, ffiResult;
+  std::vector<uint32_t> spans;
+
+  double start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    std::vector<std::string> fields;
+    split(line.data(), line.size(), &fields);
+    result.clear();
+    check(helper.call("grep", fields, 1) && helper.callResultListAsString("grep", &result), "%s", errbuf);
+  }
+  double grepCost = now() - start;
+
+  start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    spans.clear();
+    splitSpans(line.data(), line.size(), &spans);
+    check(helper.callFfi("grepFfi", line.data(), line.size(), &spans[0], spans.size() / 2, &out[0], out.size()) &&
+          helper.callResultOut("grepFfi", &out[0], out.size(), &ffiResult), "%s", errbuf);
+  }
+  double grepFfiCost = now() - start;
+  check(result == ffiResult, "%s != %s", PTRS(result), PTRS(ffiResult));
+
+  int n = 0, ffiN = 0;
+  start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    check(helper.call("transform", line.data(), line.size()), "%s", errbuf);
+    if (helper.callResultNil()) continue;
+    check(helper.callResultString("transform", &result), "%s", errbuf);
+    ++n;
+  }
+  double transformCost = now() - start;
+
+  start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    check(helper.callFfi("transformFfi", line.data(), line.size(), 0, 0, &out[0], out.size()), "%s", errbuf);
+    if (helper.callResultNil()) continue;
+    check(helper.callResultOut("transformFfi", &out[0], out.size(), &ffiResult), "%s", errbuf);
+    ++ffiN;
+  }
+  double transformFfiCost = now() - start;
+  check(n == ffiN && result == ffiResult, "%d != %d", n, ffiN);
+
+  // lines of a read chunk in one call
+  std::vector<LineRef> batch;
+  std::vector<int> lens;
+  int batchN = 0;
+  start = now();
+  for (int i = 0; i < FFI_LINES; i += FFI_BATCH) {
+    batch.clear();
+    for (int j = i; j < std::min(i + FFI_BATCH, FFI_LINES); ++j) {
+      batch.push_back(LineRef(0, lines[j].data(), lines[j].size()));
+    }
+    check(helper.call("transformBatch", &batch[0], batch.size()) &&
+          helper.callResultArray("transformBatch", batch.size(), &ffiResult, &lens), "%s", errbuf);
+    for (size_t j = 0; j < lens.size(); ++j) batchN += lens[j] >= 0;
+  }
+  double transformBatchCost = now() - start;
+  check(n == batchN, "%d != %d", n, batchN);
+
+  printf("grep      %.0f lines/s, ffi %.0f lines/s\n", FFI_LINES / grepCost, FFI_LINES / grepFfiCost);
+  printf("transform %.0f lines/s, ffi %.0f lines/s, batch of %d %.0f lines/s\n", FFI_LINES / transformCost,
+         FFI_LINES / transformFfiCost, FFI_BATCH, FFI_LINES / transformBatchCost);
+  unlink(LOG("ffi.lua"));
+}
+
+static const char *matchLua =
+  "match = {{6, '>=', 500}, {5, 'contains', '/api/'}}\n"
+  "function grep(fields)\n"
+  "  if tonumber(fields[6]) >= 500 and string.find(fields[5], '/api/', 1, true) then\n"
+  "    return {fields[4], fields[5], fields[6], fields[#fields]}\n"
+  "  end\n"
+  "end\n";
+
+/* grep in lua, against match + filter = {4, 5, 6, -1} on the spans of the line */
+DEFINE(matchExpr)
+{
+  FILE *fp = fopen(LOG("match.lua"), "w");
+  check(fp, "open %s error", LOG("match.lua"));
+  fputs(matchLua, fp);
+  fclose(fp);
+
+  char errbuf[MAX_ERR_LEN];
+  LuaHelper helper;
+  MatchExpr expr;
+  check(helper.dofile(LOG("match.lua"), errbuf) && helper.getMatch("match", &expr), "%s", errbuf);
+
+  const char *statuses[] = {"200", "200", "304", "404", "500", "502"};
+  std::vector<std::string> lines;
+  for (int i = 0; i < FFI_LINES; ++i) {
+    char line[256];
+    snprintf(line, sizeof(line), "127.0.0.%d - - [28/Feb/2015:12:30:23 +0800] \"GET /%s?id=%d HTTP/1.1\" "
+             "%s 612 \"-\" \"curl/7.29.0\" %d.%03d", i % 256, i % 4 ? "index.html" : "api/user", i,
+             statuses[i % 6], i / 1000 % 10, i % 1000);
+    lines.push_back(line);
+  }
+
+  int n = 0;
+  std::string result;
+  double start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    std::vector<std::string> fields;
+    split(line.data(), line.size(), &fields);
+    check(helper.call("grep", fields, 1), "%s", errbuf);
+    if (helper.callResultNil()) continue;
+    result.clear();
+    check(helper.callResultListAsString("grep", &result), "%s", errbuf);
+    ++n;
+  }
+  double luaCost = now() - start;
+
+  int filters[] = {4, 5, 6, -1};
+  int matchN = 0;
+  std::string matchResult;
+  std::vector<uint32_t> spans;
+  start = now();
+  for (int i = 0; i < FFI_LINES; ++i) {
+    const std::string &line = lines[i];
+    spans.clear();
+    splitSpans(line.data(), line.size(), &spans);
+    if (!expr.match(line.data(), spans)) continue;
+
+    matchResult.clear();
+    for (size_t j = 0; j < sizeof(filters)/sizeof(filters[0]); ++j) {
+      int idx = absidx(filters[j], spans.size() / 2);
+      if (!matchResult.empty()) matchResult.append(1, ' ');
+      matchResult.append(line.data() + spans[idx * 2], spans[idx * 2 + 1]);
+    }
+    ++matchN;
+  }
+  double matchCost = now() - start;
+  check(n == matchN && result == matchResult, "%d != %d, %s != %s", n, matchN, PTRS(result), PTRS(matchResult));
+
+  printf("lua grep %.0f lines/s, match %.0f lines/s, %d of %d lines pass\n",
+         FFI_LINES / luaCost, FFI_LINES / matchCost, n, FFI_LINES);
+  unlink(LOG("match.lua"));
+}
+
+DEFINE(clean)
+{
+  for (int i = 0; files[i]; ++i) {
+    unlink(files[i]);
+  }
+}
+
+/* usage: tail2kafka_benchmark [MB] */
+int main(int argc, char *argv[])
+{
+  if (argc > 1) fileSize = (off_t) atoi(argv[1]) * 1024 * 1024;
+
+  DO(prepare);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, drain, 0);
+
+  tailMmap = false;
+  TESTX(tail, "tail read()");
+  tailMmap = true;
+  TESTX(tail, "tail mmap");
+
+  size_t lineLens[] = {200, 4096, INDEX_BUFFER_LEN};
+  for (size_t i = 0; i < sizeof(lineLens)/sizeof(lineLens[0]); ++i) {
+    indexLineLen = lineLens[i];
+    TESTX(indexLines, "indexLines");
+  }
+
+  TESTX(checksum, "checksum");
+
+  cnf->queue.push(0);
+  pthread_join(tid, 0);
+
+  TESTX(latency, "latency");
+
+  int producers[] = {1, 4};
+  for (size_t i = 0; i < sizeof(producers)/sizeof(producers[0]); ++i) {
+    handoffProducerN = producers[i];
+    TESTX(handoff, "handoff");
+  }
+
+  TESTX(fstat, "fstat");
+  TESTX(splitFields, "splitFields");
+  TESTX(timeLocal, "timeLocal");
+  TESTX(luaFfi, "luaFfi");
+  TESTX(matchExpr, "matchExpr");
+
+  DO(clean);
+
+  delete cnf;
+  return 0;
+}
@@ -1,10 +1,12 @@
 #include <cstdio>
 #include <cstring>
 #include <string>
+#include <memory>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "logger.h"
 #include "unittesthelper.h"
@@ -14,6 +16,10 @@
 #include "luactx.h"
 #include "cnfctx.h"
 #include "filereader.h"
+#include "lineindex.h"
+#include "mpscqueue.h"
+#include "zfile.h"
+#include "checksum.h"
 #include "inotifyctx.h"
 
 #define PADDING_LEN 13
@@ -64,6 +70,64 @@ DEFINE(split_n)
   check(list[2] == "!", "%s", list[2].c_str());
 }
 
+DEFINE(splitSpans)
+{
+  const char *lines[] = {
+    "hello \"1 [] 2\"[world] [] [\"\"]  bj",
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /a\\\" b HTTP/1.1\" 200 612",
+    "  lead trail  ", "\"unclosed [x", "", 0
+  };
+
+  for (int i = 0; lines[i]; ++i) {
+    std::vector<std::string> list;
+    split(lines[i], strlen(lines[i]), &list);
+
+    std::vector<uint32_t> spans;
+    splitSpans(lines[i], strlen(lines[i]), &spans);
+    check(spans.size() == list.size() * 2, "%s %d", lines[i], (int) spans.size());
+    for (size_t j = 0; j < list.size(); ++j) {
+      check(std::string(lines[i] + spans[j*2], spans[j*2+1]) == list[j], "%s #%d %s", lines[i], (int) j, PTRS(list[j]));
+    }
+  }
+}
+
+static bool sameFields(const char *line, const std::vector<std::string> &list, const std::vector<uint32_t> &spans)
+{
+  if (spans.size() != list.size() * 2) return false;
+  for (size_t j = 0; j < list.size(); ++j) {
+    if (list[j].compare(0, std::string::npos, line + spans[j*2], spans[j*2+1]) != 0) return false;
+  }
+  return true;
+}
+
+/* random lines of the bytes split cares about, long enough to cross the 16 byte blocks */
+DEFINE(splitFuzz)
+{
+  const char alphabet[] = "ab  \"[]\\\t-";
+  unsigned seed = 20190401;
+  char line[96];
+
+  for (int i = 0; i < 200000; ++i) {
+    size_t nline = rand_r(&seed) % sizeof(line);
+    size_t nalpha = i % 4 == 0 ? 4 : sizeof(alphabet) - 1;   // a quarter without quotes
+    for (size_t j = 0; j < nline; ++j) line[j] = alphabet[rand_r(&seed) % nalpha];
+
+    std::vector<std::string> list;
+    std::vector<uint32_t> spans;
+    split(line, nline, &list);
+    splitSpans(line, nline, &spans);
+    check(sameFields(line, list, spans), "split %.*s", (int) nline, line);
+
+    int limit = rand_r(&seed) % 5 - 1;
+    char delimiter = i % 2 ? ' ' : '\t';
+    list.clear();
+    spans.clear();
+    splitn(line, nline, &list, limit, delimiter);
+    splitnSpans(line, nline, &spans, limit, delimiter);
+    check(sameFields(line, list, spans), "splitn %d %.*s", limit, (int) nline, line);
+  }
+}
+
 DEFINE(iso8601)
 {
   std::string iso;
@@ -90,6 +154,260 @@ DEFINE(iso8601)
   check(timestamp == 1519292433, "%ld", timestamp);
 }
 
+static bool sameWallClock(time_t time, const struct tm &expect)
+{
+  struct tm tm;
+  localtime_r(&time, &tm);
+  return tm.tm_year == expect.tm_year && tm.tm_mon == expect.tm_mon && tm.tm_mday == expect.tm_mday &&
+    tm.tm_hour == expect.tm_hour && tm.tm_min == expect.tm_min && tm.tm_sec == expect.tm_sec;
+}
+
+/* random times in random zones, formated by strftime, parsed back by the cached parsers.
+ * the next few times repeat the key or keep the minute, they are cache hits
+ */
+DEFINE(timeCache)
+{
+  const char *zones[] = {
+    "UTC0", "CST-8", "EST5EDT,M3.2.0,M11.1.0", "CET-1CEST,M3.5.0,M10.5.0/3", "IST-5:30",
+    "NST3:30NDT,M3.2.0,M11.1.0", "LHST-10:30LHDT-11,M10.1.0,M4.1.0", "CHAST-12:45CHADT,M9.5.0/2:45,M4.1.0/3:45" };
+  const char *tz = getenv("TZ");
+  std::string oldtz = tz ? tz : "";
+  unsigned seed = 20190415;
+
+  for (int i = 0; i < 20000; ++i) {
+    setenv("TZ", zones[i % (sizeof(zones) / sizeof(zones[0]))], 1);
+    tzset();
+
+    time_t base = ((time_t) rand_r(&seed) << 16 ^ rand_r(&seed)) % 0x7FFF0000;
+    for (int j = 0; j < 4; ++j) {
+      time_t t = base + (j == 0 ? 0 : rand_r(&seed) % 90);
+      struct tm tm;
+      localtime_r(&t, &tm);
+
+      char timeLocal[64], isoTime[64], expect[64];
+      strftime(timeLocal, sizeof(timeLocal), "%d/%b/%Y:%H:%M:%S %z", &tm);
+      strftime(isoTime, sizeof(isoTime), j % 2 ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S.123", &tm);
+      strftime(expect, sizeof(expect), "%Y-%m-%dT%H:%M:%S", &tm);
+
+      std::string iso;
+      time_t timestamp;
+      bool rc = timeLocalToIso8601(timeLocal, strlen(timeLocal), &iso, &timestamp);
+      check(rc, "%s", timeLocal);
+      check(iso == expect, "%s %s != %s", timeLocal, iso.c_str(), expect);
+      check(sameWallClock(timestamp, tm), "%s %ld != %ld", timeLocal, (long) timestamp, (long) t);
+
+      rc = parseIso8601(isoTime, strlen(isoTime), &timestamp);
+      check(rc, "%s", isoTime);
+      check(sameWallClock(timestamp, tm), "%s %ld != %ld", isoTime, (long) timestamp, (long) t);
+    }
+  }
+
+  if (tz) setenv("TZ", oldtz.c_str(), 1);
+  else unsetenv("TZ");
+  tzset();
+
+  // a key too long to cache leaves the cache empty, [] is an empty field, neither hits it
+  std::string iso;
+  time_t timestamp;
+  const char *longTime = "28/Feb/2015:12:30:23 +0800 and more than the cache key";
+  for (int i = 0; i < 2; ++i) {
+    check(timeLocalToIso8601(longTime, strlen(longTime), &iso, &timestamp), "%s", longTime);
+    check(iso == "2015-02-28T12:30:23", "%s", iso.c_str());
+  }
+  timeLocalToIso8601("", 0, &iso, &timestamp);
+  check(iso != "2015-02-28T12:30:23", "%s", iso.c_str());
+  check(!parseIso8601("", 0, &timestamp), "%ld", (long) timestamp);
+}
+
+DEFINE(indexLines)
+{
+  std::string s(1024 + 63, 'x');
+  for (size_t i = 0; i < s.size(); i += 7) s[i] = '\n';
+  s[s.size()-1] = '\n';
+
+  // every start and tail length around the vector width
+  for (size_t start = 0; start < 64; ++start) {
+    std::vector<uint32_t> expect, index;
+    for (size_t i = start; i < s.size(); ++i) {
+      if (s[i] == '\n') expect.push_back(i - start);
+    }
+
+    size_t n = indexLines(s.data() + start, s.size() - start, &index);
+    check(n == expect.size() && index == expect, "%s start %d, %d != %d",
+          indexLinesImpl(), (int) start, (int) n, (int) expect.size());
+  }
+
+  std::string zeros(200, '\0');
+  for (size_t i = 0; i < zeros.size(); ++i) {
+    zeros[i] = 'x';
+    check(zeroRun(zeros.data(), zeros.size()) == i, "%d", (int) zeroRun(zeros.data(), zeros.size()));
+    zeros[i] = '\0';
+  }
+  check(zeroRun(zeros.data(), zeros.size()) == zeros.size(), "%s", "all NUL");
+}
+
+#define MPSC_PRODUCER 4
+#define MPSC_NPTR     100000
+
+struct MpscProducer {
+  util::MpscQueue *queue;
+  uintptr_t        id;
+};
+
+static void *mpscProducer(void *data)
+{
+  MpscProducer *producer = (MpscProducer *) data;
+  for (uintptr_t i = 1; i <= MPSC_NPTR; ++i) {
+    producer->queue->push((void *) (producer->id * MPSC_NPTR + i));
+  }
+  return 0;
+}
+
+DEFINE(mpscQueue)
+{
+  char errbuf[MAX_ERR_LEN];
+  util::MpscQueue queue(3);
+  check(queue.init(errbuf), "%s", errbuf);
+  check(queue.capacity() == 4, "%d", (int) queue.capacity());
+
+  void *ptr;
+  check(!queue.tryPop(&ptr), "empty queue pop");
+  for (uintptr_t i = 1; i <= 4; ++i) check(queue.tryPush((void *) i), "push %d", (int) i);
+  check(!queue.tryPush((void *) 5), "full queue push");
+  for (uintptr_t i = 1; i <= 4; ++i) {
+    check(queue.tryPop(&ptr) && ptr == (void *) i, "pop %d", (int) i);
+  }
+
+  // pop blocks on eventfd, pointers of one producer keep their order
+  pthread_t tids[MPSC_PRODUCER];
+  MpscProducer producers[MPSC_PRODUCER];
+  uintptr_t last[MPSC_PRODUCER];
+  for (int i = 0; i < MPSC_PRODUCER; ++i) {
+    producers[i].queue = &queue;
+    producers[i].id = i;
+    last[i] = 0;
+    pthread_create(&tids[i], 0, mpscProducer, &producers[i]);
+  }
+
+  for (int i = 0; i < MPSC_PRODUCER * MPSC_NPTR; ++i) {
+    uintptr_t n = (uintptr_t) queue.pop() - 1;
+    uintptr_t id = n / MPSC_NPTR, seq = n % MPSC_NPTR + 1;
+    check(id < MPSC_PRODUCER && seq == last[id] + 1, "producer %d got %d after %d",
+          (int) id, (int) seq, (int) last[id]);
+    last[id] = seq;
+  }
+  for (int i = 0; i < MPSC_PRODUCER; ++i) pthread_join(tids[i], 0);
+
+  check(!queue.tryPop(&ptr), "queue should be empty");
+}
+
+DEFINE(recordArena)
+{
+  RecordArena *arena = new RecordArena;
+
+  std::string index = "index", data = "hello";
+  FileRecord *r1 = arena->create(1, 10, data);
+  FileRecord *r2 = arena->create(1, 20, &index, data);
+  check(r1->slab && r1->slab == r2->slab, "records of a batch share one slab");
+  check(r1->data->str() == data && r1->data->c_str()[5] == '\0' && !r1->esIndex, "%s", PTRS(*r1->data));
+  check(r2->data->str() == data && r2->esIndex->str() == index, "%s", PTRS(*r2->esIndex));
+  check((char *) r2 == (char *) r1 + FileRecord::chunkSize(0, data), "records are contiguous");
+
+  // fill the slab, the records in the next slab do not touch the full one
+  std::string line(1000, 'x');
+  RecordSlab *slab = r1->slab;
+  std::vector<FileRecord *> records;
+  for (size_t n = 0; n <= RECORD_SLAB_SIZE; n += FileRecord::chunkSize(0, line)) {
+    records.push_back(arena->create(1, 30, line));
+  }
+  check(records.back()->slab != slab, "slab is full");
+
+  // slab comes back to cache when its last record is destroyed, and is reused
+  FileRecord::destroy(r1);
+  FileRecord::destroy(r2);
+  for (size_t i = 0; i+1 < records.size(); ++i) FileRecord::destroy(records[i]);
+
+  records.assign(1, records.back());
+  for (size_t n = 0; n <= RECORD_SLAB_SIZE; n += FileRecord::chunkSize(0, line)) {
+    records.push_back(arena->create(1, 40, line));
+  }
+  check(records.back()->slab == slab, "slab is reused");
+
+  std::string large(RECORD_SLAB_SIZE * 2, 'y');
+  FileRecord *r3 = arena->create(1, 50, large);
+  check(r3->data->size() == large.size() && r3->slab != slab, "large record has its own slab");
+  records.push_back(r3);
+
+  // arena outlives its owner until the last record is destroyed
+  arena->destroy();
+  for (size_t i = 0; i < records.size(); ++i) FileRecord::destroy(records[i]);
+}
+
+DEFINE(checksum)
+{
+  check(crc32c(0, "123456789", 9) == 0xe3069283, "%s %x", crc32cImpl(), crc32c(0, "123456789", 9));
+
+  std::string data;
+  for (int i = 0; i < 1000; ++i) data.append("line " + util::toStr(i) + "\n");
+  uint32_t crc = crc32c(0, data.data(), data.size());
+
+  // running crc over odd pieces
+  Checksum checksum;
+  checksum.init(Checksum::CRC32C);
+  for (size_t i = 0, n = 1; i < data.size(); i += n, n = n * 2 + 1) {
+    checksum.update(data.data() + i, std::min(n, data.size() - i));
+  }
+  char hex[9];
+  snprintf(hex, 9, "%08x", crc);
+  check(checksum.hex() == hex, "%s %s", checksum.hex().c_str(), hex);
+
+  checksum.init(Checksum::MD5);
+  checksum.update("abc", 3);
+  check(checksum.hex() == "900150983cd24fb0d6963f7d28e17f72", "%s", checksum.hex().c_str());
+  check(checksum.hex() == "900150983cd24fb0d6963f7d28e17f72", "%s", "hex twice");
+
+  check(Checksum::stringToAlgorithm("CRC32C") == Checksum::CRC32C, "%s", "crc32c");
+  check(Checksum::stringToAlgorithm("sha1") == Checksum::NIL, "%s", "sha1");
+}
+
+DEFINE(zfile)
+{
+  const char *file = LOG("zfile.log.gz");
+  std::string data;
+  for (int i = 0; i < 10000; ++i) data.append("line " + util::toStr(i) + "\n");
+
+  gzFile gz = gzopen(file, "wb");
+  gzwrite(gz, data.data(), data.size());
+  gzclose(gz);
+
+  int fd = open(file, O_RDONLY);
+  check(ZFile::detect(fd) == ZFile::GZIP, "%s", "detect gzip");
+
+  std::auto_ptr<ZFile> zfile(ZFile::create(fd, ZFile::GZIP, file));
+  check(zfile.get(), "%s", "create gzip");
+  check(zfile->skip(5) == 5, "%d", (int) zfile->offset());
+
+  std::string read;
+  char buffer[1000];
+  ssize_t n;
+  while ((n = zfile->read(buffer, sizeof(buffer))) > 0) read.append(buffer, n);
+
+  check(zfile->eof(), "%s", "gzip eof");
+  check(zfile->offset() == (off_t) data.size(), "%d", (int) zfile->offset());
+  check(read == data.substr(5), "%d", (int) read.size());
+  close(fd);
+
+  // truncated, ends where the stream breaks
+  truncate(file, 100);
+  fd = open(file, O_RDONLY);
+  zfile.reset(ZFile::create(fd, ZFile::GZIP, file));
+  while ((n = zfile->read(buffer, sizeof(buffer))) > 0) {}
+  check(zfile->eof() && zfile->offset() < (off_t) data.size(), "%d", (int) zfile->offset());
+  close(fd);
+
+  unlink(file);
+}
+
 DEFINE(hostshell)
 {
   std::string s = " \tHello World\n";
@@ -129,6 +447,8 @@ DEFINE(loadCnf)
   check(cnf->host() == hostname, "cnf host %s", cnf->host().c_str());
   check(cnf->partition() == 0, "cnf partition %d", cnf->partition());
   check(cnf->getPollLimit() == 50, "cnf polllimit %d", cnf->getPollLimit());
+  check(cnf->getWorkers() == 0, "cnf workers %d", cnf->getWorkers());
+  check(cnf->getQuantum() == DEFAULT_TAIL_QUANTUM, "cnf quantum %d", cnf->getQuantum());
 
   check(cnf->getKafkaGlobalConf().count("client.id"), "kafkaGlobalConf client.id notfound");
   check(cnf->getKafkaGlobalConf().find("client.id")->second == "tail2kafka", "kafkaGlobalConf client.id = %s", PTRS(cnf->getKafkaGlobalConf().find("client.id")->second));
@@ -163,6 +483,8 @@ DEFINE(loadLuaCtx)
   check(ctx->partition_ == -1, "%d", ctx->partition_);
   check(ctx->autonl(), "%s", BTOS(ctx->autonl()));
   check(!ctx->rawcopy_, "%s", BTOS(ctx->rawcopy_));
+  check(ctx->checksum() == Checksum::MD5, "%s", Checksum::algorithmToString(ctx->checksum()));
+  check(ctx->weight() == 1, "%d", ctx->weight());
   check(!ctx->fileWithTimeFormat_, "fileWithTimeFormat_ %s", BTOS(ctx->fileWithTimeFormat_));
   check(strcmp(ctx->getStartPosition(), "LOG_START") == 0, "%s", ctx->getStartPosition());
   check(access(ctx->file().c_str(), F_OK) == 0, "file %s autocreat but notfound", PTRS(ctx->file()));
@@ -208,14 +530,12 @@ DEFINE(loadLuaCtx)
 DEFINE(filter)
 {
   std::vector<FileRecord *> datas;
-  const char *fields1[] = {
-    "-", "-", "-", "2015-04-02T12:05:05", "GET / HTTP/1.0",
-    "200", "-", "-", "95555"};
+  const char *line = "- - - [02/Apr/2015:12:05:05 +0800] \"GET / HTTP/1.0\" 200 - - 95555";
 
   LuaFunction *function = getLuaCtx("filter")->function();
-  function->filter(0, std::vector<std::string>(fields1, fields1+9), &datas);
+  function->process(0, line, strlen(line), &datas);
   check(datas.size() == 1, "datas size %d", (int) datas.size());
-  check(*datas[0]->data == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " 2015-04-02T12:05:05 GET / HTTP/1.0 200 95555",
+  check(datas[0]->data->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " 2015-04-02T12:05:05 GET / HTTP/1.0 200 95555",
         "%s", PTRS(*datas[0]->data));
 }
 
@@ -229,10 +549,85 @@ DEFINE(grep)
   LuaFunction *function = getLuaCtx("grep")->function();
   function->grep(0, std::vector<std::string>(fields1, fields1+9), &datas);
   check(datas.size() == 1, "data size %d", (int) datas.size());
-  check(*datas[0]->data == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " [2015-04-02T12:05:05] \"GET / HTTP/1.0\" 200 95555",
+  check(datas[0]->data->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " [2015-04-02T12:05:05] \"GET / HTTP/1.0\" 200 95555",
         "%s", PTRS(*datas[0]->data));
 }
 
+static bool loadMatch(LuaHelper *helper, const char *lua, MatchExpr *expr, char *errbuf)
+{
+  int fd = creat(LOG("match.lua"), 0644);
+  write(fd, lua, strlen(lua));
+  close(fd);
+
+  bool rc = helper->dofile(LOG("match.lua"), errbuf) && helper->getMatch("match", expr);
+  unlink(LOG("match.lua"));
+  return rc;
+}
+
+DEFINE(matchExpr)
+{
+  char errbuf[MAX_ERR_LEN];
+  LuaHelper helper;
+  MatchExpr expr;
+  const char *lua =
+    "match = {\n"
+    "  {6, '>=', 500},\n"
+    "  {5, 'contains', '/api/'},\n"
+    "  {'or', {1, 'prefix', '127.'}, {-1, '>', 1}},\n"
+    "  {'not', {9, 'regex', '^(wget|python)'}},\n"
+    "}\n";
+  check(loadMatch(&helper, lua, &expr, errbuf), "%s", errbuf);
+
+  const char *lines[] = {
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" 500 612 \"-\" \"curl/7.29.0\" 0.005",
+    "10.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" 502 612 \"-\" \"curl/7.29.0\" 1.5",
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" 200 612 \"-\" \"curl/7.29.0\" 0.005",
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /index.html HTTP/1.1\" 500 612 \"-\" \"curl/7.29.0\" 0.005",
+    "10.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" 500 612 \"-\" \"curl/7.29.0\" -",
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" 500 612 \"-\" \"wget/1.0\" 0.005",
+    "127.0.0.1 - - [28/Feb/2015:12:30:23 +0800] \"GET /api/user HTTP/1.1\" - 612 \"-\" \"curl/7.29.0\" 0.005",
+    "127.0.0.1",
+  };
+  bool expects[] = {true, true, false, false, false, false, false, false};
+
+  for (size_t i = 0; i < sizeof(lines)/sizeof(lines[0]); ++i) {
+    std::vector<uint32_t> spans;
+    splitSpans(lines[i], strlen(lines[i]), &spans);
+    check(expr.match(lines[i], spans) == expects[i], "%d %s", (int) i, lines[i]);
+  }
+
+  // a copy compiles its own regex
+  MatchExpr copy(expr);
+  std::vector<uint32_t> spans;
+  splitSpans(lines[5], strlen(lines[5]), &spans);
+  check(!copy.match(lines[5], spans), "%s", lines[5]);
+
+  const char *bads[] = {
+    "match = {{6, '=>', 500}}",
+    "match = {{0, '==', 'a'}}",
+    "match = {{6, 'contains', 500}}",
+    "match = {{6, 'regex', '('}}",
+    "match = {{'not', {6, '==', 1}, {6, '==', 2}}}",
+    "match = {{'xor', {6, '==', 1}}}",
+    "match = {6, '=='}",
+    0};
+  for (int i = 0; bads[i]; ++i) {
+    MatchExpr bad;
+    check(!loadMatch(&helper, bads[i], &bad, errbuf), "%s", bads[i]);
+  }
+
+  // the filter topic, timeidx 4, the record is the one filter builds from fields
+  LuaFunction *function = getLuaCtx("filter")->function();
+  check(loadMatch(&helper, "match = {6, '>=', 500}", &function->match_, errbuf), "%s", errbuf);
+
+  std::vector<FileRecord *> datas;
+  check(function->process(0, lines[2], strlen(lines[2]), &datas) == 0 && datas.empty(), "%s", lines[2]);
+  check(function->process(0, lines[0], strlen(lines[0]), &datas) == 1, "%s", lines[0]);
+  check(datas[0]->data->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') +
+        " 2015-02-28T12:30:23 GET /api/user HTTP/1.1 500 0.005", "%s", PTRS(*datas[0]->data));
+  function->match_ = MatchExpr();
+}
+
 DEFINE(transform)
 {
   std::vector<FileRecord *> datas;
@@ -242,7 +637,7 @@ DEFINE(transform)
 
   function->transform(0, "[error] this", sizeof("[error] this")-1, &datas);
   check(datas.size() == 1, "data size %d", (int) datas.size());
-  check(*datas[0]->data == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " [error] this",
+  check(datas[0]->data->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " [error] this",
         "'%s'", PTRS(*datas[0]->data));
 
   datas.clear();
@@ -288,16 +683,55 @@ DEFINE(aggregate)
   check(datas.size() == 2, "%d", (int) datas.size());
 
   const char *msg = "2015-04-02T12:05:04 10086 reqt<0.1=1 reqt<0.3=1 size=500 status_200=2";
-  check(*datas[0]->data == cnf->host() + " " + msg, "%s", PTRS(*datas[0]->data));
+  check(datas[0]->data->str() == cnf->host() + " " + msg, "%s", PTRS(*datas[0]->data));
 
   msg = "2015-04-02T12:05:04 yuntu reqt<0.1=1 reqt<0.3=1 size=500 status_200=2";
-  check(*datas[1]->data == cnf->host() + " " + msg, "%s", PTRS(*datas[1]->data));
+  check(datas[1]->data->str() == cnf->host() + " " + msg, "%s", PTRS(*datas[1]->data));
 
   datas.clear();
   function->serializeCache(&datas);
   check(function->aggregateCache_.empty(), "cache size %d", (int) function->aggregateCache_.size());
 }
 
+DEFINE(luaFfi)
+{
+  std::vector<FileRecord *> datas;
+
+  LuaFunction *function = getLuaCtx("grep")->function();
+  std::string funName = function->funName_;
+  function->funName_ = "grepFfi";
+  function->out_.resize(16);
+
+  const char *line = "- - - [2015-04-02T12:05:05] \"GET / HTTP/1.0\" 200 - - 95555";
+  check(function->process(0, line, strlen(line), &datas) == 1, "%s", cnf->errbuf());
+  check(datas.size() == 1, "data size %d", (int) datas.size());
+  check(datas[0]->data->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " [2015-04-02T12:05:05] \"GET / HTTP/1.0\" 200 95555",
+        "%s", PTRS(*datas[0]->data));
+  function->funName_ = funName;
+  function->out_.clear();
+
+  LuaCtx *ctx = getLuaCtx("transform");
+  ctx->withhost_ = false;
+  function = ctx->function();
+  funName = function->funName_;
+  function->funName_ = "transformFfi";
+  function->out_.resize(16);
+
+  // in out, longer than out, skipped
+  std::string lines[] = {"[error] this", "[error] " + std::string(100, 'x'), "[debug] that"};
+  datas.clear();
+  for (int i = 0; i < 3; ++i) {
+    check(function->process(0, lines[i].data(), lines[i].size(), &datas) == (i < 2 ? 1 : 0), "%s", cnf->errbuf());
+  }
+  check(datas.size() == 2, "data size %d", (int) datas.size());
+  check(datas[0]->data->str() == lines[0], "%s", PTRS(*datas[0]->data));
+  check(datas[1]->data->str() == lines[1], "%s", PTRS(*datas[1]->data));
+
+  function->funName_ = funName;
+  function->out_.clear();
+  ctx->withhost_ = true;
+}
+
 DEFINE(initKafka)
 {
   check(cnf->initKafka(), "%s", cnf->errbuf());
@@ -376,7 +810,7 @@ DEFINE(initFileReader)
 
   std::string host(getenv("HOSTNAME"));
 
-  ctx->md5sum_ = false;
+  ctx->checksum_ = Checksum::NONE;
   std::string *s = ctx->fileReader_->buildFileStartRecord(now);
   std::string json = "#" + host + " {'time':'2018-02-13T11:48:57', 'event':'START'}";
   check(*s == util::replace(&json, '\'', '"'), "start record error %s != %s", PTRS(*s), PTRS(json));
@@ -408,7 +842,7 @@ DEFINE(watchLoop)
   LuaCtx *ctx = getLuaCtx("basic");
   ctx->withhost_ = true;
   ctx->autocreat_ = false;
-  ctx->md5sum_ = true;
+  ctx->checksum_ = Checksum::MD5;
 
   InotifyCtx inotify(cnf);
   check(inotify.init(), "%s", cnf->errbuf());
@@ -433,35 +867,30 @@ DEFINE(watchLoop)
   time_t renameStartTime = cnf->fasttime(true, TIMEUNIT_SECONDS);
   rename(LOG("basic.log"), LOG("basic.log.old"));
 
-  uintptr_t nptr;
-  read(cnf->accept, &nptr, sizeof(nptr));
-
   // ignore memory leak
-  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) nptr;
-  const std::string *ptr;
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  const RecordData *ptr;
 
   check(records->size() == 1, "%d", (int) records->size());
 
   ptr = records->at(0)->data;
-  check(ptr->find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
+  check(ptr->str().find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
-  records = (std::vector<FileRecord*>*) nptr;
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
 
   check(records->size() == 2, "%d", (int) records->size());
 
   ptr = records->at(0)->data;
-  check(*ptr == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " 456\n", "%s", PTRS(*ptr));
+  check(ptr->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " 456\n", "%s", PTRS(*ptr));
   ptr = records->at(1)->data;
-  check(*ptr == "*" + cnf->host() + "@" + util::toStr(sizeof("456\n"), PADDING_LEN) + " 789\n", "%s", PTRS(*ptr));
+  check(ptr->str() == "*" + cnf->host() + "@" + util::toStr(sizeof("456\n"), PADDING_LEN) + " 789\n", "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
-  records = (std::vector<FileRecord*>*) nptr;
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
 
   check(records->size() == 1, "%d", (int) records->size());
   ptr = records->at(0)->data;
-  check(ptr->find("\"event\":\"END\"") != std::string::npos, "%s", PTRS(*ptr));
-  check(ptr->find("\"md5\":\"7b88e495713969b037e50ca7b9b54af5\"") != std::string::npos, "%s", PTRS(*ptr));
+  check(ptr->str().find("\"event\":\"END\"") != std::string::npos, "%s", PTRS(*ptr));
+  check(ptr->str().find("\"md5\":\"7b88e495713969b037e50ca7b9b54af5\"") != std::string::npos, "%s", PTRS(*ptr));
 
   time_t renameEndTime = cnf->fasttime(true, TIMEUNIT_SECONDS);
   check(renameEndTime - renameStartTime >= cnf->rotateDelay_, "%d", (int) (renameEndTime - renameStartTime));
@@ -474,26 +903,760 @@ DEFINE(watchLoop)
   write(fd, "abcd\nefg\n", sizeof("abcd\nefg\n")-1);
   close(fd);
 
-  read(cnf->accept, &nptr, sizeof(nptr));
-  records = (std::vector<FileRecord *>*) nptr;
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
 
   check(records->size() == 1, "%d", (int) records->size());
 
   ptr = records->at(0)->data;
-  check(ptr->find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
+  check(ptr->str().find("\"event\":\"START\"") != std::string::npos, "%s", PTRS(*ptr));
 
-  read(cnf->accept, &nptr, sizeof(nptr));
-  records = (std::vector<FileRecord*>*) nptr;
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
 
   check(records->size() == 1, "%d", (int) records->size());
 
   ptr = records->at(0)->data;
-  check(*ptr == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " abcd\nefg\n", "%s", PTRS(*ptr));
+  check(ptr->str() == "*" + cnf->host() + "@" + std::string(PADDING_LEN, '0') + " abcd\nefg\n", "%s", PTRS(*ptr));
 
   runStatus->set(RunStatus::STOP);
   pthread_join(tid, 0);
 }
 
+DEFINE(mmapTail)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  ctx->rawcopy_ = false;
+
+  FileReader *reader = ctx->getFileReader();
+  reader->mmap_ = true;
+
+  off_t size = reader->size_;
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "123\n45", sizeof("123\n45")-1);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  off_t off = lseek(reader->fd_, 0, SEEK_CUR);
+  check(off == size + 4, "partial line must be left in file %d", (int) off);
+  check(reader->size_ == size + 4 && reader->tailBytes() == 4, "%d %d", (int) reader->size_, (int) reader->tailBytes());
+
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+
+  check(records->size() == 1, "%d", (int) records->size());
+  const RecordData *ptr = records->at(0)->data;
+  check(ptr->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " 123\n", "%s", PTRS(*ptr));
+
+  write(fd, "6\n", 2);
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  check(reader->size_ == size + 8, "%d", (int) reader->size_);
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+
+  check(records->size() == 1, "%d", (int) records->size());
+  ptr = records->at(0)->data;
+  check(ptr->str() == "*" + cnf->host() + "@" + util::toStr(size + 4, PADDING_LEN) + " 456\n", "%s", PTRS(*ptr));
+
+  reader->mmap_ = false;
+}
+
+// the partial line mmap leaves in the file is read again after the idle close
+DEFINE(mmapSleep)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  reader->mmap_ = true;
+
+  off_t size = reader->size_;
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "ab", 2);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  check(reader->size_ == size, "%d", (int) reader->size_);
+  check(reader->sleep() && reader->sleeping(), "%s", "sleep with partial line");
+  check(reader->wake() && reader->fd_ != -1, "%s", "wake");
+
+  write(fd, "c\n", 2);
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " abc\n",
+        "%s", PTRS(*records->at(0)->data));
+
+  reader->mmap_ = false;
+}
+
+// a copytruncate under the mmap scan is FILE_TRUNCATED, the truncated pages read as NULs
+DEFINE(mmapTruncate)
+{
+  LuaCtx *ctx = getLuaCtx("transform");
+  LuaFunction *function = ctx->function();
+  std::string funName = function->funName_;
+  function->funName_ = "transformTruncate";
+
+  FileReader *reader = ctx->getFileReader();
+  reader->mmap_ = true;
+
+  off_t size = reader->size_;
+  std::string data = "[error] truncate\n";
+  while (data.size() < 64 * 1024) data.append("[error] after the truncate\n");
+  int fd = open(LOG("transform.log"), O_WRONLY | O_APPEND);
+  write(fd, data.data(), data.size());
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  check(reader->flags_ & FILE_TRUNCATED, "%d", (int) reader->flags_);
+
+  if (size == 0) cnf->queue.pop();   // the start record of an empty file
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " [error] truncate",
+        "%s", PTRS(*records->at(0)->data));
+
+  // reopened from the start as remove() does for a truncated file
+  reader->flags_ &= ~FILE_TRUNCATED;
+  reader->size_ = 0;
+  lseek(reader->fd_, 0, SEEK_SET);
+
+  function->funName_ = funName;
+  reader->mmap_ = false;
+}
+
+// the last line without NL mmap left in the file is sent at END
+DEFINE(mmapEndLine)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  reader->mmap_ = true;
+
+  off_t size = reader->size_;
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "1\nxy", 4);
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka mmap");
+  check(reader->size_ == size + 2 && reader->partial_ == 2, "%d %d", (int) reader->size_, (int) reader->partial_);
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+
+  check(reader->tail2kafka(FileReader::END, 0, new std::string("#end")), "%s", "tail2kafka mmap END");
+  check(reader->size_ == size + 4 && reader->partial_ == 0, "%d %d", (int) reader->size_, (int) reader->partial_);
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size + 2, PADDING_LEN) + " xy\n",
+        "%s", PTRS(*records->at(0)->data));
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->at(0)->data->str() == "#end", "%s", PTRS(*records->at(0)->data));
+
+  reader->mmap_ = false;
+}
+
+DEFINE(growBuffer)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  check(reader->bufferSize_ == MIN_BUFFER_LEN, "%d", (int) reader->bufferSize_);
+  int64_t total = cnf->stats()->bufferSize();
+
+  off_t size = reader->size_;
+  std::string line(MIN_BUFFER_LEN + 100, 'x');
+  line.append(1, '\n');
+
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, line.data(), line.size());
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka long line");
+  check(reader->bufferSize_ == MIN_BUFFER_LEN * 2, "%d", (int) reader->bufferSize_);
+  check(cnf->stats()->bufferSize() == total + MIN_BUFFER_LEN, "%d", (int) cnf->stats()->bufferSize());
+
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " " + line,
+        "%d", (int) records->at(0)->data->size());
+
+  // the long line is in this window, keep the buffer
+  reader->bufferTime_ -= BUFFER_IDLE_TIMEOUT;
+  reader->shrinkBuffer();
+  check(reader->bufferSize_ == MIN_BUFFER_LEN * 2, "%d", (int) reader->bufferSize_);
+
+  reader->bufferTime_ -= BUFFER_IDLE_TIMEOUT;
+  reader->shrinkBuffer();
+  check(reader->bufferSize_ == MIN_BUFFER_LEN, "%d", (int) reader->bufferSize_);
+  check(cnf->stats()->bufferSize() == total, "%d", (int) cnf->stats()->bufferSize());
+}
+
+DEFINE(lineFragment)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+  size_t maxLineLen = reader->maxLineLen_;
+  size_t len = reader->bufferSize_;
+  reader->maxLineLen_ = len;
+
+  for (int m = 0; m < 2; ++m) {
+    reader->mmap_ = m == 1;
+
+    struct stat st;
+    stat(LOG("basic.log"), &st);
+    off_t size = st.st_size;
+
+    std::string a(len, 'a'), b(len, 'b'), c(100, 'c');
+    int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+    write(fd, a.data(), a.size());
+    write(fd, b.data(), b.size());
+    write(fd, c.data(), c.size());
+    write(fd, "\nabc\n", 5);
+    close(fd);
+
+    check(reader->tail2kafka(), "%s", "tail2kafka long line");
+    std::string prefix = "*" + cnf->host() + "@";
+
+    std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 1, "%d", (int) records->size());
+    check(records->at(0)->data->str() == prefix + util::toStr(size, PADDING_LEN) + ":0/0 " + a,
+          "%.*s", 40, records->at(0)->data->c_str());
+
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 1, "%d", (int) records->size());
+    check(records->at(0)->data->str() == prefix + util::toStr(size + len, PADDING_LEN) + ":1/0 " + b,
+          "%.*s", 40, records->at(0)->data->c_str());
+
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 2, "%d", (int) records->size());
+    check(records->at(0)->data->str() == prefix + util::toStr(size + len * 2, PADDING_LEN) + ":2/3 " + c + "\n",
+          "%s", PTRS(*records->at(0)->data));
+    check(records->at(1)->data->str() == prefix + util::toStr(size + len * 2 + 101, PADDING_LEN) + " abc\n",
+          "%s", PTRS(*records->at(1)->data));
+  }
+
+  reader->mmap_ = false;
+  reader->maxLineLen_ = maxLineLen;
+}
+
+DEFINE(transformBatch)
+{
+  LuaCtx *ctx = getLuaCtx("transform");
+  LuaFunction *function = ctx->function();
+  std::string funName = function->funName_;
+  function->funName_ = "transformBatch";
+  function->type_ = LuaFunction::TRANSFORM_BATCH;
+
+  FileReader *reader = ctx->getFileReader();
+  off_t size = reader->size_;
+  int fd = open(LOG("transform.log"), O_WRONLY | O_APPEND);
+  write(fd, "[error] a\n[info] b\n\n[error] c\n", sizeof("[error] a\n[info] b\n\n[error] c\n")-1);
+  close(fd);
+
+  check(reader->tail2kafka(), "%s", "tail2kafka batch");
+  if (size == 0) cnf->queue.pop();   // the start record of an empty file
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 2, "%d", (int) records->size());
+
+  // each record has the off of its line, not of the batch
+  std::string prefix = "*" + cnf->host() + "@";
+  check(records->at(0)->off == size && records->at(0)->data->str() == prefix + util::toStr(size, PADDING_LEN) + " [error] a",
+        "%s", PTRS(*records->at(0)->data));
+  check(records->at(1)->off == size + 20 && records->at(1)->data->str() == prefix + util::toStr(size + 20, PADDING_LEN) + " [error] c",
+        "%s", PTRS(*records->at(1)->data));
+  check(reader->size_ == size + 30, "%d", (int) reader->size_);
+
+  function->funName_ = funName;
+  function->type_ = LuaFunction::TRANSFORM;
+}
+
+DEFINE(nulSkip)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  for (int m = 0; m < 2; ++m) {
+    reader->mmap_ = m == 1;
+    int64_t skip = cnf->stats()->nulSkip();
+
+    struct stat st;
+    stat(LOG("basic.log"), &st);
+    off_t size = st.st_size;
+
+    // a torn line, the hole of a crash, lines again, then preallocated
+    int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+    write(fd, "12", 2);
+    ftruncate(fd, size + 2 + 8192);
+    write(fd, "abc\n", 4);
+    ftruncate(fd, size + 8198 + 4096);
+
+    check(reader->tail2kafka(), "%s", "tail2kafka NUL");
+    check(cnf->stats()->nulSkip() == skip + 8192, "%d", (int) (cnf->stats()->nulSkip() - skip));
+    check(lseek(reader->fd_, 0, SEEK_CUR) == size + 8198, "trailing NUL must be left %d",
+          (int) lseek(reader->fd_, 0, SEEK_CUR));
+
+    std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 1, "%d", (int) records->size());
+    check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size + 8194, PADDING_LEN) + " abc\n",
+          "%s", PTRS(*records->at(0)->data));
+
+    // written at last, pwrite of O_APPEND appends
+    close(fd);
+    fd = open(LOG("basic.log"), O_WRONLY);
+    pwrite(fd, "def\n", 4, size + 8198);
+    check(reader->tail2kafka(), "%s", "tail2kafka NUL");
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 1, "%d", (int) records->size());
+    check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size + 8198, PADDING_LEN) + " def\n",
+          "%s", PTRS(*records->at(0)->data));
+
+    ftruncate(fd, size + 8202);
+    close(fd);
+  }
+  reader->mmap_ = false;
+}
+
+DEFINE(tailBudget)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  off_t size = reader->size_;
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "123\n456\n", 8);
+  close(fd);
+
+  reader->setTailBudget(4);
+  check(!reader->tail2kafka(), "%s", "tail2kafka with budget stops before eof");
+  check(reader->tailBytes() == 4, "%d", (int) reader->tailBytes());
+
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " 123\n",
+        "%s", PTRS(*records->at(0)->data));
+
+  // budget is for one call only
+  check(reader->tail2kafka(), "%s", "tail2kafka the rest");
+  check(reader->tailBytes() == 4 && reader->eof(), "%d", (int) reader->tailBytes());
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size + 4, PADDING_LEN) + " 456\n",
+        "%s", PTRS(*records->at(0)->data));
+}
+
+DEFINE(prefetch)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  off_t size = reader->size_;
+  std::string line(1023, 'p');
+  line.append(1, '\n');
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  for (int i = 0; i < 16; ++i) write(fd, line.data(), line.size());
+  close(fd);
+
+  // 4k a call, 16k behind
+  cnf->prefetch_ = 8192;
+  off_t prefetchOff[] = {size + 8192, size + 12288, size + 12288, size + 12288};
+  for (int i = 0; i < 4; ++i) {
+    reader->setTailBudget(4096);
+    check(reader->tail2kafka() == (i == 3), "%d", i);
+    check(reader->behind_ == (i < 2), "%d behind", i);
+    check(reader->prefetchOff_ == prefetchOff[i], "%d %ld", i, (long) (reader->prefetchOff_ - size));
+
+    std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+    check(records->size() == 4, "%d", (int) records->size());
+    check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size + i * 4096, PADDING_LEN) + " " + line,
+          "%s", PTRS(*records->at(0)->data));
+  }
+  cnf->prefetch_ = 0;
+}
+
+DEFINE(topicCongestion)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  off_t size = reader->size_;
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "789\n", 4);
+  close(fd);
+
+  // acks of basic fall behind, other files go on
+  ctx->queueSizeInc(1, MAX_TOPIC_QUEUE_BYTES + 1);
+  check(!reader->tail2kafka(), "%s", "tail2kafka congested");
+  check(reader->tailBytes() == 0 && !reader->eof(), "%d", (int) reader->tailBytes());
+  check(cnf->tailBlocked(), "%s", "basic is congested");
+  check(!getLuaCtx("filter")->getFileReader()->flowControlOn(), "%s", "filter is not congested");
+
+  ctx->queueSizeDec(1, MAX_TOPIC_QUEUE_BYTES + 1);
+  check(!cnf->tailBlocked(), "%s", "basic is drained");
+
+  uint64_t n;
+  check(read(cnf->tailWakeFd(), &n, sizeof(n)) == sizeof(n), "%s", "tail is waked up");
+
+  check(reader->tail2kafka(), "%s", "tail2kafka after drain");
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 1, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(size, PADDING_LEN) + " 789\n",
+        "%s", PTRS(*records->at(0)->data));
+}
+
+DEFINE(coalesce)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  cnf->pollLimit_ = 50;
+
+  InotifyCtx inotify(cnf);
+  check(inotify.init(), "%s", cnf->errbuf());
+  check(inotify.initEpoll(), "%s", cnf->errbuf());
+
+  // a cheap read, the next one goes at once
+  int64_t now = cnf->fasttime(true, TIMEUNIT_MILLI);
+  inotify.sched_[ctx].tailTime = now;
+  inotify.ready(ctx, true);
+  check(inotify.ready_.size() == 1 && inotify.deferred_.empty(), "%d", (int) inotify.ready_.size());
+
+  // a 2ms read, writes in the next 20ms are coalesced
+  inotify.ready_.clear();
+  inotify.sched_[ctx].ready = false;
+  inotify.sched_[ctx].tailCost = 2000;
+  inotify.ready(ctx, true);
+  check(inotify.ready_.empty() && inotify.deferred_.size() == 1, "%d", (int) inotify.deferred_.size());
+  check(inotify.sched_[ctx].deferTime == now + 20, "%d", (int) (inotify.sched_[ctx].deferTime - now));
+
+  inotify.expireDeferred(now + 10);
+  check(inotify.ready_.empty(), "%d", (int) inotify.ready_.size());
+  inotify.expireDeferred(now + 20);
+  check(inotify.ready_.size() == 1 && inotify.deferred_.empty(), "%d", (int) inotify.ready_.size());
+}
+
+DEFINE(rotateCheck)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+
+  InotifyCtx inotify(cnf);
+  check(inotify.init(), "%s", cnf->errbuf());
+  check(inotify.initEpoll(), "%s", cnf->errbuf());
+
+  // checked at the first tick, then backs off while idle
+  int64_t checks = cnf->stats()->rotateCheck();
+  std::vector<uint64_t> ticks;
+  for (int i = 0; i < 40; ++i) {
+    if (inotify.sched_[ctx].checkTick == inotify.wheelTick_ + 1) ticks.push_back(inotify.wheelTick_ + 1);
+    inotify.tryRmWatch();
+  }
+  check(ticks.size() == 5 && ticks[0] == 1 && ticks[1] == 3 && ticks[2] == 7 && ticks[3] == 15 && ticks[4] == 31,
+        "%d %d", (int) ticks.size(), ticks.empty() ? 0 : (int) ticks.back());
+  check(inotify.sched_[ctx].checkInterval == 32, "%d", inotify.sched_[ctx].checkInterval);
+  check(cnf->stats()->rotateCheck() >= checks + 5, "%d", (int) (cnf->stats()->rotateCheck() - checks));
+
+  // a write brings it back to the next tick
+  int fd = open(LOG("basic.log"), O_WRONLY | O_APPEND);
+  write(fd, "rotate\n", 7);
+  close(fd);
+  inotify.readEvents();
+  check(inotify.sched_[ctx].checkInterval == 1 && inotify.sched_[ctx].checkTick == inotify.wheelTick_ + 1,
+        "%d", inotify.sched_[ctx].checkInterval);
+  inotify.drain();
+  cnf->queue.pop();
+}
+
+DEFINE(gzipHistory)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  // logrotate mv basic.log basic.log.1, then compress it
+  gzFile gz = gzopen(LOG("basic.log.1.gz"), "wb");
+  gzwrite(gz, "123\n456\n", 8);
+  gzclose(gz);
+
+  check(ctx->addHistoryFile(LOG("basic.log.1")), "%s", "add history file");
+  close(reader->fd_);
+  reader->fd_ = -1;
+  reader->flags_ = FILE_HISTORY | FILE_OPENONLY | FILE_WATCHED;
+
+  reader->reinit();
+  check(ctx->datafile() == LOG("basic.log.1.gz"), "%s", ctx->datafile().c_str());
+  check(reader->zfile_ && reader->size_ == 8, "%d", (int) reader->size_);
+
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();  // start record
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 2, "%d", (int) records->size());
+  const RecordData *ptr = records->at(1)->data;
+  check(ptr->str() == "*" + cnf->host() + "@" + util::toStr(4, PADDING_LEN) + " 456\n", "%s", PTRS(*ptr));
+
+  reader->remove();
+  check(!reader->zfile_ && reader->fd_ == -1, "%d", reader->fd_);
+  check(ctx->datafile() == ctx->file(), "%s", ctx->datafile().c_str());
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();  // end record
+
+  reader->reinit();
+  check(reader->fd_ != -1, "%s", "reopen basic.log");
+  unlink(LOG("basic.log.1.gz"));
+}
+
+DEFINE(compressHalfway)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  FileReader *reader = ctx->getFileReader();
+
+  // basic.log.1 is read as a history file, its lines are sent
+  int fd = creat(LOG("basic.log.1"), 0644);
+  write(fd, "h1\nh2\n", 6);
+  close(fd);
+
+  check(ctx->addHistoryFile(LOG("basic.log.1")), "%s", "add history file");
+  close(reader->fd_);
+  reader->fd_ = -1;
+  reader->flags_ = FILE_HISTORY | FILE_OPENONLY | FILE_WATCHED;
+
+  reader->reinit();
+  check(ctx->datafile() == LOG("basic.log.1") && !reader->zfile_, "%s", ctx->datafile().c_str());
+  // records left by the tests before go first
+  std::vector<FileRecord *> *records;
+  do {
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  } while (records->at(0)->data->str().find(" h1\n") == std::string::npos);
+  check(records->size() == 2, "%d", (int) records->size());
+  for (size_t i = 0; i < records->size(); ++i) reader->updateFileOffRecord(records->at(i));
+  off_t off = reader->fileOffRecord_->off;
+  check(off == 3, "%d", (int) off);
+
+  // h3 is written before logrotate compresses it, the new inode is not in fileoff
+  gzFile gz = gzopen(LOG("basic.log.1.gz"), "wb");
+  gzwrite(gz, "h1\nh2\nh3\n", 9);
+  gzclose(gz);
+  unlink(LOG("basic.log.1"));
+
+  close(reader->fd_);
+  reader->fd_ = -1;
+  reader->flags_ = FILE_HISTORY | FILE_OPENONLY | FILE_WATCHED;
+
+  reader->reinit();
+  check(ctx->datafile() == LOG("basic.log.1.gz") && reader->zfile_, "%s", ctx->datafile().c_str());
+  check(ctx->compressedInode() == reader->fileOffRecord_->inode, "%ld", (long) ctx->compressedInode());
+  check(reader->size_ == 9, "%d", (int) reader->size_);
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();  // no start record, the stream goes on
+  check(records->size() == 2, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(off, PADDING_LEN) + " h2\n",
+        "%s", PTRS(*records->at(0)->data));
+  check(records->at(1)->data->str() == "*" + cnf->host() + "@" + util::toStr(off + 3, PADDING_LEN) + " h3\n",
+        "%s", PTRS(*records->at(1)->data));
+
+  reader->remove();
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();  // end record
+  reader->reinit();
+  check(reader->fd_ != -1, "%s", "reopen basic.log");
+  unlink(LOG("basic.log.1.gz"));
+}
+
+DEFINE(globWatch)
+{
+  mkdir(LOG("glob"), 0755);
+  mkdir(LOG("glob/a"), 0755);
+  int fd = creat(LOG("glob/a/access.log"), 0644);
+  write(fd, "a1\n", 3);
+  close(fd);
+
+  const char *lua = "topic = 'glob'\nfile = 'logs/glob/*/access.log'\nfileWithGlob = true\n";
+  fd = creat(LOG("glob.lua"), 0644);
+  write(fd, lua, strlen(lua));
+  close(fd);
+
+  LuaCtx *glob = LuaCtx::loadFile(cnf, LOG("glob.lua"));
+  check(glob && glob->fileWithGlob(), "%s", cnf->errbuf());
+  cnf->addLuaCtx(glob);
+  check(cnf->getGlobCtxs().size() == 1, "%d", (int) cnf->getGlobCtxs().size());
+
+  InotifyCtx inotify(cnf);
+  check(inotify.init(), "%s", cnf->errbuf());
+
+  // matched before fork, the reader comes with the others
+  LuaCtx *a = cnf->getGlobFile(LOG("glob/a/access.log"));
+  check(a && a->globTemplate() == glob && !a->getFileReader(), "%s", "instance of a/access.log");
+  check(a->fileAlias_ == "glob.logs_glob_a_access.log", "%s", PTRS(a->fileAlias_));
+  check(cnf->initFileReader(a), "%s", cnf->errbuf());
+  check(inotify.initEpoll(), "%s", cnf->errbuf());
+
+  inotify.ready(a, false);
+  inotify.drain();
+  // records left by the tests before go first
+  std::vector<FileRecord *> *records;
+  do {
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  } while (records->at(0)->data->str().find(" a1\n") == std::string::npos);
+
+  // a directory and a file created while running
+  mkdir(LOG("glob/b"), 0755);
+  fd = creat(LOG("glob/b/access.log"), 0644);
+  write(fd, "b1\n", 3);
+  close(fd);
+
+  inotify.readEvents();
+  LuaCtx *b = cnf->getGlobFile(LOG("glob/b/access.log"));
+  check(b && b->getFileReader() && inotify.sched_[b].ready, "%s", "instance of b/access.log");
+  inotify.drain();
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();  // start record
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->at(0)->data->str().find(" b1\n") != std::string::npos, "%s", PTRS(*records->at(0)->data));
+
+  // a is idle, over maxopenfiles it is closed, IN_MODIFY opens it again
+  cnf->maxOpenFiles_ = 1;
+  inotify.sched_[a].tailTime = 0;
+  inotify.globalCheck();
+  check(a->getFileReader()->sleeping() && a->getFileReader()->fd_ == -1, "%d", a->getFileReader()->fd_);
+  check(!b->getFileReader()->sleeping() && inotify.active_.size() == 1, "%d", (int) inotify.active_.size());
+
+  fd = open(LOG("glob/a/access.log"), O_WRONLY | O_APPEND);
+  write(fd, "a2\n", 3);
+  close(fd);
+
+  inotify.readEvents();
+  check(!a->getFileReader()->sleeping() && a->getFileReader()->fd_ != -1, "%d", a->getFileReader()->fd_);
+  inotify.drain();
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(3, PADDING_LEN) + " a2\n",
+        "%s", PTRS(*records->at(0)->data));
+
+  // closed again, the write, the rename and the new file come in one batch: IN_MODIFY
+  // finds the new file by the name, the rest of the old inode is read under its new name
+  ino_t inode = a->getFileReader()->inode_;
+  check(a->getFileReader()->sleep(), "%s", "sleep a");
+  inotify.sleeping_++;
+
+  fd = open(LOG("glob/a/access.log"), O_WRONLY | O_APPEND);
+  write(fd, "a3\n", 3);
+  close(fd);
+  rename(LOG("glob/a/access.log"), LOG("glob/a/access.log.1"));
+  fd = creat(LOG("glob/a/access.log"), 0644);
+  write(fd, "n1\n", 3);
+  close(fd);
+
+  inotify.readEvents();
+  check(!a->getFileReader()->sleeping() && a->getFileReader()->inode_ == inode, "%ld", (long) a->getFileReader()->inode_);
+  inotify.drain();
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->at(0)->data->str() == "*" + cnf->host() + "@" + util::toStr(6, PADDING_LEN) + " a3\n",
+        "%s", PTRS(*records->at(0)->data));
+
+  cnf->maxOpenFiles_ = 0;
+  unlink(LOG("glob/a/access.log.1"));
+  unlink(LOG("glob/a/access.log"));
+  unlink(LOG("glob/b/access.log"));
+  rmdir(LOG("glob/a"));
+  rmdir(LOG("glob/b"));
+  rmdir(LOG("glob"));
+  unlink(LOG("glob.lua"));
+}
+
+DEFINE(catchupHistory)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+
+  // kafka was down, basic.log.1 is being read, .2 and .3 wait
+  gzFile gz = gzopen(LOG("basic.log.3.gz"), "wb");
+  gzwrite(gz, "y1\ny2\n", 6);
+  gzclose(gz);
+
+  ctx->fqueue_.clear();
+  ctx->fqueue_.push_back(LOG("basic.log.1"));
+  ctx->fqueue_.push_back(LOG("basic.log.2"));
+  ctx->fqueue_.push_back(LOG("basic.log.3"));
+
+  std::vector<std::string> files;
+  check(ctx->catchupHistoryFiles(&files), "%s", "catchup history files");
+  check(files.size() == 2 && ctx->fqueue_.size() == 1, "%d", (int) ctx->fqueue_.size());
+  check(ctx->loadHistoryFile(), "%s", cnf->errbuf());
+  check(ctx->cqueue_.size() == 2 && ctx->fqueue_.size() == 1, "%d", (int) ctx->cqueue_.size());
+
+  // logrotate compressed .3 after it was queued, it keeps its name
+  InotifyCtx inotify(cnf);
+  InotifyCtx::CatchupFile file(ctx, LOG("basic.log.3"));
+  file.ctx = cnf->addCatchupFile(ctx, file.file);
+  check(file.ctx && file.ctx->file() == LOG("basic.log.3.gz"), "%s", cnf->errbuf());
+  check(file.ctx->host() == cnf->host() + ".basic.log.3", "%s", PTRS(file.ctx->host()));
+
+  file.fileOff = cnf->getFileOff()->alloc();
+  file.ctx->getFileReader()->initFileOffRecord(file.fileOff);
+  file.state = InotifyCtx::CATCHUP_RUN;
+  inotify.catchupRead(&file);
+  check(file.state == InotifyCtx::CATCHUP_END && file.ctx->getFileReader()->fd_ == -1, "%d", file.state);
+
+  std::string host = file.ctx->host();
+  std::vector<FileRecord *> *records;
+  do {
+    records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  } while (records->at(0)->data->str().find("#" + host + " ") != 0);  // start record
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 2, "%d", (int) records->size());
+  check(records->at(1)->data->str() == "*" + host + "@" + util::toStr(3, PADDING_LEN) + " y2\n",
+        "%s", PTRS(*records->at(1)->data));
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  const std::string end = records->at(0)->data->str();
+  check(end.find("\"event\":\"END\", \"file\":\"" LOG("basic.log.3.gz") "\", \"size\":6") != std::string::npos,
+        "%s", end.c_str());
+
+  cnf->getFileOff()->release(file.fileOff);
+  cnf->dropCatchupFile(file.ctx);
+  ctx->removeCatchupFile(LOG("basic.log.2"));
+  ctx->removeCatchupFile(LOG("basic.log.3"));
+  check(ctx->cqueue_.empty(), "%d", (int) ctx->cqueue_.size());
+  check(ctx->removeHistoryFile(), "%s", "history is empty");
+  unlink(LOG("basic.log.3.gz"));
+}
+
+DEFINE(backfillChunk)
+{
+  LuaCtx *ctx = getLuaCtx("basic");
+  const char *file = LOG("basic.log.4");
+
+  std::string data;
+  for (int i = 0; i < 10; ++i) data.append("line" + util::toStr(i) + "\n");
+  int fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  check(write(fd, data.data(), data.size()) == (ssize_t) data.size(), "%s", "write basic.log.4");
+  close(fd);
+
+  // bounds move on to line starts
+  std::vector<off_t> bounds;
+  check(sys::splitLines(file, 0, -1, 3, &bounds, cnf->errbuf()), "%s", cnf->errbuf());
+  check(bounds.size() == 4 && bounds[1] == 24 && bounds[2] == 42 && bounds[3] == 60, "%d", (int) bounds.size());
+  check(sys::splitLines(file, 3, 33, 2, &bounds, cnf->errbuf()), "%s", cnf->errbuf());
+  check(bounds.size() == 3 && bounds[0] == 6 && bounds[1] == 18 && bounds[2] == 36, "%d", (int) bounds.size());
+  check(sys::splitLines(file, 0, -1, 100, &bounds, cnf->errbuf()) && bounds.size() == 11, "%d", (int) bounds.size());
+
+  // the middle chunk, no START, END at the chunk end
+  InotifyCtx inotify(cnf);
+  InotifyCtx::CatchupFile chunk(ctx, file);
+  chunk.ctx = cnf->addCatchupFile(ctx, file, 1);
+  check(chunk.ctx && chunk.ctx->host() == cnf->host() + ".basic.log.4.1", "%s", cnf->errbuf());
+  check(chunk.ctx->getFileReader()->setRange(24, 42), "%s", "set range");
+
+  chunk.fileOff = cnf->getFileOff()->alloc();
+  chunk.ctx->getFileReader()->initFileOffRecord(chunk.fileOff);
+  chunk.state = InotifyCtx::CATCHUP_RUN;
+  inotify.catchupRead(&chunk);
+  check(chunk.state == InotifyCtx::CATCHUP_END, "%d", chunk.state);
+
+  std::string host = chunk.ctx->host();
+  std::vector<FileRecord *> *records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  check(records->size() == 3, "%d", (int) records->size());
+  check(records->at(0)->data->str() == "*" + host + "@" + util::toStr(24, PADDING_LEN) + " line4\n",
+        "%s", PTRS(*records->at(0)->data));
+
+  records = (std::vector<FileRecord*>*) cnf->queue.pop();
+  const std::string end = records->at(0)->data->str();
+  check(end.find("\"event\":\"END\", \"file\":\"" LOG("basic.log.4") "\", \"size\":42") != std::string::npos,
+        "%s", end.c_str());
+
+  cnf->getFileOff()->release(chunk.fileOff);
+  cnf->dropCatchupFile(chunk.ctx);
+  unlink(file);
+}
+
 static const char *files[] = {
   LOG("basic.log"),
   LOG("filter.log"),
@@ -528,20 +1691,48 @@ int main()
 
   TEST(split);
   TEST(split_n);
+  TEST(splitSpans);
+  TEST(splitFuzz);
   TEST(iso8601);
+  TEST(timeCache);
+  TEST(indexLines);
+  TEST(mpscQueue);
+  TEST(recordArena);
+  TEST(checksum);
+  TEST(zfile);
 
   TEST(loadCnf);
   TEST(loadLuaCtx);
   TEST(filter);
   TEST(grep);
+  TEST(matchExpr);
   TEST(transform);
   TEST(aggregate);
+  TEST(luaFfi);
 
   TEST(initKafka);
   TEST(initFileOff);
   TEST(initFileReader);
   TEST(reinitFileOff);
   TEST(watchLoop);
+  TEST(mmapTail);
+  TEST(mmapSleep);
+  TEST(mmapTruncate);
+  TEST(mmapEndLine);
+  TEST(growBuffer);
+  TEST(lineFragment);
+  TEST(transformBatch);
+  TEST(nulSkip);
+  TEST(tailBudget);
+  TEST(prefetch);
+  TEST(topicCongestion);
+  TEST(coalesce);
+  TEST(rotateCheck);
+  TEST(gzipHistory);
+  TEST(compressHalfway);
+  TEST(globWatch);
+  TEST(catchupHistory);
+  TEST(backfillChunk);
 
   DO(clean);
 
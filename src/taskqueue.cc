@@ -32,13 +32,10 @@ void TaskQueue::run()
 
   while (true) {
     pthread_mutex_lock(&mutex_);
+    while (tasks_.empty() && !quit_) pthread_cond_wait(&cond_, &mutex_);
     if (tasks_.empty()) {
-      if (!quit_) {
-        pthread_cond_wait(&cond_, &mutex_);
-      } else {
-        pthread_mutex_unlock(&mutex_);
-        break;
-      }
+      pthread_mutex_unlock(&mutex_);
+      break;
     }
 
     Task *task = tasks_.front();
@@ -11,6 +11,8 @@
 #include "sys.h"
 #include "transform.h"
 
+#define MAX_MIRROR_CACHE_BYTES (64 * 1024 * 1024)  // of a host, fragments of a long line flush on
+
 Transform::~Transform() {}
 uint32_t Transform::timeout(uint64_t * /*offsetPtr*/) { return IGNORE; }
 
@@ -99,6 +101,9 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
   else if (flag == '#') info->type = META;
   else info->type = MSG;
 
+  info->fragIndex = -1;
+  info->fragTotal = 0;
+
   char *spacePos = 0;
   if (info->type == META || info->type == NMSG) {
     spacePos = (char *) memchr(payload, ' ', len);
@@ -110,7 +115,18 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
       char *atPos = (char *) memchr(payload, '@', spacePos - payload);
       if (!atPos) return false;
       info->host.assign(payload+1, atPos - (payload+1));
-      info->pos = util::toLong(atPos+1, spacePos - (atPos+1));
+
+      // *host@off:index/total a fragment
+      char *colonPos = (char *) memchr(atPos, ':', spacePos - atPos);
+      char *slashPos = colonPos ? (char *) memchr(colonPos, '/', spacePos - colonPos) : 0;
+      if (colonPos && !slashPos) return false;
+
+      char *posEnd = colonPos ? colonPos : spacePos;
+      info->pos = util::toLong(atPos+1, posEnd - (atPos+1));
+      if (colonPos) {
+        info->fragIndex = util::toLong(colonPos+1, slashPos - (colonPos+1));
+        info->fragTotal = util::toLong(slashPos+1, spacePos - (slashPos+1));
+      }
     }
   }
 
@@ -129,6 +145,18 @@ bool MessageInfo::extract(const char *payload, size_t len, MessageInfo *info, bo
 
     Json::Value &val = root["md5"];
     if (!val.isNull()) info->md5  = val.asString();
+
+    Json::Value &alg = root["checksumalg"];
+    if (!alg.isNull()) {
+      info->checksumAlg = alg.asString();
+      info->checksum    = root["checksum"].asString();
+    } else if (!info->md5.empty()) {
+      info->checksumAlg = "md5";
+      info->checksum    = info->md5;
+    } else {
+      info->checksumAlg.clear();
+      info->checksum.clear();
+    }
   } else if (info->type == NMSG) {
     info->ptr = spacePos + 1;
     if (nonl && payload[len-1] == '\n') {
@@ -161,11 +189,20 @@ void MirrorTransform::addToCache(rd_kafka_message_t *rkm, const MessageInfo &inf
               rkm->offset, (int) rkm->len, (char *) rkm->payload);
   }
 
+  // fragments are appended as they come, the line is never held whole
+  int fragIndex = std::max(info.fragIndex, 0);
+  if (fragIndex != fdCache.fragNext) {
+    log_error(0, "%s:%d %s@%ld fragment %d, expect %d, the long line is torn", topic_, partition_,
+              info.host.c_str(), info.pos, fragIndex, fdCache.fragNext);
+  }
+  fdCache.fragNext = info.fragIndex >= 0 && info.fragTotal == 0 ? info.fragIndex + 1 : 0;
+
   fdCache.pos = info.pos;
   if (!fdCache.rkms) fdCache.rkms = new rd_kafka_message_t*[IOV_MAX];
 
   struct iovec iov = { (void *) info.ptr, static_cast<size_t>(info.len) };
   fdCache.iovs.push_back(iov);
+  fdCache.bytes += info.len;
   fdCache.rkms[fdCache.rkmSize++] = rkm;
 }
 
@@ -174,7 +211,8 @@ bool MirrorTransform::flushCache(bool eof, const std::string &host)
   bool flush = false;
   for (std::map<std::string, FdCache>::iterator ite = fdCache_.begin(); ite != fdCache_.end(); ++ite) {
     FdCache &fdCache = ite->second;
-    if (!(fdCache.rkmSize == IOV_MAX || (eof && host == ite->first))) continue;
+    if (!(fdCache.rkmSize == IOV_MAX || fdCache.bytes >= MAX_MIRROR_CACHE_BYTES ||
+          (eof && host == ite->first))) continue;
 
     flush = true;
     if (fdCache.fd < 0) {
@@ -240,7 +278,8 @@ uint32_t MirrorTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
       exit(EXIT_FAILURE);
     } else {
       log_info(0, "%s:%d rename %s to %s", topic_, partition_, opath, npath);
-      if (notify_) notify_->exec(npath, info.file.c_str(), -1, info.size, info.md5.c_str());
+      if (notify_) notify_->exec(npath, info.file.c_str(), -1, info.size, info.checksum.c_str(),
+                                 info.checksumAlg.c_str());
     }
     ide = GLOBAL | RKMFREE;
   }
@@ -556,34 +595,41 @@ bool LuaTransform::fieldsToJson(
   return true;
 }
 
+/* fields are split as spans and checked first, a bad line never allocates its fields */
 bool LuaTransform::parseFields(const char *ptr, size_t len, std::vector<std::string> *fields, time_t *timestamp)
 {
+  spans_.clear();
   if (inputFormat_ == TSV) {
-    splitn(ptr, len, fields, -1, '\t');
+    splitnSpans(ptr, len, &spans_, -1, '\t');
   } else {
-    split(ptr, len, fields);
+    splitSpans(ptr, len, &spans_);
   }
 
-  if (fields->size() != fields_.size()) {
+  if (spans_.size() != fields_.size() * 2) {
     log_error(0, "%s:%d invalid field size %.*s", topic_, partition_, static_cast<int>(len), ptr);
     return false;
   }
 
+  const char *timeField = ptr + spans_[timeLocalIndex_ * 2];
+  size_t ntimeField = spans_[timeLocalIndex_ * 2 + 1];
+  std::string isoTime;
   if (timestampFormat_ == TIMELOCAL) {
-    std::string isoTime;
-    if (!timeLocalToIso8601(fields->at(timeLocalIndex_), &isoTime, timestamp)) {
+    if (!timeLocalToIso8601(timeField, ntimeField, &isoTime, timestamp)) {
       log_error(0, "%s:%d invalid timestamp %.*s", topic_, partition_, static_cast<int>(len), ptr);
       return false;
     }
-    if (timeLocalFormat_ == "iso8601") (*fields)[timeLocalIndex_] = isoTime;
   } else if (timestampFormat_ == ISO8601) {
-    if (!parseIso8601(fields->at(timeLocalIndex_), timestamp)) {
+    if (!parseIso8601(timeField, ntimeField, timestamp)) {
       log_error(0, "%s:%d invalid timestamp %.*s", topic_, partition_, static_cast<int>(len), ptr);
       return false;
     }
   } else {
     assert(0);
   }
+
+  fields->reserve(fields_.size());
+  for (size_t i = 0; i < spans_.size(); i += 2) fields->push_back(std::string(ptr + spans_[i], spans_[i+1]));
+  if (timestampFormat_ == TIMELOCAL && timeLocalFormat_ == "iso8601") (*fields)[timeLocalIndex_] = isoTime;
   return true;
 }
 
@@ -600,6 +646,11 @@ uint32_t LuaTransform::write(rd_kafka_message_t *rkm, uint64_t *offsetPtr)
     log_info(0, "%s:%d META %lu %.*s", topic_, partition_, offset, (int) rkm->len, (char *) rkm->payload);
     return IGNORE | RKMFREE;
   }
+  if (info.fragIndex >= 0) {
+    log_error(0, "%s:%d %s@%ld fragment %d of a long line, skip", topic_, partition_,
+              info.host.c_str(), info.pos, info.fragIndex);
+    return IGNORE | RKMFREE;
+  }
 
   std::vector<std::string> fields;
   time_t timestamp;
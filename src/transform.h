@@ -20,10 +20,14 @@ struct MessageInfo {
 
   std::string host;
   long pos;
+  int  fragIndex;   // -1 a whole line, or a piece of a line longer than maxlinelen
+  int  fragTotal;   // 0 while more pieces follow, fragIndex+1 on the last one
 
   std::string file;
   size_t size;
   std::string md5;
+  std::string checksum;
+  std::string checksumAlg;   // md5 if the producer only knows md5
 
   const char *ptr;
   int len;
@@ -64,12 +68,14 @@ public:
   struct FdCache {
     int                       fd;
     std::vector<struct iovec> iovs;
+    size_t                    bytes;
+    int                       fragNext;  // the fragment expected next, 0 a whole line
 
     long                 pos;
     size_t               rkmSize;
     rd_kafka_message_t **rkms;
 
-    FdCache() : fd(-1), pos(-1), rkmSize(0), rkms(0) {}
+    FdCache() : fd(-1), bytes(0), fragNext(0), pos(-1), rkmSize(0), rkms(0) {}
 
     ~FdCache() {
       assert(rkmSize == 0);
@@ -82,6 +88,7 @@ public:
       pos = -1;
       rkmSize = 0;
       iovs.clear();
+      bytes = 0;
     }
   };
 
@@ -163,6 +170,7 @@ private:
   Format inputFormat_;
 
   std::vector<std::string> fields_;
+  std::vector<uint32_t> spans_;   // of the message being parsed
   TimeFormat timestampFormat_;
   size_t timeLocalIndex_;
   int requestIndex_;
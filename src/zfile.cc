@@ -0,0 +1,175 @@
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "logger.h"
+#include "zfile.h"
+
+#define ZFILE_INPUT_LEN (128 * 1024)
+#define ZFILE_SKIP_LEN  (64 * 1024)
+
+ZFile::Type ZFile::detect(int fd)
+{
+  unsigned char magic[4];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return GZIP;
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return ZSTD;
+  return NONE;
+}
+
+const char *ZFile::typeToString(Type type)
+{
+  if (type == GZIP) return "gzip";
+  else if (type == ZSTD) return "zstd";
+  else return "none";
+}
+
+off_t ZFile::skip(off_t off)
+{
+  char buffer[ZFILE_SKIP_LEN];
+  while (off_ < off) {
+    size_t n = std::min(off - off_, (off_t) sizeof(buffer));
+    if (read(buffer, n) == 0) break;
+  }
+  return off_;
+}
+
+class GzipFile : public ZFile {
+public:
+  GzipFile(const std::string &file) : ZFile(file), gz_(0) {}
+  ~GzipFile() { if (gz_) gzclose(gz_); }
+
+  bool init(int fd) {
+    // gzclose closes the fd
+    int dfd = dup(fd);
+    if (dfd == -1) {
+      log_fatal(errno, "%s dup error", file_.c_str());
+      return false;
+    }
+
+    gz_ = gzdopen(dfd, "rb");
+    if (!gz_) {
+      log_fatal(errno, "%s gzdopen error", file_.c_str());
+      close(dfd);
+      return false;
+    }
+    gzbuffer(gz_, ZFILE_INPUT_LEN);
+    return true;
+  }
+
+  ssize_t read(char *buffer, size_t n) {
+    if (eof_) return 0;
+
+    int nn = gzread(gz_, buffer, n);
+    if (nn > 0) {
+      off_ += nn;
+      return nn;
+    }
+
+    if (nn == -1) {
+      int err;
+      const char *msg = gzerror(gz_, &err);
+      int eno = err == Z_ERRNO ? errno : 0;
+      log_fatal(eno, "%s gzread at %ld error %s, drop the rest", file_.c_str(), (long) off_, msg);
+    }
+    eof_ = true;
+    return 0;
+  }
+
+private:
+  gzFile gz_;
+};
+
+#ifdef WITH_ZSTD
+class ZstdFile : public ZFile {
+public:
+  ZstdFile(const std::string &file) : ZFile(file), fd_(-1), ds_(0), inputEnd_(false), hint_(0) {
+    in_.src  = input_;
+    in_.size = 0;
+    in_.pos  = 0;
+  }
+  ~ZstdFile() { if (ds_) ZSTD_freeDStream(ds_); }
+
+  bool init(int fd) {
+    fd_ = fd;
+    ds_ = ZSTD_createDStream();
+    if (!ds_ || ZSTD_isError(ZSTD_initDStream(ds_))) {
+      log_fatal(0, "%s zstd init error", file_.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  ssize_t read(char *buffer, size_t n) {
+    if (eof_) return 0;
+
+    ZSTD_outBuffer out = { buffer, n, 0 };
+    while (true) {
+      // flush what is decoded even if no more input
+      hint_ = ZSTD_decompressStream(ds_, &out, &in_);
+      if (ZSTD_isError(hint_)) {
+        log_fatal(0, "%s zstd decompress at %ld error %s, drop the rest",
+                  file_.c_str(), (long) off_, ZSTD_getErrorName(hint_));
+        eof_ = true;
+        return 0;
+      }
+      if (out.pos > 0) break;
+      if (in_.pos < in_.size) continue;
+
+      if (inputEnd_) {
+        // hint_ != 0, the last frame is not complete
+        if (hint_ != 0) log_fatal(0, "%s zstd truncated at %ld, drop the rest", file_.c_str(), (long) off_);
+        eof_ = true;
+        return 0;
+      }
+
+      ssize_t nn = ::read(fd_, input_, sizeof(input_));
+      if (nn == -1) {
+        log_fatal(errno, "%s read error at %ld, drop the rest", file_.c_str(), (long) off_);
+        eof_ = true;
+        return 0;
+      }
+      if (nn == 0) inputEnd_ = true;
+      in_.size = nn;
+      in_.pos  = 0;
+    }
+
+    off_ += out.pos;
+    return out.pos;
+  }
+
+private:
+  int            fd_;
+  ZSTD_DStream  *ds_;
+  ZSTD_inBuffer  in_;
+  bool           inputEnd_;
+  size_t         hint_;    // 0 when a frame is completely decoded and flushed
+  char           input_[ZFILE_INPUT_LEN];
+};
+#endif
+
+ZFile *ZFile::create(int fd, Type type, const std::string &file)
+{
+  if (type == GZIP) {
+    GzipFile *gz = new GzipFile(file);
+    if (gz->init(fd)) return gz;
+    delete gz;
+  }
+#ifdef WITH_ZSTD
+  else if (type == ZSTD) {
+    ZstdFile *zst = new ZstdFile(file);
+    if (zst->init(fd)) return zst;
+    delete zst;
+  }
+#endif
+  else {
+    log_fatal(0, "%s %s is not supported, build with ZSTD=1", file.c_str(), typeToString(type));
+  }
+  return 0;
+}
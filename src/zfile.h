@@ -0,0 +1,39 @@
+#ifndef _ZFILE_H_
+#define _ZFILE_H_
+
+#include <string>
+#include <sys/types.h>
+
+/* a compressed history file read as a stream, offset counts decompressed bytes
+ * logrotate compress the rotated file, and we may still have lines of it unsent
+ */
+class ZFile {
+public:
+  enum Type { NONE, GZIP, ZSTD };
+
+  /* by magic, fd offset is not changed */
+  static Type detect(int fd);
+  static const char *typeToString(Type type);
+
+  /* fd is still owned by the caller, and must be at offset 0 */
+  static ZFile *create(int fd, Type type, const std::string &file);
+  virtual ~ZFile() {}
+
+  /* 0 at the end of stream, a corrupt stream is logged and ends there too */
+  virtual ssize_t read(char *buffer, size_t n) = 0;
+
+  /* drop decompressed bytes until off, return the offset reached */
+  off_t skip(off_t off);
+
+  off_t offset() const { return off_; }
+  bool eof() const { return eof_; }
+
+protected:
+  ZFile(const std::string &file) : file_(file), off_(0), eof_(false) {}
+
+  std::string file_;
+  off_t       off_;
+  bool        eof_;
+};
+
+#endif